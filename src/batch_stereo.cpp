@@ -0,0 +1,323 @@
+#include <frame_helper/CalibrationCv.h>
+#include "densestereo.h"
+
+#include <opencv2/opencv.hpp>
+#include <boost/lexical_cast.hpp>
+#include <base/Time.hpp>
+
+#include <dirent.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * Offline dense stereo processing of many image pairs.
+ *
+ * Images are decoded by a pool of reader threads, which prefetch into a
+ * bounded queue. A number of workers, each with its own DenseStereo
+ * instance, process the pairs in parallel, and a single writer thread
+ * stores the results. The disparity images are written as 16 bit png files
+ * with the disparity multiplied by 256, and 0 for invalid pixels.
+ */
+
+struct PairFiles
+{
+    std::string name;
+    std::string left, right;
+};
+
+struct Job
+{
+    PairFiles files;
+    cv::Mat left, right;
+};
+
+struct Result
+{
+    std::string name;
+    cv::Mat left, right;
+};
+
+/** a bounded blocking queue, which can be closed by the producers */
+template <class T>
+class BoundedQueue
+{
+public:
+    explicit BoundedQueue( size_t capacity )
+	: capacity( std::max( capacity, (size_t)1 ) ), producers( 0 ) {}
+
+    void addProducer()
+    {
+	std::lock_guard<std::mutex> lock( mutex );
+	producers++;
+    }
+
+    /** called by each producer when it is done, the queue is closed when
+     * the last producer has finished */
+    void removeProducer()
+    {
+	std::lock_guard<std::mutex> lock( mutex );
+	producers--;
+	notEmpty.notify_all();
+    }
+
+    void push( const T& item )
+    {
+	std::unique_lock<std::mutex> lock( mutex );
+	while( items.size() >= capacity )
+	    notFull.wait( lock );
+	items.push_back( item );
+	notEmpty.notify_one();
+    }
+
+    /** @result false if the queue is empty and all producers are done */
+    bool pop( T& item )
+    {
+	std::unique_lock<std::mutex> lock( mutex );
+	while( items.empty() && producers > 0 )
+	    notEmpty.wait( lock );
+	if( items.empty() )
+	    return false;
+	item = items.front();
+	items.pop_front();
+	notFull.notify_one();
+	return true;
+    }
+
+private:
+    size_t capacity;
+    size_t producers;
+    std::deque<T> items;
+    std::mutex mutex;
+    std::condition_variable notEmpty, notFull;
+};
+
+/** collect all pairs left<suffix>/right<suffix> in a directory */
+static bool listDirectory( const std::string& path, std::vector<PairFiles>& pairs )
+{
+    DIR *dir = opendir( path.c_str() );
+    if( !dir )
+	return false;
+
+    std::vector<std::string> names;
+    while( struct dirent *entry = readdir( dir ) )
+	names.push_back( entry->d_name );
+    closedir( dir );
+    std::sort( names.begin(), names.end() );
+
+    for( size_t i = 0; i < names.size(); i++ )
+    {
+	const std::string &name( names[i] );
+	if( name.compare( 0, 4, "left" ) != 0 )
+	    continue;
+	const std::string suffix = name.substr( 4 );
+	if( !std::binary_search( names.begin(), names.end(), "right" + suffix ) )
+	    continue;
+
+	PairFiles files;
+	files.left = path + "/" + name;
+	files.right = path + "/right" + suffix;
+	// strip the extension and separators for the output name
+	files.name = suffix.substr( 0, suffix.rfind( '.' ) );
+	files.name.erase( 0, files.name.find_first_not_of( "_-." ) );
+	if( files.name.empty() )
+	    files.name = "pair";
+	pairs.push_back( files );
+    }
+    return true;
+}
+
+/** read a list file with one "left right" pair of file names per line */
+static bool listFile( const std::string& path, std::vector<PairFiles>& pairs )
+{
+    std::ifstream in( path.c_str() );
+    if( !in )
+	return false;
+
+    PairFiles files;
+    while( in >> files.left >> files.right )
+    {
+	files.name = boost::lexical_cast<std::string>( pairs.size() );
+	pairs.push_back( files );
+    }
+    return true;
+}
+
+static cv::Mat toDisparityPng( const cv::Mat& disparity )
+{
+    // invalid disparities are negative and end up as 0
+    cv::Mat result;
+    disparity.convertTo( result, CV_16U, 256.0 );
+    return result;
+}
+
+static void usage()
+{
+    std::cout << "usage: batch_stereo [options] input calibration_file output_dir" << std::endl;
+    std::cout << "  input            - directory with left*/right* pairs, or a file with a 'left right' pair per line" << std::endl;
+    std::cout << "  calibration_file - stereo calibration in matlab format" << std::endl;
+    std::cout << "  output_dir       - existing directory for the <name>_ldisp.png/<name>_rdisp.png results" << std::endl;
+    std::cout << "options:" << std::endl;
+    std::cout << "  -w <n>           - number of dense stereo workers (default: number of cores)" << std::endl;
+    std::cout << "  -r <n>           - number of image readers (default: 2)" << std::endl;
+    std::cout << "  -q <n>           - prefetch queue length (default: 2 * workers)" << std::endl;
+    std::cout << "  -g <n>           - gaussian kernel size for preprocessing (default: 0)" << std::endl;
+    std::cout << "  --rectified      - input images are already rectified" << std::endl;
+}
+
+int main( int argc, char* argv[] )
+{
+    size_t workers = std::max( 1u, std::thread::hardware_concurrency() );
+    size_t readers = 2;
+    size_t queueLength = 0;
+    int gaussian_kernel = 0;
+    bool isRectified = false;
+
+    std::vector<std::string> args;
+    for( int i = 1; i < argc; i++ )
+    {
+	const std::string arg = argv[i];
+	if( arg == "-h" || arg == "--help" )
+	{
+	    usage();
+	    return 0;
+	}
+	else if( arg == "--rectified" )
+	    isRectified = true;
+	else if( ( arg == "-w" || arg == "-r" || arg == "-q" || arg == "-g" ) && i + 1 < argc )
+	{
+	    const int value = boost::lexical_cast<int>( argv[++i] );
+	    if( arg == "-w" ) workers = std::max( value, 1 );
+	    else if( arg == "-r" ) readers = std::max( value, 1 );
+	    else if( arg == "-q" ) queueLength = std::max( value, 1 );
+	    else gaussian_kernel = value;
+	}
+	else
+	    args.push_back( arg );
+    }
+
+    if( args.size() != 3 )
+    {
+	usage();
+	return 1;
+    }
+
+    const std::string input = args[0], calibFile = args[1], outputDir = args[2];
+    if( queueLength == 0 )
+	queueLength = 2 * workers;
+
+    std::vector<PairFiles> pairs;
+    if( !listDirectory( input, pairs ) && !listFile( input, pairs ) )
+    {
+	std::cerr << "could not read input " << input << std::endl;
+	return 1;
+    }
+    if( pairs.empty() )
+    {
+	std::cerr << "no image pairs found in " << input << std::endl;
+	return 1;
+    }
+
+    BoundedQueue<Job> jobs( queueLength );
+    BoundedQueue<Result> results( queueLength );
+    std::atomic<size_t> nextPair( 0 );
+    std::atomic<size_t> processed( 0 ), failed( 0 );
+
+    const base::Time start = base::Time::now();
+
+    // readers decode the images ahead of the workers
+    std::vector<std::thread> threads;
+    for( size_t i = 0; i < readers; i++ )
+	jobs.addProducer();
+    for( size_t i = 0; i < readers; i++ )
+    {
+	threads.push_back( std::thread( [&]() {
+	    for( size_t idx = nextPair++; idx < pairs.size(); idx = nextPair++ )
+	    {
+		Job job;
+		job.files = pairs[idx];
+		job.left = cv::imread( job.files.left );
+		job.right = cv::imread( job.files.right );
+		if( !job.left.data || !job.right.data || job.left.size() != job.right.size() )
+		{
+		    std::cerr << "skipping " << job.files.left << " " << job.files.right
+			<< ": images can not be read or differ in size" << std::endl;
+		    failed++;
+		    continue;
+		}
+		jobs.push( job );
+	    }
+	    jobs.removeProducer();
+	} ) );
+    }
+
+    // each worker has its own dense stereo instance, which is initialized
+    // for the image size of the first pair it gets
+    for( size_t i = 0; i < workers; i++ )
+	results.addProducer();
+    for( size_t i = 0; i < workers; i++ )
+    {
+	threads.push_back( std::thread( [&]() {
+	    stereo::DenseStereo dense;
+	    dense.setGaussianKernel( gaussian_kernel );
+	    cv::Size size;
+	    Job job;
+	    while( jobs.pop( job ) )
+	    {
+		try
+		{
+		    if( job.left.size() != size )
+		    {
+			size = job.left.size();
+			dense.setStereoCalibration(
+				frame_helper::StereoCalibration::fromMatlabFile( calibFile, size.width, size.height ),
+				size.width, size.height );
+		    }
+
+		    Result result;
+		    result.name = job.files.name;
+		    dense.processFramePair( job.left, job.right, result.left, result.right, isRectified );
+		    results.push( result );
+		}
+		catch( const std::exception& e )
+		{
+		    std::cerr << "processing " << job.files.name << " failed: " << e.what() << std::endl;
+		    failed++;
+		}
+	    }
+	    results.removeProducer();
+	} ) );
+    }
+
+    // asynchronous writer
+    threads.push_back( std::thread( [&]() {
+	Result result;
+	while( results.pop( result ) )
+	{
+	    cv::imwrite( outputDir + "/" + result.name + "_ldisp.png", toDisparityPng( result.left ) );
+	    cv::imwrite( outputDir + "/" + result.name + "_rdisp.png", toDisparityPng( result.right ) );
+	    processed++;
+	}
+    } ) );
+
+    for( size_t i = 0; i < threads.size(); i++ )
+	threads[i].join();
+
+    const double elapsed = ( base::Time::now() - start ).toSeconds();
+    const size_t numProcessed = processed.load(), numFailed = failed.load();
+    std::cout << "processed " << numProcessed << " of " << pairs.size() << " pairs";
+    if( numFailed )
+	std::cout << " (" << numFailed << " failed)";
+    std::cout << " in " << elapsed << "s, "
+	<< ( elapsed > 0 ? numProcessed / elapsed : 0 ) << " frames per second"
+	<< " with " << workers << " workers" << std::endl;
+
+    return numFailed ? 1 : 0;
+}
@@ -0,0 +1,247 @@
+#include <frame_helper/CalibrationCv.h>
+#include "densestereo.h"
+#include "configuration.h"
+
+#include <opencv2/opencv.hpp>
+#include <boost/lexical_cast.hpp>
+#include <base/Time.hpp>
+
+#include <sys/resource.h>
+#include <algorithm>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+/**
+ * End-to-end benchmark for the dense stereo pipeline.
+ *
+ * The test pairs are rectified once at their native resolution and then
+ * scaled to each benchmark resolution, together with the intrinsics of
+ * their calibration, so the timings cover grayscale conversion, libelas and
+ * the disparity to distance conversion, but not the rectification. The results are written as a single JSON document to
+ * stdout, progress goes to stderr.
+ */
+
+struct Resolution
+{
+    const char *name;
+    int width;
+    int height;
+};
+
+struct Preset
+{
+    std::string name;
+    stereo::libElasConfiguration config;
+};
+
+struct TestPair
+{
+    std::string name;
+    cv::Mat left, right;
+    /// calibration for the native size of the images
+    frame_helper::StereoCalibration calib;
+};
+
+static std::vector<Preset> getPresets()
+{
+    std::vector<Preset> presets;
+
+    // the defaults of libElasConfiguration are the libelas ROBOTICS settings
+    Preset robotics;
+    robotics.name = "robotics";
+    presets.push_back( robotics );
+
+    Preset middlebury;
+    middlebury.name = "middlebury";
+    Elas::parameters params( Elas::MIDDLEBURY );
+    stereo::copyFromElas( &params, &middlebury.config );
+    presets.push_back( middlebury );
+
+    // cheap settings, trading density for speed
+    Preset fast;
+    fast.name = "fast";
+    fast.config.candidate_stepsize *= 2;
+    fast.config.postprocess_only_left = true;
+    fast.config.filter_median = false;
+    fast.config.filter_adaptive_mean = false;
+    presets.push_back( fast );
+
+    return presets;
+}
+
+static bool loadTestPair( const std::string& prefix, const std::string& name, TestPair& pair )
+{
+    cv::Mat cleft = cv::imread( prefix + "left" + name + ".png" );
+    cv::Mat cright = cv::imread( prefix + "right" + name + ".png" );
+    if( !cleft.data || !cright.data || cleft.size() != cright.size() )
+	return false;
+
+    pair.name = "pair" + name;
+    pair.calib = frame_helper::StereoCalibration::fromMatlabFile(
+	    prefix + "calib" + name + ".txt", cleft.size().width, cleft.size().height );
+
+    frame_helper::StereoCalibrationCv calib;
+    calib.setCalibration( pair.calib );
+    calib.setImageSize( cleft.size() );
+    calib.initCv();
+
+    calib.camLeft.undistortAndRectify( cleft, pair.left );
+    calib.camRight.undistortAndRectify( cright, pair.right );
+
+    return true;
+}
+
+/** scale the intrinsics of a camera for images resized by sx and sy, the
+ * pixel centers stay aligned as in cv::resize */
+static void scaleCamera( frame_helper::CameraCalibration& cam, double sx, double sy )
+{
+    cam.fx *= sx;
+    cam.fy *= sy;
+    cam.cx = ( cam.cx + 0.5 ) * sx - 0.5;
+    cam.cy = ( cam.cy + 0.5 ) * sy - 0.5;
+}
+
+/** @result the calibration of the pair for its images resized to size. The
+ * baseline stays the same, the disparity to distance conversion changes
+ * with fx. */
+static frame_helper::StereoCalibration scaleCalibration( const TestPair& pair, const cv::Size& size )
+{
+    const double sx = (double)size.width / pair.left.cols;
+    const double sy = (double)size.height / pair.left.rows;
+    frame_helper::StereoCalibration calib( pair.calib );
+    scaleCamera( calib.camLeft, sx, sy );
+    scaleCamera( calib.camRight, sx, sy );
+    return calib;
+}
+
+static long getPeakRssKb()
+{
+    struct rusage usage;
+    if( getrusage( RUSAGE_SELF, &usage ) != 0 )
+	return -1;
+    // ru_maxrss is given in kilobytes on linux
+    return usage.ru_maxrss;
+}
+
+static double percentile( const std::vector<double>& sorted, double p )
+{
+    if( sorted.empty() )
+	return 0;
+    const size_t idx = std::min( sorted.size() - 1, (size_t)( p * ( sorted.size() - 1 ) + 0.5 ) );
+    return sorted[idx];
+}
+
+int main( int argc, char* argv[] )
+{
+    if( argc > 1 && ( std::string( argv[1] ) == "-h" || std::string( argv[1] ) == "--help" ) )
+    {
+	std::cout << "usage: benchmark_dense <test_prefix> <iterations> <warmup>" << std::endl;
+	std::cout << "  test_prefix - directory containing left/right/calib test files (default: test/)" << std::endl;
+	std::cout << "  iterations  - measured iterations per run (default: 20)" << std::endl;
+	std::cout << "  warmup      - unmeasured iterations per run (default: 3)" << std::endl;
+	exit(0);
+    }
+
+    const std::string prefix = argc > 1 ? argv[1] : "test/";
+    const int iterations = argc > 2 ? boost::lexical_cast<int>( argv[2] ) : 20;
+    const int warmup = argc > 3 ? boost::lexical_cast<int>( argv[3] ) : 3;
+
+    std::vector<TestPair> pairs;
+    const char *pair_names[] = { "", "1" };
+    for( size_t i = 0; i < sizeof( pair_names ) / sizeof( pair_names[0] ); i++ )
+    {
+	TestPair pair;
+	if( loadTestPair( prefix, pair_names[i], pair ) )
+	    pairs.push_back( pair );
+	else
+	    std::cerr << "skipping test pair '" << pair_names[i] << "', could not be loaded" << std::endl;
+    }
+
+    if( pairs.empty() )
+    {
+	std::cerr << "no test pairs found in " << prefix << std::endl;
+	return 1;
+    }
+
+    const Resolution resolutions[] = {
+	{ "vga", 640, 480 },
+	{ "720p", 1280, 720 },
+	{ "1080p", 1920, 1080 } };
+    const std::vector<Preset> presets = getPresets();
+
+    std::ostringstream json;
+    json << "{\n  \"iterations\": " << iterations << ",\n  \"warmup\": " << warmup << ",\n  \"runs\": [";
+    bool first = true;
+
+    for( size_t p = 0; p < pairs.size(); p++ )
+    {
+	for( size_t r = 0; r < sizeof( resolutions ) / sizeof( resolutions[0] ); r++ )
+	{
+	    const Resolution &res( resolutions[r] );
+	    const cv::Size size( res.width, res.height );
+
+	    cv::Mat left, right;
+	    cv::resize( pairs[p].left, left, size, 0, 0, cv::INTER_AREA );
+	    cv::resize( pairs[p].right, right, size, 0, 0, cv::INTER_AREA );
+	    const frame_helper::StereoCalibration calib = scaleCalibration( pairs[p], size );
+
+	    for( size_t c = 0; c < presets.size(); c++ )
+	    {
+		std::cerr << "running " << pairs[p].name << " " << res.name << " " << presets[c].name << std::endl;
+
+		stereo::DenseStereo dense;
+		dense.setStereoCalibration( calib, res.width, res.height );
+		dense.setLibElasConfiguration( presets[c].config );
+
+		cv::Mat ldist, rdist;
+		for( int i = 0; i < warmup; i++ )
+		    dense.getDistanceImages( left, right, ldist, rdist, true );
+
+		std::vector<double> latencies;
+		latencies.reserve( iterations );
+		const base::Time start = base::Time::now();
+		for( int i = 0; i < iterations; i++ )
+		{
+		    const base::Time frame_start = base::Time::now();
+		    dense.getDistanceImages( left, right, ldist, rdist, true );
+		    latencies.push_back( ( base::Time::now() - frame_start ).toSeconds() * 1e3 );
+		}
+		const double total = ( base::Time::now() - start ).toSeconds();
+
+		std::vector<double> sorted( latencies );
+		std::sort( sorted.begin(), sorted.end() );
+		double mean = 0;
+		for( size_t i = 0; i < sorted.size(); i++ )
+		    mean += sorted[i];
+		if( !sorted.empty() )
+		    mean /= sorted.size();
+
+		json << ( first ? "\n" : ",\n" );
+		first = false;
+		json << "    {\"pair\": \"" << pairs[p].name << "\""
+		     << ", \"resolution\": \"" << res.name << "\""
+		     << ", \"width\": " << res.width
+		     << ", \"height\": " << res.height
+		     << ", \"preset\": \"" << presets[c].name << "\""
+		     << ", \"fps\": " << ( total > 0 ? iterations / total : 0 )
+		     << ", \"megapixels_per_second\": " << ( total > 0 ? iterations * res.width * res.height / total * 1e-6 : 0 )
+		     << ", \"latency_ms\": {"
+		     << "\"mean\": " << mean
+		     << ", \"min\": " << percentile( sorted, 0.0 )
+		     << ", \"p50\": " << percentile( sorted, 0.5 )
+		     << ", \"p90\": " << percentile( sorted, 0.9 )
+		     << ", \"p99\": " << percentile( sorted, 0.99 )
+		     << ", \"max\": " << percentile( sorted, 1.0 ) << "}"
+		     // the peak rss is process wide, so it is monotonic over the runs
+		     << ", \"peak_rss_kb\": " << getPeakRssKb() << "}";
+	    }
+	}
+    }
+
+    json << "\n  ],\n  \"peak_rss_kb\": " << getPeakRssKb() << "\n}\n";
+    std::cout << json.str();
+
+    return 0;
+}
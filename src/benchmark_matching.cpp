@@ -0,0 +1,160 @@
+#include "sparse_stereo.hpp"
+
+#include <opencv2/opencv.hpp>
+#include <boost/lexical_cast.hpp>
+#include <base/Time.hpp>
+
+#include <stdlib.h>
+#include <atomic>
+#include <iostream>
+#include <new>
+#include <sstream>
+#include <string>
+#include <vector>
+
+/**
+ * Microbenchmark for the cross check matching of the sparse stereo.
+ *
+ * Synthetic descriptor sets of typical sizes are matched with the different
+ * matcher paths of StereoFeatures::crossCheckMatching. Besides the time per
+ * call, the number of heap allocations per call is counted with a replaced
+ * global operator new, which shows whether the match buffers are reused
+ * across frames. The results are written as JSON to stdout.
+ */
+
+static std::atomic<size_t> allocations( 0 );
+
+void* operator new( size_t size )
+{
+    allocations++;
+    void *p = malloc( size ? size : 1 );
+    if( !p )
+	throw std::bad_alloc();
+    return p;
+}
+
+void* operator new[]( size_t size )
+{
+    return operator new( size );
+}
+
+void operator delete( void *p ) noexcept
+{
+    free( p );
+}
+
+void operator delete[]( void *p ) noexcept
+{
+    free( p );
+}
+
+struct Variant
+{
+    const char *name;
+    stereo::DESCRIPTOR descriptorType;
+    int bruteForceMatchLimit;
+    bool multiIndexHashing;
+};
+
+/** two descriptor sets, where the first half of the second set are noisy
+ * copies of the first set, and the rest is random */
+static void createDescriptors( int n, bool binary, cv::Mat& d1, cv::Mat& d2 )
+{
+    cv::RNG rng( n );
+    if( binary )
+    {
+	d1.create( n, 32, CV_8U );
+	d2.create( n, 32, CV_8U );
+	rng.fill( d1, cv::RNG::UNIFORM, 0, 256 );
+	rng.fill( d2, cv::RNG::UNIFORM, 0, 256 );
+	for( int i = 0; i < n / 2; i++ )
+	{
+	    d1.row( i ).copyTo( d2.row( i ) );
+	    // flip a few bits
+	    for( int b = 0; b < 8; b++ )
+		d2.at<uchar>( i, rng.uniform( 0, 32 ) ) ^= 1 << rng.uniform( 0, 8 );
+	}
+    }
+    else
+    {
+	d1.create( n, 64, CV_32F );
+	d2.create( n, 64, CV_32F );
+	rng.fill( d1, cv::RNG::UNIFORM, -0.2, 0.2 );
+	rng.fill( d2, cv::RNG::UNIFORM, -0.2, 0.2 );
+	cv::Mat noise( 1, 64, CV_32F );
+	for( int i = 0; i < n / 2; i++ )
+	{
+	    rng.fill( noise, cv::RNG::NORMAL, 0, 0.01 );
+	    cv::Mat row = d2.row( i );
+	    cv::add( d1.row( i ), noise, row );
+	}
+    }
+}
+
+int main( int argc, char* argv[] )
+{
+    if( argc > 1 && std::string( argv[1] ) == "-h" )
+    {
+	std::cout << "usage: benchmark_matching <iterations> <warmup>" << std::endl;
+	std::cout << "  iterations  - measured calls per run (default: 50)" << std::endl;
+	std::cout << "  warmup      - unmeasured calls per run (default: 5)" << std::endl;
+	return 0;
+    }
+    const int iterations = argc > 1 ? boost::lexical_cast<int>( argv[1] ) : 50;
+    const int warmup = argc > 2 ? boost::lexical_cast<int>( argv[2] ) : 5;
+
+    const Variant variants[] = {
+	{ "flann", stereo::DESCRIPTOR_SURF, 0, false },
+	{ "brute_force_l2", stereo::DESCRIPTOR_SURF, 100000000, false },
+	{ "hamming_brute_force", stereo::DESCRIPTOR_ORB, 100000000, false },
+	{ "hamming_multi_index", stereo::DESCRIPTOR_ORB, 0, true },
+    };
+    const int sizes[] = { 100, 300, 1000 };
+
+    std::ostringstream json;
+    json << "{\n  \"iterations\": " << iterations << ",\n  \"warmup\": " << warmup << ",\n  \"runs\": [";
+    bool first = true;
+
+    for( size_t v = 0; v < sizeof( variants ) / sizeof( variants[0] ); v++ )
+    {
+	const Variant &variant( variants[v] );
+	stereo::FeatureConfiguration config;
+	config.descriptorType = variant.descriptorType;
+	config.bruteForceMatchLimit = variant.bruteForceMatchLimit;
+	config.multiIndexHashing = variant.multiIndexHashing;
+	config.knn = 2;
+
+	stereo::StereoFeatures features;
+	features.setConfiguration( config );
+
+	for( size_t s = 0; s < sizeof( sizes ) / sizeof( sizes[0] ); s++ )
+	{
+	    cv::Mat d1, d2;
+	    createDescriptors( sizes[s], stereo::isBinaryDescriptor( variant.descriptorType ), d1, d2 );
+
+	    std::cerr << variant.name << " " << sizes[s] << std::endl;
+	    std::vector<cv::DMatch> matches;
+	    for( int i = 0; i < warmup; i++ )
+		features.crossCheckMatching( d1, d2, matches, config.knn, 1.5 );
+
+	    const size_t allocationsBefore = allocations;
+	    const base::Time start = base::Time::now();
+	    for( int i = 0; i < iterations; i++ )
+		features.crossCheckMatching( d1, d2, matches, config.knn, 1.5 );
+	    const double elapsed = ( base::Time::now() - start ).toSeconds();
+	    const size_t numAllocations = allocations - allocationsBefore;
+
+	    json << ( first ? "\n" : ",\n" );
+	    first = false;
+	    json << "    {\"matcher\": \"" << variant.name << "\""
+		<< ", \"features\": " << sizes[s]
+		<< ", \"matches\": " << matches.size()
+		<< ", \"time_us\": " << elapsed / iterations * 1e6
+		<< ", \"allocations_per_call\": " << (double)numAllocations / iterations << "}";
+	}
+    }
+
+    json << "\n  ],\n  \"l2_kernel\": \"" << stereo::BruteForceMatcher::getImplementation() << "\"\n}\n";
+    std::cout << json.str();
+    return 0;
+}
@@ -0,0 +1,212 @@
+#include "ransac.hpp"
+
+#include <boost/lexical_cast.hpp>
+#include <base/Time.hpp>
+
+#include <algorithm>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+/**
+ * Microbenchmark for the sampling and evaluation strategies of the ransac
+ * of the isometry filter.
+ *
+ * Synthetic 3d correspondences with a known isometry and different outlier
+ * ratios are given a match quality, which is better for the inliers on
+ * average, like the descriptor distance of real matches. For every variant,
+ * the number of hypotheses, the number of sample tests and the time per
+ * call are measured, together with the hypothesis at which the final model
+ * was found and the overlap of the resulting inlier set with the true
+ * inliers. Additionally, the time to fit a hypothesis to a sample of only
+ * inliers, and the time per sample to score a hypothesis with testSample and
+ * with the batch testSamples are measured. The results are written as JSON
+ * to stdout.
+ */
+
+using namespace stereo::ransac;
+
+struct Variant
+{
+    const char *name;
+    bool prosac;
+    bool sprt;
+};
+
+struct Scene
+{
+    std::vector<Eigen::Vector3d> x, p;
+    std::vector<bool> inlier;
+    /// sample indices sorted by match quality
+    vector_size_t order;
+};
+
+static void createScene( size_t n, double inlierRatio, Scene& scene )
+{
+    std::mt19937 rng( n * 1000 + inlierRatio * 100 );
+    std::uniform_real_distribution<double> pos( -10.0, 10.0 ), depth( 2.0, 30.0 ), unit( 0.0, 1.0 );
+    std::normal_distribution<double> noise( 0, 0.02 ), quality( 0.1, 0.05 );
+
+    Eigen::Affine3d transform( Eigen::AngleAxisd( 0.1, Eigen::Vector3d( 0.2, 1.0, 0.1 ).normalized() ) );
+    transform.translation() = Eigen::Vector3d( 0.3, 0.05, 1.0 );
+
+    std::vector<double> distance( n );
+    for( size_t i = 0; i < n; i++ )
+    {
+	const Eigen::Vector3d v( pos( rng ), pos( rng ), depth( rng ) );
+	const bool inlier = unit( rng ) < inlierRatio;
+	scene.p.push_back( v );
+	scene.inlier.push_back( inlier );
+	if( inlier )
+	{
+	    scene.x.push_back( transform * v + Eigen::Vector3d( noise( rng ), noise( rng ), noise( rng ) ) );
+	    distance[i] = std::abs( quality( rng ) );
+	}
+	else
+	{
+	    scene.x.push_back( Eigen::Vector3d( pos( rng ), pos( rng ), depth( rng ) ) );
+	    distance[i] = 0.05 + 0.45 * unit( rng );
+	}
+    }
+
+    scene.order.resize( n );
+    for( size_t i = 0; i < n; i++ )
+	scene.order[i] = i;
+    std::stable_sort( scene.order.begin(), scene.order.end(),
+	    [&]( size_t a, size_t b ) { return distance[a] < distance[b]; } );
+}
+
+/** @result the jaccard index of the inliers with the true inliers */
+static double overlap( const Scene& scene, const vector_size_t& inliers )
+{
+    size_t common = 0, truth = 0;
+    for( size_t i = 0; i < inliers.size(); i++ )
+	common += scene.inlier[inliers[i]];
+    for( size_t i = 0; i < scene.inlier.size(); i++ )
+	truth += scene.inlier[i];
+    return static_cast<double>( common ) / ( truth + inliers.size() - common );
+}
+
+int main( int argc, char* argv[] )
+{
+    if( argc > 1 && std::string( argv[1] ) == "-h" )
+    {
+	std::cout << "usage: benchmark_ransac <runs> <max_steps>" << std::endl;
+	std::cout << "  runs       - ransac runs with different seeds per scene (default: 200)" << std::endl;
+	std::cout << "  max_steps  - hard iteration limit (default: 1000)" << std::endl;
+	return 0;
+    }
+    const int runs = argc > 1 ? boost::lexical_cast<int>( argv[1] ) : 200;
+    const size_t maxSteps = argc > 2 ? boost::lexical_cast<size_t>( argv[2] ) : 1000;
+
+    const Variant variants[] = {
+	{ "uniform", false, false },
+	{ "prosac", true, false },
+	{ "sprt", false, true },
+	{ "prosac_sprt", true, true },
+    };
+    const double inlierRatios[] = { 0.5, 0.4, 0.3 };
+    const size_t numSamples = 300;
+    const double threshold = 0.1;
+
+    std::ostringstream json;
+    json << "{\n  \"runs\": " << runs << ",\n  \"max_steps\": " << maxSteps
+	<< ",\n  \"samples\": " << numSamples << ",\n  \"results\": [";
+    bool first = true;
+
+    for( size_t r = 0; r < sizeof( inlierRatios ) / sizeof( inlierRatios[0] ); r++ )
+    {
+	Scene scene;
+	createScene( numSamples, inlierRatios[r], scene );
+	FitTransform fit( scene.x, scene.p, threshold );
+
+	for( size_t v = 0; v < sizeof( variants ) / sizeof( variants[0] ); v++ )
+	{
+	    const Variant &variant( variants[v] );
+	    std::cerr << variant.name << " " << inlierRatios[r] << std::endl;
+
+	    RansacOptions options;
+	    options.sprt = variant.sprt;
+	    if( variant.prosac )
+		options.prosacOrder = scene.order;
+
+	    size_t samples = 0, iterations = 0, bestIterations = 0, rejected = 0, tests = 0, successes = 0;
+	    double sumOverlap = 0;
+	    const base::Time start = base::Time::now();
+	    for( int i = 0; i < runs; i++ )
+	    {
+		options.seed = i;
+		Eigen::Affine3d model;
+		vector_size_t inliers;
+		RansacStatistics statistics;
+		ransacModel( fit, 3, threshold, model, inliers, options, maxSteps, &statistics );
+
+		samples += statistics.samples;
+		iterations += statistics.iterations;
+		bestIterations += statistics.bestIteration;
+		rejected += statistics.rejected;
+		tests += statistics.tests;
+		const double o = overlap( scene, inliers );
+		sumOverlap += o;
+		successes += o >= 0.95;
+	    }
+	    const double elapsed = ( base::Time::now() - start ).toSeconds();
+
+	    json << ( first ? "\n" : ",\n" );
+	    first = false;
+	    json << "    {\"variant\": \"" << variant.name << "\""
+		<< ", \"inlier_ratio\": " << inlierRatios[r]
+		<< ", \"samples\": " << (double)samples / runs
+		<< ", \"iterations\": " << (double)iterations / runs
+		<< ", \"best_iteration\": " << (double)bestIterations / runs
+		<< ", \"rejected\": " << (double)rejected / runs
+		<< ", \"tests\": " << (double)tests / runs
+		<< ", \"time_us\": " << elapsed / runs * 1e6
+		<< ", \"overlap\": " << sumOverlap / runs
+		<< ", \"success_rate\": " << (double)successes / runs << "}";
+	}
+    }
+
+    // time of a single hypothesis, independent of the sampling
+    Scene scene;
+    createScene( numSamples, 1.0, scene );
+    FitTransform fit( scene.x, scene.p, threshold );
+    const int fits = 100000;
+    FastRandom rng;
+    vector_size_t ind;
+    Eigen::Affine3d model;
+    size_t accepted = 0;
+    const base::Time start = base::Time::now();
+    for( int i = 0; i < fits; i++ )
+    {
+	pickRandomIndex( numSamples, (size_t)3, ind, rng );
+	accepted += fit.fitModel( ind, model );
+    }
+    const double elapsed = ( base::Time::now() - start ).toSeconds();
+
+    // time to score a model against all samples, one by one and in a batch
+    const int scorings = 10000;
+    vector_mask_t mask( numSamples );
+    size_t inliers = 0;
+    const base::Time startSingle = base::Time::now();
+    for( int i = 0; i < scorings; i++ )
+	for( size_t j = 0; j < numSamples; j++ )
+	    inliers += fit.testSample( j, model ) < threshold;
+    const double elapsedSingle = ( base::Time::now() - startSingle ).toSeconds();
+    const base::Time startBatch = base::Time::now();
+    for( int i = 0; i < scorings; i++ )
+	inliers += fit.testSamples( model, threshold, mask );
+    const double elapsedBatch = ( base::Time::now() - startBatch ).toSeconds();
+
+    json << "\n  ],\n  \"fit_model_ns\": " << elapsed / fits * 1e9
+	<< ",\n  \"fit_model_accepted\": " << (double)accepted / fits 
+	<< ",\n  \"test_sample_ns\": " << elapsedSingle / scorings / numSamples * 1e9
+	<< ",\n  \"test_samples_ns\": " << elapsedBatch / scorings / numSamples * 1e9
+	<< ",\n  \"score_kernel\": \"" << getScoreImplementation() << "\""
+	// the inlier count keeps the scoring loops from being optimized away
+	<< ",\n  \"checksum\": " << inliers << "\n}\n";
+    std::cout << json.str();
+    return 0;
+}
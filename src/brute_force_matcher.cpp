@@ -0,0 +1,241 @@
+#include "brute_force_matcher.hpp"
+#include "cpu_dispatch.hpp"
+#include "hamming.hpp"
+#include "thread_pool.hpp"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+
+using namespace stereo;
+
+namespace
+{
+    /// number of train descriptors, which are compared with a query at once
+    const int TRAIN_LANES = 4;
+    /// number of train descriptors per cache block (32kB for 128 floats)
+    const int TRAIN_BLOCK = 64;
+    /// number of query descriptors per task
+    const int QUERY_BLOCK = 32;
+
+    /** squared distances of the query q to the train descriptors t[0..3] */
+    typedef void (*DistanceFunction)( const float *q, const float * const *t, int dims, float *result );
+
+    void distancesScalar( const float *q, const float * const *t, int dims, float *result )
+    {
+	for( int l = 0; l < TRAIN_LANES; l++ )
+	{
+	    float sum = 0;
+	    for( int k = 0; k < dims; k++ )
+	    {
+		const float diff = q[k] - t[l][k];
+		sum += diff * diff;
+	    }
+	    result[l] = sum;
+	}
+    }
+
+#ifdef STEREO_X86
+    __attribute__((target("avx,fma")))
+    inline float horizontalSum( __m256 v )
+    {
+	const __m128 s = _mm_add_ps( _mm256_castps256_ps128( v ), _mm256_extractf128_ps( v, 1 ) );
+	const __m128 h = _mm_add_ps( s, _mm_movehl_ps( s, s ) );
+	return _mm_cvtss_f32( _mm_add_ss( h, _mm_shuffle_ps( h, h, 1 ) ) );
+    }
+
+    __attribute__((target("avx,fma")))
+    void distancesAvxFma( const float *q, const float * const *t, int dims, float *result )
+    {
+	// the query is loaded once for four train descriptors
+	__m256 sum0 = _mm256_setzero_ps(), sum1 = _mm256_setzero_ps();
+	__m256 sum2 = _mm256_setzero_ps(), sum3 = _mm256_setzero_ps();
+	int k = 0;
+	for( ; k + 8 <= dims; k += 8 )
+	{
+	    const __m256 vq = _mm256_loadu_ps( q + k );
+	    const __m256 d0 = _mm256_sub_ps( vq, _mm256_loadu_ps( t[0] + k ) );
+	    const __m256 d1 = _mm256_sub_ps( vq, _mm256_loadu_ps( t[1] + k ) );
+	    const __m256 d2 = _mm256_sub_ps( vq, _mm256_loadu_ps( t[2] + k ) );
+	    const __m256 d3 = _mm256_sub_ps( vq, _mm256_loadu_ps( t[3] + k ) );
+	    sum0 = _mm256_fmadd_ps( d0, d0, sum0 );
+	    sum1 = _mm256_fmadd_ps( d1, d1, sum1 );
+	    sum2 = _mm256_fmadd_ps( d2, d2, sum2 );
+	    sum3 = _mm256_fmadd_ps( d3, d3, sum3 );
+	}
+	result[0] = horizontalSum( sum0 );
+	result[1] = horizontalSum( sum1 );
+	result[2] = horizontalSum( sum2 );
+	result[3] = horizontalSum( sum3 );
+
+	for( ; k < dims; k++ )
+	{
+	    for( int l = 0; l < TRAIN_LANES; l++ )
+	    {
+		const float diff = q[k] - t[l][k];
+		result[l] += diff * diff;
+	    }
+	}
+    }
+#endif
+
+    const CpuImplementation<DistanceFunction>& getDistanceImplementation()
+    {
+	static const CpuImplementation<DistanceFunction> implementations[] = {
+#ifdef STEREO_X86
+	    { &distancesAvxFma, "avx_fma", CPU_AVX | CPU_FMA },
+#endif
+	    { &distancesScalar, "scalar", 0 } };
+	static const CpuImplementation<DistanceFunction> &implementation = selectCpuImplementation( implementations );
+	return implementation;
+    }
+
+    inline void update( float distance, int index, float& first, float& second, int& firstIndex, int& secondIndex )
+    {
+	if( distance < first )
+	{
+	    second = first;
+	    secondIndex = firstIndex;
+	    first = distance;
+	    firstIndex = index;
+	}
+	else if( distance < second )
+	{
+	    second = distance;
+	    secondIndex = index;
+	}
+    }
+
+    inline void pushBest( KnnMatches& matches, int query, float first, float second,
+	    int firstIndex, int secondIndex, bool squared )
+    {
+	if( firstIndex >= 0 )
+	    matches.push( query, firstIndex, squared ? std::sqrt( first ) : first );
+	if( secondIndex >= 0 )
+	    matches.push( query, secondIndex, squared ? std::sqrt( second ) : second );
+    }
+}
+
+BruteForceMatcher::BruteForceMatcher()
+{
+}
+
+const char* BruteForceMatcher::getImplementation()
+{
+    return getDistanceImplementation().name;
+}
+
+void BruteForceMatcher::computeRows( const cv::Mat& descriptors1, const cv::Mat& descriptors2, int begin, int end, KnnMatches& matches12 )
+{
+    const DistanceFunction distanceFunction = getDistanceImplementation().function;
+    const bool binary = descriptors1.type() == CV_8U;
+    const int dims = descriptors1.cols;
+    const int n2 = descriptors2.rows;
+    const float inf = std::numeric_limits<float>::infinity();
+
+    // called for at most QUERY_BLOCK rows
+    Best rowBest[QUERY_BLOCK];
+    for( int i = begin; i < end; i++ )
+    {
+	Best none = { inf, inf, -1, -1 };
+	rowBest[i - begin] = none;
+    }
+
+    // block over the train descriptors, so they stay in the cache for all
+    // queries of this block of rows
+    for( int jb = 0; jb < n2; jb += TRAIN_BLOCK )
+    {
+	const int jend = std::min( jb + TRAIN_BLOCK, n2 );
+	for( int i = begin; i < end; i++ )
+	{
+	    float *row = &distances[(size_t)i * n2];
+	    Best &best( rowBest[i - begin] );
+
+	    if( binary )
+	    {
+		const unsigned char *q = descriptors1.ptr<unsigned char>( i );
+		for( int j = jb; j < jend; j++ )
+		{
+		    row[j] = hammingDistance( q, descriptors2.ptr<unsigned char>( j ), dims );
+		    update( row[j], j, best.first, best.second, best.firstIndex, best.secondIndex );
+		}
+		continue;
+	    }
+
+	    const float *q = descriptors1.ptr<float>( i );
+	    for( int j = jb; j < jend; j += TRAIN_LANES )
+	    {
+		// the last group is padded with the last descriptor
+		const float *t[TRAIN_LANES];
+		for( int l = 0; l < TRAIN_LANES; l++ )
+		    t[l] = descriptors2.ptr<float>( std::min( j + l, jend - 1 ) );
+
+		float result[TRAIN_LANES];
+		distanceFunction( q, t, dims, result );
+
+		for( int l = 0; l < TRAIN_LANES && j + l < jend; l++ )
+		{
+		    row[j + l] = result[l];
+		    update( result[l], j + l, best.first, best.second, best.firstIndex, best.secondIndex );
+		}
+	    }
+	}
+    }
+
+    for( int i = begin; i < end; i++ )
+    {
+	const Best &best( rowBest[i - begin] );
+	pushBest( matches12, i, best.first, best.second, best.firstIndex, best.secondIndex, !binary );
+    }
+}
+
+void BruteForceMatcher::knnMatch( const cv::Mat& descriptors1, const cv::Mat& descriptors2,
+	KnnMatches& matches12, KnnMatches& matches21, ThreadPool *pool )
+{
+    matches12.resize( descriptors1.rows, 2 );
+    matches21.resize( descriptors2.rows, 2 );
+    if( descriptors1.empty() || descriptors2.empty() )
+	return;
+    if( descriptors1.type() != descriptors2.type() || descriptors1.cols != descriptors2.cols ||
+	    ( descriptors1.type() != CV_32F && descriptors1.type() != CV_8U ) )
+	throw std::runtime_error( "BruteForceMatcher: descriptors need to be float or binary and of the same size" );
+
+    const int n1 = descriptors1.rows, n2 = descriptors2.rows;
+    distances.resize( (size_t)n1 * n2 );
+
+    if( pool && n1 > QUERY_BLOCK )
+    {
+	TaskGroup tasks( *pool );
+	for( int begin = 0; begin < n1; begin += QUERY_BLOCK )
+	{
+	    const int end = std::min( begin + QUERY_BLOCK, n1 );
+	    tasks.run( [this, &descriptors1, &descriptors2, &matches12, begin, end]() { 
+		    computeRows( descriptors1, descriptors2, begin, end, matches12 ); } );
+	}
+	tasks.wait();
+    }
+    else
+    {
+	for( int begin = 0; begin < n1; begin += QUERY_BLOCK )
+	    computeRows( descriptors1, descriptors2, begin, std::min( begin + QUERY_BLOCK, n1 ), matches12 );
+    }
+
+    // the best matches of the other direction from the same matrix
+    const float inf = std::numeric_limits<float>::infinity();
+    const Best none = { inf, inf, -1, -1 };
+    colBest.assign( n2, none );
+    for( int i = 0; i < n1; i++ )
+    {
+	const float *row = &distances[(size_t)i * n2];
+	for( int j = 0; j < n2; j++ )
+	{
+	    Best &best( colBest[j] );
+	    update( row[j], i, best.first, best.second, best.firstIndex, best.secondIndex );
+	}
+    }
+    for( int j = 0; j < n2; j++ )
+    {
+	const Best &best( colBest[j] );
+	pushBest( matches21, j, best.first, best.second, best.firstIndex, best.secondIndex, descriptors1.type() != CV_8U );
+    }
+}
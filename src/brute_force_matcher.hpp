@@ -0,0 +1,64 @@
+#ifndef __STEREO_BRUTE_FORCE_MATCHER_HPP__
+#define __STEREO_BRUTE_FORCE_MATCHER_HPP__
+
+#include <opencv2/core/core.hpp>
+#include <stereo/knn_matches.hpp>
+#include <vector>
+
+namespace stereo
+{
+
+class ThreadPool;
+
+/**
+ * Exhaustive matcher for float descriptors (e.g. 64 or 128 dimensional
+ * SURF) with the L2 distance, and for binary descriptors with the hamming
+ * distance.
+ *
+ * For the few hundred features per image of the sparse stereo, building a
+ * FLANN index for both directions costs more than comparing all pairs. This
+ * matcher computes the full distance matrix once, in blocks of query rows
+ * which are processed in parallel on a ThreadPool, and takes the two best
+ * matches per row and per column from it. These are the matches of both
+ * directions, which are needed for the cross check and the ratio test.
+ *
+ * The float distance kernel is selected at runtime, using AVX with FMA if
+ * the cpu supports it and a scalar version otherwise. The hamming distance
+ * uses hammingDistance().
+ *
+ * All buffers are kept between calls.
+ */
+class BruteForceMatcher
+{
+public:
+    BruteForceMatcher();
+
+    /** compute the two best matches of descriptors1 in descriptors2 and of
+     * descriptors2 in descriptors1 in a single pass.
+     *
+     * @param pool - pool for the query blocks, or NULL to compute all in the
+     *               calling thread
+     */
+    void knnMatch( const cv::Mat& descriptors1, const cv::Mat& descriptors2,
+	    KnnMatches& matches12, KnnMatches& matches21, ThreadPool *pool = NULL );
+
+    /** @result the name of the float distance kernel in use ("avx_fma" or "scalar") */
+    static const char* getImplementation();
+
+private:
+    void computeRows( const cv::Mat& descriptors1, const cv::Mat& descriptors2, int begin, int end, KnnMatches& matches12 );
+
+    /// distances, squared for float descriptors, descriptors1.rows x descriptors2.rows
+    std::vector<float> distances;
+
+    struct Best
+    {
+	float first, second;
+	int firstIndex, secondIndex;
+    };
+    std::vector<Best> colBest;
+};
+
+}
+
+#endif
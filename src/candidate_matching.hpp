@@ -0,0 +1,90 @@
+#ifndef __STEREO_CANDIDATE_MATCHING_HPP__
+#define __STEREO_CANDIDATE_MATCHING_HPP__
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/features2d/features2d.hpp>
+#include <stereo/hamming.hpp>
+#include <cmath>
+#include <limits>
+#include <vector>
+
+namespace stereo
+{
+
+/** Helpers for the matchers which only compare selected candidate pairs of
+ * descriptors, like the EpipolarMatcher and the WindowMatcher. */
+
+/** distance between two descriptor rows, L2 for float descriptors and
+ * hamming for binary ones */
+inline float descriptorDistance( const cv::Mat& a, int i, const cv::Mat& b, int j )
+{
+    if( a.type() == CV_32F )
+    {
+	const float *pa = a.ptr<float>( i ), *pb = b.ptr<float>( j );
+	float sum = 0;
+	for( int k = 0; k < a.cols; k++ )
+	{
+	    const float diff = pa[k] - pb[k];
+	    sum += diff * diff;
+	}
+	return std::sqrt( sum );
+    }
+    return hammingDistance( a.ptr<unsigned char>( i ), b.ptr<unsigned char>( j ), a.cols );
+}
+
+/** the two best distances and the index of the best candidate of a
+ * keypoint */
+struct BestCandidates
+{
+    float first, second;
+    int index;
+
+    BestCandidates() 
+	: first( std::numeric_limits<float>::infinity() ), 
+	second( std::numeric_limits<float>::infinity() ), index( -1 ) {}
+
+    void update( float distance, int candidate )
+    {
+	if( distance < first )
+	{
+	    second = first;
+	    first = distance;
+	    index = candidate;
+	}
+	else if( distance < second )
+	    second = distance;
+    }
+
+    /** a match is unique if the second best candidate is further away by
+     * distanceFactor. As in the ratio test of the knn matchers, a single
+     * candidate is not unique. */
+    bool isUnique( float distanceFactor ) const
+    {
+	return second != std::numeric_limits<float>::infinity() && first * distanceFactor < second;
+    }
+};
+
+/** the matches where the best candidates of both sides agree, and which
+ * pass the ratio test if knn is 2 or more */
+inline void crossCheckCandidates( const std::vector<BestCandidates>& best1, const std::vector<BestCandidates>& best2,
+	std::vector<cv::DMatch>& matches, int knn, float distanceFactor )
+{
+    matches.clear();
+    for( size_t i = 0; i < best1.size(); i++ )
+    {
+	const BestCandidates &b1( best1[i] );
+	if( b1.index < 0 )
+	    continue;
+	const BestCandidates &b2( best2[b1.index] );
+	if( b2.index != (int)i )
+	    continue;
+	if( knn > 1 && !( b1.isUnique( distanceFactor ) && b2.isUnique( distanceFactor ) ) )
+	    continue;
+
+	matches.push_back( cv::DMatch( i, b1.index, b1.first ) );
+    }
+}
+
+}
+
+#endif
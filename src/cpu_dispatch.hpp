@@ -0,0 +1,67 @@
+#ifndef __STEREO_CPU_DISPATCH_HPP__
+#define __STEREO_CPU_DISPATCH_HPP__
+
+#include <stddef.h>
+
+#if defined(__GNUC__) && ( defined(__x86_64__) || defined(__i386__) )
+#define STEREO_X86
+#include <immintrin.h>
+#endif
+
+namespace stereo
+{
+
+/** Runtime selection of kernels with instruction set specific versions,
+ * which are compiled with __attribute__((target(...))) inside of STEREO_X86
+ * blocks. This is an internal header, which is not installed. */
+
+/** instruction set extensions, which can be combined */
+enum CpuFeature
+{
+    CPU_POPCNT = 1,
+    CPU_AVX = 2,
+    CPU_AVX2 = 4,
+    CPU_FMA = 8
+};
+
+/** @result true if the cpu supports all of the given CpuFeature flags */
+inline bool cpuSupports( unsigned int features )
+{
+#ifdef STEREO_X86
+    __builtin_cpu_init();
+    return !( ( features & CPU_POPCNT ) && !__builtin_cpu_supports( "popcnt" ) ) &&
+	!( ( features & CPU_AVX ) && !__builtin_cpu_supports( "avx" ) ) &&
+	!( ( features & CPU_AVX2 ) && !__builtin_cpu_supports( "avx2" ) ) &&
+	!( ( features & CPU_FMA ) && !__builtin_cpu_supports( "fma" ) );
+#else
+    return features == 0;
+#endif
+}
+
+/** one version of a kernel, and the features it needs */
+template <class Function>
+struct CpuImplementation
+{
+    Function function;
+    /// name for benchmarks, e.g. "avx2" or "scalar"
+    const char *name;
+    unsigned int features;
+};
+
+/** @result the first of the implementations, which the cpu supports. The
+ * last one needs to be a portable version without features.
+ */
+template <class Function, size_t N>
+const CpuImplementation<Function>& selectCpuImplementation( const CpuImplementation<Function> (&implementations)[N] )
+{
+    for( size_t i = 0; i + 1 < N; i++ )
+    {
+	if( cpuSupports( implementations[i].features ) )
+	    return implementations[i];
+    }
+    return implementations[N - 1];
+}
+
+}
+
+#endif
@@ -0,0 +1,176 @@
+#include "dense_stereo_scheduler.h"
+#include <iostream>
+
+using namespace stereo;
+
+DenseStereoScheduler::DenseStereoScheduler( DenseStereo& dense, const Callback& callback )
+    : dense( dense ), callback( callback ), deadline( 0 ),
+    mailbox( NULL ), spare( NULL ),
+    pushed( 0 ), dropped( 0 ), skipped( 0 ),
+    latencySum( 0 ), processingSum( 0 ),
+    running( false )
+{
+}
+
+DenseStereoScheduler::~DenseStereoScheduler()
+{
+    stop();
+    delete mailbox.exchange( NULL );
+    delete spare.exchange( NULL );
+}
+
+void DenseStereoScheduler::push( const cv::Mat& left, const cv::Mat& right, const base::Time& time, bool isRectified )
+{
+    Pair *pair = spare.exchange( NULL );
+    if( !pair )
+	pair = new Pair;
+
+    pair->left = left;
+    pair->right = right;
+    pair->time = time;
+    pair->isRectified = isRectified;
+
+    // latest pair wins, whatever was in the mailbox has not been picked up
+    // in time and is dropped
+    Pair *old = mailbox.exchange( pair );
+    pushed++;
+    if( old )
+    {
+	dropped++;
+	recycle( old );
+    }
+
+    {
+	std::lock_guard<std::mutex> lock( wakeupMutex );
+    }
+    wakeup.notify_one();
+}
+
+void DenseStereoScheduler::recycle( Pair *pair )
+{
+    // don't hold on to the image buffers of the caller
+    pair->left.release();
+    pair->right.release();
+    delete spare.exchange( pair );
+}
+
+bool DenseStereoScheduler::processLatest()
+{
+    Pair *pair = mailbox.exchange( NULL );
+    if( !pair )
+	return false;
+
+    const base::Time start = base::Time::now();
+    const int64_t maxAge = deadline;
+    if( maxAge != 0 && ( start - pair->time ).microseconds > maxAge )
+    {
+	skipped++;
+	recycle( pair );
+	return false;
+    }
+
+    const base::Time time = pair->time;
+    try
+    {
+	dense.getDistanceImages( pair->left, pair->right, leftResult, rightResult, pair->isRectified );
+    }
+    catch( ... )
+    {
+	recycle( pair );
+	throw;
+    }
+    recycle( pair );
+
+    const base::Time done = base::Time::now();
+    leftResult.time = time;
+    rightResult.time = time;
+
+    {
+	std::lock_guard<std::mutex> lock( statsMutex );
+	const base::Time latency = done - time;
+	if( stats.processed == 0 || latency < stats.latencyMin )
+	    stats.latencyMin = latency;
+	if( stats.processed == 0 || latency > stats.latencyMax )
+	    stats.latencyMax = latency;
+	stats.latencyLast = latency;
+	stats.processed++;
+	latencySum += latency.toSeconds();
+	processingSum += ( done - start ).toSeconds();
+    }
+
+    if( callback )
+	callback( leftResult, rightResult );
+
+    return true;
+}
+
+void DenseStereoScheduler::start()
+{
+    if( isRunning() )
+	return;
+
+    running = true;
+    worker = std::thread( &DenseStereoScheduler::run, this );
+}
+
+void DenseStereoScheduler::stop()
+{
+    if( !isRunning() )
+	return;
+
+    {
+	std::lock_guard<std::mutex> lock( wakeupMutex );
+	running = false;
+    }
+    wakeup.notify_all();
+    worker.join();
+}
+
+void DenseStereoScheduler::run()
+{
+    while( true )
+    {
+	{
+	    std::unique_lock<std::mutex> lock( wakeupMutex );
+	    while( running && !mailbox.load() )
+		wakeup.wait( lock );
+	    if( !running )
+		return;
+	}
+
+	try
+	{
+	    processLatest();
+	}
+	catch( const std::exception& e )
+	{
+	    std::cerr << "DenseStereoScheduler: processing failed: " << e.what() << std::endl;
+	}
+    }
+}
+
+DenseStereoSchedulerStatistics DenseStereoScheduler::getStatistics() const
+{
+    std::lock_guard<std::mutex> lock( statsMutex );
+    DenseStereoSchedulerStatistics result( stats );
+    result.pushed = pushed;
+    result.dropped = dropped;
+    result.skipped = skipped;
+    if( stats.processed > 0 )
+    {
+	result.latencyMean = base::Time::fromSeconds( latencySum / stats.processed );
+	result.processingMean = base::Time::fromSeconds( processingSum / stats.processed );
+    }
+    return result;
+}
+
+void DenseStereoScheduler::resetStatistics()
+{
+    std::lock_guard<std::mutex> lock( statsMutex );
+    stats = DenseStereoSchedulerStatistics();
+    latencySum = 0;
+    processingSum = 0;
+    pushed = 0;
+    dropped = 0;
+    skipped = 0;
+}
@@ -0,0 +1,146 @@
+#ifndef __DENSE_STEREO_SCHEDULER_H__
+#define __DENSE_STEREO_SCHEDULER_H__
+
+#include "densestereo.h"
+#include <base/Time.hpp>
+#include <base/samples/DistanceImage.hpp>
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+namespace stereo {
+
+/** counters and end-to-end latency statistics of a DenseStereoScheduler */
+struct DenseStereoSchedulerStatistics
+{
+    DenseStereoSchedulerStatistics()
+	: pushed(0), processed(0), dropped(0), skipped(0) {}
+
+    /// number of pairs given to push()
+    uint64_t pushed;
+    /// number of pairs that have been processed
+    uint64_t processed;
+    /// number of pairs that were replaced by a newer pair before processing started
+    uint64_t dropped;
+    /// number of pairs that were discarded because they were older than the deadline
+    uint64_t skipped;
+
+    /// end-to-end latency (capture time to result) of the last processed pair
+    base::Time latencyLast;
+    base::Time latencyMin;
+    base::Time latencyMax;
+    base::Time latencyMean;
+
+    /// mean time spent in the dense stereo processing
+    base::Time processingMean;
+};
+
+/**
+ * Scheduling front end for DenseStereo, which makes sure that the latency
+ * stays bounded if the processing is occasionally slower than the camera.
+ *
+ * Pairs are given to push(), which never blocks. Only the latest pair is
+ * kept in a single slot mailbox, which is exchanged lock-free. If a newer
+ * pair arrives before the previous one has been picked up, the previous one
+ * is dropped. Optionally, pairs which are already older than a deadline when
+ * the processing would start are skipped as well.
+ *
+ * The processing is either done in a worker thread, which is started with
+ * start(), or by the caller through processLatest(). Results are passed to
+ * the callback together with the capture time of the pair.
+ *
+ * The DenseStereo object must not be used by anyone else while the scheduler
+ * is running, and the images given to push() are referenced, not copied.
+ */
+class DenseStereoScheduler
+{
+public:
+    typedef std::function<void ( const base::samples::DistanceImage& left,
+	    const base::samples::DistanceImage& right )> Callback;
+
+    DenseStereoScheduler( DenseStereo& dense, const Callback& callback );
+
+    /** stops the worker thread, if running */
+    ~DenseStereoScheduler();
+
+    /** pairs older than the deadline at the start of processing are skipped.
+     * A deadline of zero (the default) disables skipping. It can be changed
+     * while the worker thread is running.
+     */
+    void setDeadline( const base::Time& deadline ) { this->deadline = deadline.microseconds; }
+    base::Time getDeadline() const { return base::Time::fromMicroseconds( deadline ); }
+
+    /** put a new pair into the mailbox, replacing any pair that has not been
+     * picked up yet. This method is non-blocking and thread-safe.
+     *
+     * @param left left input frame
+     * @param right right input frame
+     * @param time capture time of the pair, used for the deadline and the latency
+     * @param isRectified tells if the input images are already rectified
+     */
+    void push( const cv::Mat& left, const cv::Mat& right, const base::Time& time, bool isRectified = false );
+
+    /** process the latest pair in the calling thread, if there is one.
+     * Must not be called while the worker thread is running.
+     *
+     * @result true if a pair was processed
+     */
+    bool processLatest();
+
+    /** start the worker thread */
+    void start();
+
+    /** stop the worker thread. A pair which is processed at that time is
+     * finished, a pair which is still in the mailbox is kept.
+     */
+    void stop();
+
+    bool isRunning() const { return worker.joinable(); }
+
+    DenseStereoSchedulerStatistics getStatistics() const;
+    void resetStatistics();
+
+private:
+    struct Pair
+    {
+	cv::Mat left, right;
+	base::Time time;
+	bool isRectified;
+    };
+
+    DenseStereoScheduler( const DenseStereoScheduler& );
+    DenseStereoScheduler& operator=( const DenseStereoScheduler& );
+
+    void run();
+    void recycle( Pair *pair );
+
+    DenseStereo &dense;
+    Callback callback;
+    /// the deadline in microseconds, which is read by the worker thread
+    std::atomic<int64_t> deadline;
+
+    /// the single slot mailbox, only accessed with atomic exchange
+    std::atomic<Pair*> mailbox;
+    /// a processed pair that can be reused by push()
+    std::atomic<Pair*> spare;
+
+    std::atomic<uint64_t> pushed, dropped, skipped;
+
+    base::samples::DistanceImage leftResult, rightResult;
+
+    mutable std::mutex statsMutex;
+    DenseStereoSchedulerStatistics stats;
+    double latencySum, processingSum;
+
+    std::thread worker;
+    std::atomic<bool> running;
+    std::mutex wakeupMutex;
+    std::condition_variable wakeup;
+};
+
+}
+
+#endif
@@ -11,3 +11,39 @@ libElasConfiguration::libElasConfiguration()
     copyFromElas( &params, this );
 }
 
+
+RectifiedValidRegion::RectifiedValidRegion()
+    : x( 0 ), y( 0 ),
+    width( 0 ), height( 0 ),
+    image_width( 0 ), image_height( 0 )
+{
+}
+
+DisparityRangeConfiguration::DisparityRangeConfiguration()
+    : enabled( false ),
+    lower_percentile( 0.02 ),
+    upper_percentile( 0.98 ),
+    margin( 4 ),
+    relative_margin( 0.1 ),
+    min_matches( 20 )
+{
+}
+
+AdaptiveQualityConfiguration::AdaptiveQualityConfiguration()
+    : enabled( false ),
+    target_frame_time( 0.1 ),
+    upper_threshold( 1.0 ),
+    lower_threshold( 0.6 ),
+    smoothing( 0.3 ),
+    min_frames_per_level( 5 )
+{
+}
+
+AdaptiveQualityState::AdaptiveQualityState()
+    : level( 0 ),
+    num_levels( 0 ),
+    frames_at_level( 0 ),
+    last_frame_time( 0 ),
+    mean_frame_time( 0 )
+{
+}
@@ -37,6 +37,72 @@ namespace stereo {
                                     //       width/2 x height/2 (rounded towards zero)
   };
 
+  /** Region of the rectified images which is valid in both cameras, and
+   * the pixel savings when matching is restricted to it.
+   */
+  struct RectifiedValidRegion
+  {
+    RectifiedValidRegion();
+
+    int32_t x, y;                   // top left corner of the region
+    int32_t width, height;          // size of the region
+    int32_t image_width;            // size of the rectified images
+    int32_t image_height;
+
+    /** @return the fraction of pixels outside of the region (0..1) */
+    float getSavings() const
+    {
+      const float total = (float)image_width * image_height;
+      return total > 0 ? 1.0f - (float)width * height / total : 0.0f;
+    }
+  };
+
+  /** Configuration for deriving the libelas disparity range of a frame
+   * from the sparse stereo disparities of the same pair. The range given by
+   * disp_min/disp_max of the libelas configuration is the outer limit and
+   * is used if there are too few sparse matches.
+   */
+  struct DisparityRangeConfiguration
+  {
+    DisparityRangeConfiguration();
+
+    bool    enabled;                // use the sparse disparities given to DenseStereo::setSparseDisparities
+    float   lower_percentile;       // percentile (0..1) of the sparse disparities used for the lower bound
+    float   upper_percentile;       // percentile (0..1) of the sparse disparities used for the upper bound
+    int32_t margin;                 // margin in pixels subtracted from the lower and added to the upper bound
+    float   relative_margin;        // additional margin relative to the upper bound
+    int32_t min_matches;            // minimum number of sparse disparities, otherwise the full range is used
+  };
+
+  /** Configuration of the adaptive quality controller of DenseStereo.
+   * The controller measures the processing time of each frame and steps
+   * through a ladder of cheaper libelas configurations if the target frame
+   * time is exceeded, and back to the configured one if there is headroom.
+   */
+  struct AdaptiveQualityConfiguration
+  {
+    AdaptiveQualityConfiguration();
+
+    bool    enabled;                // enable the controller
+    float   target_frame_time;      // target processing time per frame in seconds
+    float   upper_threshold;        // step down if the mean frame time exceeds target_frame_time * upper_threshold
+    float   lower_threshold;        // step up if the mean frame time is below target_frame_time * lower_threshold
+    float   smoothing;              // weight (0..1] of the newest frame in the moving average of the frame time
+    int32_t min_frames_per_level;   // number of frames to measure after a level change before changing again
+  };
+
+  /** State of the adaptive quality controller of DenseStereo. */
+  struct AdaptiveQualityState
+  {
+    AdaptiveQualityState();
+
+    int32_t level;                  // current level, 0 is the configuration given to setLibElasConfiguration
+    int32_t num_levels;             // number of levels in the ladder
+    int32_t frames_at_level;        // number of frames processed since the last level change
+    float   last_frame_time;        // processing time of the last frame in seconds
+    float   mean_frame_time;        // moving average of the processing time in seconds
+  };
+
 }
 
 #endif
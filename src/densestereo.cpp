@@ -1,7 +1,11 @@
 #include "densestereo.h"
 #include "configuration.h"
 #include <stdexcept>
+#include <algorithm>
+#include <limits>
+#include <cmath>
 #include <opencv2/opencv.hpp>
+#include <base/Time.hpp>
 
 using namespace std;
 
@@ -9,13 +13,13 @@ namespace stereo {
 
 // wrapper class to hide libelas from orocos
 DenseStereo::DenseStereo() 
-    : gaussian_kernel(0), calibrationInitialized( false )
+    : gaussian_kernel(0), cropToValidRegion( false ), validRegionInitialized( false ), elas( NULL ),
+    rangeHintValid( false ), rangeHintMin( 0 ), rangeHintMax( 0 ),
+    calibrationInitialized( false )
 {
   // configure Elas and instantiate it
-  Elas::parameters elasParam;
-  libElasConfiguration config;
-  copyToElas( &config, &elasParam );
-  elas = new Elas(elasParam);
+  qualityState.num_levels = NUM_QUALITY_LEVELS;
+  initElas( elasConfig );
 }
 
 DenseStereo::~DenseStereo() {
@@ -26,21 +30,174 @@ DenseStereo::~DenseStereo() {
 void DenseStereo::setStereoCalibration(const frame_helper::StereoCalibration& stereoCal, const int imgWidth, const int imgHeight){
   calParam.setCalibration(stereoCal);
   calParam.setImageSize(cv::Size(imgWidth, imgHeight));
-  calParam.initCv();
+  rectificationCache.initCv(calParam);
+  // the valid region is only computed when it is needed
+  validRegionInitialized = false;
   
   calibrationInitialized = true;
 }
 
+// find an upright rectangle in which both rectified images are valid. The
+// rectangle is found by greedily shrinking the image, so it is not
+// necessarily the largest one
+void DenseStereo::computeValidRegion() const{
+  // the maps have the size of the rectified images
+  const cv::Size size = calParam.camLeft.map1.size();
+
+  // remap a white image with the rectification maps, the black border are
+  // the pixels without a source pixel in the original image
+  cv::Mat white(size, CV_8UC1, cv::Scalar(255)), leftMask, rightMask, mask;
+  cv::remap(white, leftMask, calParam.camLeft.map1, calParam.camLeft.map2,
+	  cv::INTER_NEAREST, cv::BORDER_CONSTANT, cv::Scalar(0));
+  cv::remap(white, rightMask, calParam.camRight.map1, calParam.camRight.map2,
+	  cv::INTER_NEAREST, cv::BORDER_CONSTANT, cv::Scalar(0));
+  cv::bitwise_and(leftMask, rightMask, mask);
+
+  // undistortAndRectify uses cubic interpolation, which blends in the
+  // border for the first two pixels
+  cv::erode(mask, mask, cv::Mat(), cv::Point(-1,-1), 2);
+
+  // shrink the image rectangle from the side with the most invalid pixels
+  // until there are no invalid pixels on any of its edges
+  cv::Rect roi(0, 0, size.width, size.height);
+  while( roi.width > 0 && roi.height > 0 ) {
+    const int invalid[4] = {
+      roi.width - cv::countNonZero(mask(cv::Rect(roi.x, roi.y, roi.width, 1))),
+      roi.width - cv::countNonZero(mask(cv::Rect(roi.x, roi.y + roi.height - 1, roi.width, 1))),
+      roi.height - cv::countNonZero(mask(cv::Rect(roi.x, roi.y, 1, roi.height))),
+      roi.height - cv::countNonZero(mask(cv::Rect(roi.x + roi.width - 1, roi.y, 1, roi.height))) };
+    const int side = std::max_element(invalid, invalid + 4) - invalid;
+    if( invalid[side] == 0 )
+      break;
+    switch( side ) {
+      case 0: roi.y++; roi.height--; break;
+      case 1: roi.height--; break;
+      case 2: roi.x++; roi.width--; break;
+      case 3: roi.width--; break;
+    }
+  }
+
+  validRegion.x = roi.x;
+  validRegion.y = roi.y;
+  validRegion.width = std::max(roi.width, 0);
+  validRegion.height = std::max(roi.height, 0);
+  validRegion.image_width = size.width;
+  validRegion.image_height = size.height;
+  validRegionInitialized = true;
+}
+
+const RectifiedValidRegion& DenseStereo::getValidRegion() const{
+  if( !validRegionInitialized && calibrationInitialized )
+    computeValidRegion();
+  return validRegion;
+}
+
+//enable or disable the rectification map cache
+void DenseStereo::setRectificationCacheDirectory(const std::string &path){
+  rectificationCache.setDirectory(path);
+}
+
 //load libelas parameters (if other then default)
 void DenseStereo::setLibElasConfiguration(const libElasConfiguration &libElasParam){
-  //delete default configured libelas
+  elasConfig = libElasParam;
+  initElas( getQualityLevelConfiguration( qualityState.level ) );
+}
+
+void DenseStereo::initElas(const libElasConfiguration &config){
+  //delete previously configured libelas
   delete elas;
 
   //configure Elas and instantiate it
   Elas::parameters elasParam;
-  copyToElas( &libElasParam, &elasParam );
+  copyToElas( &config, &elasParam );
 
   elas = new Elas(elasParam);
+  activeElasConfig = config;
+}
+
+bool DenseStereo::setSparseDisparities(const std::vector<float> &disparities){
+  rangeHintValid = false;
+  if( !rangeConfig.enabled || disparities.size() < (size_t)std::max( 1, rangeConfig.min_matches ) )
+    return false;
+
+  // robust lower and upper bound of the sparse disparities
+  std::vector<float> d( disparities );
+  const size_t lower = std::min( d.size() - 1, (size_t)( std::max( 0.0f, rangeConfig.lower_percentile ) * (d.size() - 1) ) );
+  const size_t upper = std::min( d.size() - 1, (size_t)( std::max( 0.0f, rangeConfig.upper_percentile ) * (d.size() - 1) ) );
+  std::nth_element( d.begin(), d.begin() + lower, d.end() );
+  const float lowerDisp = d[lower];
+  std::nth_element( d.begin(), d.begin() + upper, d.end() );
+  const float upperDisp = d[upper];
+
+  // the configured range is the outer limit
+  const libElasConfiguration &config( elasConfig );
+  int32_t dispMin = (int32_t)floor( lowerDisp ) - rangeConfig.margin;
+  int32_t dispMax = (int32_t)ceil( upperDisp * ( 1.0f + rangeConfig.relative_margin ) ) + rangeConfig.margin;
+  dispMin = std::max( config.disp_min, std::min( dispMin, config.disp_max ) );
+  dispMax = std::max( config.disp_min, std::min( dispMax, config.disp_max ) );
+  if( dispMax <= dispMin )
+    return false;
+
+  rangeHintMin = dispMin;
+  rangeHintMax = dispMax;
+  rangeHintValid = true;
+  return true;
+}
+
+void DenseStereo::setAdaptiveQualityConfiguration(const AdaptiveQualityConfiguration &config){
+  qualityConfig = config;
+
+  // restart the controller from the configured quality
+  qualityState = AdaptiveQualityState();
+  qualityState.num_levels = NUM_QUALITY_LEVELS;
+  initElas( elasConfig );
+}
+
+// the ladder is cumulative, every level includes the savings of the previous ones
+libElasConfiguration DenseStereo::getQualityLevelConfiguration(int level) const {
+  libElasConfiguration config = elasConfig;
+  if( level >= 1 )
+    // sparser grid of support points
+    config.candidate_stepsize *= 2;
+  if( level >= 2 )
+    config.postprocess_only_left = true;
+  if( level >= 3 ) {
+    config.filter_median = false;
+    config.filter_adaptive_mean = false;
+  }
+  if( level >= 4 )
+    // only every second pixel, the result is upsampled in processFramePair
+    config.subsampling = true;
+  return config;
+}
+
+void DenseStereo::updateAdaptiveQuality(float frameTime){
+  AdaptiveQualityState &state( qualityState );
+
+  // the moving average starts from scratch after each level change
+  const float alpha = std::min( 1.0f, std::max( 0.0f, qualityConfig.smoothing ) );
+  if( state.frames_at_level == 0 )
+    state.mean_frame_time = frameTime;
+  else
+    state.mean_frame_time = alpha * frameTime + (1.0f - alpha) * state.mean_frame_time;
+  state.last_frame_time = frameTime;
+  state.frames_at_level++;
+
+  if( !qualityConfig.enabled || state.frames_at_level < qualityConfig.min_frames_per_level )
+    return;
+
+  const float target = qualityConfig.target_frame_time;
+  int level = state.level;
+  if( state.mean_frame_time > target * qualityConfig.upper_threshold && level < NUM_QUALITY_LEVELS - 1 )
+    level++;
+  else if( state.mean_frame_time < target * qualityConfig.lower_threshold && level > 0 )
+    level--;
+
+  if( level != state.level ) {
+    state.level = level;
+    state.frames_at_level = 0;
+    initElas( getQualityLevelConfiguration( level ) );
+  }
 }
 
 // undistorts and rectifies images with opencv
@@ -97,6 +254,18 @@ void DenseStereo::processFramePair (const cv::Mat &left_frame,
   if (!calibrationInitialized) {
       throw std::runtime_error("Call setStereoCalibration() first!");
   }
+
+  const base::Time start = base::Time::now();
+
+  // use the disparity range from the sparse disparities for this frame only
+  libElasConfiguration config = getQualityLevelConfiguration( qualityState.level );
+  if( rangeHintValid ) {
+    config.disp_min = rangeHintMin;
+    config.disp_max = rangeHintMax;
+    rangeHintValid = false;
+  }
+  if( config.disp_min != activeElasConfig.disp_min || config.disp_max != activeElasConfig.disp_max )
+    initElas( config );
   
   // rectify and convert images to Grayscale (uint8_t)
   cv::Mat left = left_frame;
@@ -128,8 +297,6 @@ void DenseStereo::processFramePair (const cv::Mat &left_frame,
   const int32_t width  = left_frame.size().width;
   const int32_t height = left_frame.size().height;
 
-  // set processing dimensions
-  const int32_t dims[3] = {width,height,width}; // bytes per line = width
   // allocate memory for disparity images if not already done
   if (!left_output_frame.data) {
     left_output_frame = cv::Mat(left_frame.size().height,
@@ -143,11 +310,58 @@ void DenseStereo::processFramePair (const cv::Mat &left_frame,
  }
   
   // process
-  elas->process(left.ptr<uint8_t>(),
-                right.ptr<uint8_t>(),
-                left_output_frame.ptr<float>(),
-                right_output_frame.ptr<float>(),
-                dims);
+  const RectifiedValidRegion &valid = cropToValidRegion ? getValidRegion() : RectifiedValidRegion();
+  const cv::Rect roi(valid.x, valid.y, valid.width, valid.height);
+  if( cropToValidRegion && roi.area() > 0 && roi.size() != left.size() 
+      && valid.image_width == width && valid.image_height == height ) {
+    // match only the valid region, libelas needs continuous buffers
+    left(roi).copyTo(left_cropped);
+    right(roi).copyTo(right_cropped);
+    left_cropped_disp.create(roi.size(), cv::DataType<float>::type);
+    right_cropped_disp.create(roi.size(), cv::DataType<float>::type);
+    runElas(left_cropped, right_cropped, left_cropped_disp, right_cropped_disp);
+
+    left_output_frame.setTo(std::numeric_limits<float>::quiet_NaN());
+    right_output_frame.setTo(std::numeric_limits<float>::quiet_NaN());
+    cv::Mat left_output_roi(left_output_frame, roi), right_output_roi(right_output_frame, roi);
+    left_cropped_disp.copyTo(left_output_roi);
+    right_cropped_disp.copyTo(right_output_roi);
+  }
+  else {
+    runElas(left, right, left_output_frame, right_output_frame);
+  }
+
+  updateAdaptiveQuality( (base::Time::now() - start).toSeconds() );
+}
+
+void DenseStereo::runElas(cv::Mat &left, cv::Mat &right, cv::Mat &left_disp, cv::Mat &right_disp)
+{
+  const int32_t width  = left.size().width;
+  const int32_t height = left.size().height;
+
+  // set processing dimensions
+  const int32_t dims[3] = {width,height,width}; // bytes per line = width
+
+  if( activeElasConfig.subsampling ) {
+    // libelas writes width/2 x height/2 disparity images in this mode, so
+    // compute them into separate buffers and upsample them to the output
+    left_subsampled.create(height/2, width/2, cv::DataType<float>::type);
+    right_subsampled.create(height/2, width/2, cv::DataType<float>::type);
+    elas->process(left.ptr<uint8_t>(),
+                  right.ptr<uint8_t>(),
+                  left_subsampled.ptr<float>(),
+                  right_subsampled.ptr<float>(),
+                  dims);
+    cv::resize(left_subsampled, left_disp, left_disp.size(), 0, 0, cv::INTER_NEAREST);
+    cv::resize(right_subsampled, right_disp, right_disp.size(), 0, 0, cv::INTER_NEAREST);
+  }
+  else {
+    elas->process(left.ptr<uint8_t>(),
+                  right.ptr<uint8_t>(),
+                  left_disp.ptr<float>(),
+                  right_disp.ptr<float>(),
+                  dims);
+  }
 }
 
 void disparityToDistance( cv::Mat &disp, float dist_factor )
@@ -7,7 +7,9 @@
 #include <libelas/elas.h>
 #include <frame_helper/CalibrationCv.h>
 #include "dense_stereo_types.h"
+#include "rectification_cache.h"
 #include <base/samples/DistanceImage.hpp>
+#include <vector>
 
 namespace stereo {
 
@@ -37,17 +39,80 @@ public:
                             const int imgWidth,
                             const int imgHeight);
   
+  /** enables caching of the rectification maps in the given directory.
+   * Subsequent calls to setStereoCalibration will load the maps from the
+   * cache if they have been computed before for the same calibration and
+   * image size. An empty path disables the cache.
+   * @param path existing, writable directory for the cache files
+   */
+  void setRectificationCacheDirectory(const std::string &path);
+  
   /** configures libElas
    * @param libElasParam libElas configuration
    */
   void setLibElasConfiguration(const libElasConfiguration &libElasParam);
 
+  /** configures the adaptive quality controller. If enabled, the libelas
+   * configuration is replaced by cheaper ones when the processing time
+   * exceeds the target frame time, and restored when there is headroom.
+   * The controller starts at level 0 again after this call.
+   * @param config controller configuration
+   */
+  void setAdaptiveQualityConfiguration(const AdaptiveQualityConfiguration &config);
+
+  /** @return the configuration of the adaptive quality controller */
+  const AdaptiveQualityConfiguration& getAdaptiveQualityConfiguration() const { return qualityConfig; }
+
+  /** @return the current state of the adaptive quality controller */
+  const AdaptiveQualityState& getAdaptiveQualityState() const { return qualityState; }
+
+  /** configures how the disparity range is derived from sparse disparities
+   * @param config disparity range configuration
+   */
+  void setDisparityRangeConfiguration(const DisparityRangeConfiguration &config) { rangeConfig = config; }
+
+  /** @return the configuration of the disparity range estimation */
+  const DisparityRangeConfiguration& getDisparityRangeConfiguration() const { return rangeConfig; }
+
+  /** 
+   * sets the disparity range of libelas for the next processed frame from
+   * the sparse disparities (left x - right x) of the same rectified pair,
+   * e.g. from StereoFeatures::getStereoDisparities(). If the range estimation
+   * is disabled or there are not enough disparities, the configured range
+   * is used for that frame.
+   * @param disparities sparse disparities in pixels
+   * @return true if the disparities were used to set the range
+   */
+  bool setSparseDisparities(const std::vector<float> &disparities);
+
+  /** @return the libelas configuration which is currently used, including
+   * the changes made by the adaptive quality controller
+   */
+  const libElasConfiguration& getActiveLibElasConfiguration() const { return activeElasConfig; }
+
   /** 
    * if set to greater than 0, the images will be preprocessed with a 
    * gaussian blur filter with a kernel of the given size. Should be
    * an odd number.
    */
   void setGaussianKernel( int size ) { gaussian_kernel = size; }
+
+  /**
+   * if set to true, only the region of the rectified images which is valid
+   * in both cameras is matched. The disparities outside of that region are
+   * set to NaN. This saves the time spent on the invalid borders that
+   * remain after rectification, which can be large for wide angle lenses.
+   */
+  void setCropToValidRegion( bool crop ) { cropToValidRegion = crop; }
+
+  /**
+   * @return the region of the rectified images which is valid in both
+   * cameras, as computed from the current calibration. Also gives the
+   * fraction of pixels saved by setCropToValidRegion(). The region is
+   * computed on the first call after setStereoCalibration(), which remaps
+   * a full image with both rectification maps.
+   */
+  const RectifiedValidRegion& getValidRegion() const;
   
   /** computes disparities of input frame pair left_frame, right_frame 
    * @param left_frame left input frame
@@ -124,18 +189,49 @@ public:
   }
 			  
   
+  /// number of levels of the adaptive quality ladder
+  static const int NUM_QUALITY_LEVELS = 5;
+  
 private:
   /// see if we need to apply a gaussian filter
   int gaussian_kernel;
 
+  /// only match the valid region of the rectified images
+  bool cropToValidRegion;
+  /// the valid region is computed lazily by getValidRegion()
+  mutable bool validRegionInitialized;
+  mutable RectifiedValidRegion validRegion;
+
+  ///buffers for matching the valid region only
+  cv::Mat left_cropped, right_cropped;
+  cv::Mat left_cropped_disp, right_cropped_disp;
+
   ///instance of libElas
   Elas *elas;
+
+  ///libElas configuration given by the user and the one currently in use
+  libElasConfiguration elasConfig, activeElasConfig;
+
+  ///disparity range from sparse disparities, only valid for the next frame
+  DisparityRangeConfiguration rangeConfig;
+  bool rangeHintValid;
+  int32_t rangeHintMin, rangeHintMax;
+
+  ///adaptive quality controller
+  AdaptiveQualityConfiguration qualityConfig;
+  AdaptiveQualityState qualityState;
+
+  ///buffers for the half resolution output when subsampling is enabled
+  cv::Mat left_subsampled, right_subsampled;
   
   ///calibration parameters
   frame_helper::StereoCalibrationCv calParam;
   
   ///calibration initialized?
   bool calibrationInitialized;
+
+  ///optional cache for the rectification maps, may own the memory of the maps in calParam
+  RectificationCache rectificationCache;
   
   /** undistorts and rectifies an image with openCV 
    * @param image image which should be undistorted and rectified
@@ -143,6 +239,36 @@ private:
    */
   void undistortAndRectify(cv::Mat &image, const frame_helper::CameraCalibrationCv& calib);
   
+  /** computes the region of the rectified images which is valid in both
+   * cameras from the rectification maps
+   */
+  void computeValidRegion() const;
+
+  /** runs libElas on a rectified grayscale pair, and takes care of the
+   * output size if subsampling is enabled
+   * @param left left image
+   * @param right right image, same size as the left one
+   * @param left_disp left disparity output, same size as the input
+   * @param right_disp right disparity output, same size as the input
+   */
+  void runElas(cv::Mat &left, cv::Mat &right, cv::Mat &left_disp, cv::Mat &right_disp);
+
+  /** (re)creates the libElas instance for the given configuration
+   * @param config libElas configuration
+   */
+  void initElas(const libElasConfiguration &config);
+
+  /** @return the configuration for the given level of the adaptive quality ladder
+   * @param level quality level, 0 is the configuration given by the user
+   */
+  libElasConfiguration getQualityLevelConfiguration(int level) const;
+
+  /** feeds the processing time of a frame to the adaptive quality
+   * controller and changes the libElas configuration if needed
+   * @param frameTime processing time of the last frame in seconds
+   */
+  void updateAdaptiveQuality(float frameTime);
+
   /** converts colour of an image to grayscale (uint8_t) with openCV
    * @param image Image which is converted
    */
@@ -0,0 +1,64 @@
+#include "descriptor_index_cache.hpp"
+#include <algorithm>
+#include <string.h>
+
+using namespace stereo;
+
+DescriptorIndexCache::DescriptorIndexCache( size_t capacity )
+    : capacity( std::max( capacity, (size_t)1 ) ), hits( 0 ), misses( 0 ), evictions( 0 )
+{
+}
+
+bool DescriptorIndexCache::matches( const Entry& entry, const base::Time& time, const cv::Mat& descriptors )
+{
+    const cv::Mat &cached( entry.descriptors );
+    if( entry.time != time || cached.rows != descriptors.rows || cached.cols != descriptors.cols 
+	    || cached.type() != descriptors.type() )
+	return false;
+    if( descriptors.empty() )
+	return true;
+
+    // only spot check the content, a full comparison would cost about as
+    // much as the index is supposed to save
+    const size_t rowSize = descriptors.cols * descriptors.elemSize();
+    const int last = descriptors.rows - 1;
+    return memcmp( cached.ptr( 0 ), descriptors.ptr( 0 ), rowSize ) == 0 &&
+	memcmp( cached.ptr( last ), descriptors.ptr( last ), rowSize ) == 0;
+}
+
+cv::Ptr<cv::DescriptorMatcher> DescriptorIndexCache::get( const cv::Ptr<cv::DescriptorMatcher>& prototype,
+	const base::Time& time, const cv::Mat& descriptors )
+{
+    for( std::list<Entry>::iterator it = entries.begin(); it != entries.end(); ++it )
+    {
+	if( matches( *it, time, descriptors ) )
+	{
+	    hits++;
+	    entries.splice( entries.begin(), entries, it );
+	    return entries.front().matcher;
+	}
+    }
+
+    misses++;
+    Entry entry;
+    entry.time = time;
+    // the descriptors of a frame are usually a view on a StereoFeatureArray,
+    // which may be changed by the caller
+    entry.descriptors = descriptors.clone();
+    entry.matcher = prototype->clone( true );
+    entry.matcher->add( std::vector<cv::Mat>( 1, entry.descriptors ) );
+    entry.matcher->train();
+
+    entries.push_front( entry );
+    if( entries.size() > capacity )
+    {
+	entries.pop_back();
+	evictions++;
+    }
+    return entries.front().matcher;
+}
+
+void DescriptorIndexCache::clear()
+{
+    entries.clear();
+}
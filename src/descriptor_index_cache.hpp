@@ -0,0 +1,71 @@
+#ifndef __STEREO_DESCRIPTOR_INDEX_CACHE_HPP__
+#define __STEREO_DESCRIPTOR_INDEX_CACHE_HPP__
+
+#include <opencv2/features2d/features2d.hpp>
+#include <base/Time.hpp>
+#include <list>
+
+namespace stereo
+{
+
+/**
+ * Cache of trained descriptor matchers for the frames of the inter-frame
+ * matching.
+ *
+ * The current frame of one call to calculateInterFrameCorrespondences is
+ * usually the previous frame of the next call. Instead of building the
+ * search structure (e.g. the FLANN index) of a frame again, the matcher which
+ * has been trained with its descriptors is kept and reused.
+ *
+ * Entries are identified by the frame time and the shape of the
+ * descriptors, without a pass over the descriptor data. As a check against
+ * a reused time, the first and the last descriptor are compared with the
+ * cached ones. The least recently used entry is evicted when the capacity
+ * is reached.
+ */
+class DescriptorIndexCache
+{
+public:
+    /** @param capacity - number of frames which are kept. Two frames are
+     *                    used per call, so it should be at least 2.
+     */
+    explicit DescriptorIndexCache( size_t capacity = 3 );
+
+    /** @result a matcher which is trained with the given descriptors. On a
+     * miss, it is created with prototype->clone(true) and trained with a
+     * copy of the descriptors.
+     */
+    cv::Ptr<cv::DescriptorMatcher> get( const cv::Ptr<cv::DescriptorMatcher>& prototype,
+	    const base::Time& time, const cv::Mat& descriptors );
+
+    /** remove all entries, e.g. after the matcher type has changed */
+    void clear();
+
+    size_t getHits() const { return hits; }
+    size_t getMisses() const { return misses; }
+    /// number of entries which were removed to make room for a new one
+    size_t getEvictions() const { return evictions; }
+    void resetStatistics() { hits = misses = evictions = 0; }
+
+    size_t size() const { return entries.size(); }
+
+private:
+    struct Entry
+    {
+	base::Time time;
+	/// the copy of the descriptors the matcher is trained with
+	cv::Mat descriptors;
+	cv::Ptr<cv::DescriptorMatcher> matcher;
+    };
+
+    static bool matches( const Entry& entry, const base::Time& time, const cv::Mat& descriptors );
+
+    size_t capacity;
+    /// most recently used entry first
+    std::list<Entry> entries;
+    size_t hits, misses, evictions;
+};
+
+}
+
+#endif
@@ -0,0 +1,151 @@
+#include "epipolar_matcher.hpp"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+
+using namespace stereo;
+
+EpipolarMatcher::EpipolarMatcher()
+    : maxYDeviation( 5 ), minDisparity( 0 ), maxDisparity( 0 ), searchRadius( 4 ), bandHeight( 5 )
+{
+}
+
+void EpipolarMatcher::setMaxYDeviation( float maxYDeviation )
+{
+    this->maxYDeviation = maxYDeviation;
+}
+
+void EpipolarMatcher::setDisparityRange( float minDisparity, float maxDisparity )
+{
+    this->minDisparity = minDisparity;
+    this->maxDisparity = maxDisparity;
+}
+
+void EpipolarMatcher::setSearchRadius( float searchRadius )
+{
+    this->searchRadius = searchRadius;
+}
+
+int EpipolarMatcher::getBand( float y ) const
+{
+    return std::max( 0, (int)std::floor( y / bandHeight ) );
+}
+
+void EpipolarMatcher::buildIndex( const std::vector<cv::KeyPoint>& keypoints )
+{
+    // the bands are as high as the allowed deviation, so a query has to look
+    // at no more than three bands
+    bandHeight = std::max( 1.0f, maxYDeviation );
+
+    // keep the allocated bands from the last call
+    for( size_t b = 0; b < bands.size(); b++ )
+	bands[b].clear();
+
+    for( size_t i = 0; i < keypoints.size(); i++ )
+    {
+	const int band = getBand( keypoints[i].pt.y );
+	if( band >= (int)bands.size() )
+	    bands.resize( band + 1 );
+	Entry entry = { keypoints[i].pt.x, (int)i };
+	bands[band].push_back( entry );
+    }
+
+    for( size_t b = 0; b < bands.size(); b++ )
+	std::sort( bands[b].begin(), bands[b].end() );
+}
+
+template <class F>
+void EpipolarMatcher::forEachCandidate( const std::vector<cv::KeyPoint>& leftKeypoints,
+	const std::vector<cv::KeyPoint>& rightKeypoints,
+	const std::vector<float>* predictedDisparities, F f ) const
+{
+    if( predictedDisparities && predictedDisparities->size() != leftKeypoints.size() )
+	throw std::runtime_error( "EpipolarMatcher: number of keypoints and predicted disparities differ" );
+
+    const float inf = std::numeric_limits<float>::infinity();
+    for( size_t i = 0; i < leftKeypoints.size(); i++ )
+    {
+	const cv::Point2f &pl( leftKeypoints[i].pt );
+	const int firstBand = getBand( pl.y - maxYDeviation );
+	const int lastBand = std::min( (int)bands.size() - 1, getBand( pl.y + maxYDeviation ) );
+
+	// candidates have xr in [xl - maxDisparity, xl - minDisparity)
+	Entry lower = { maxDisparity > 0 ? pl.x - maxDisparity : -inf, 0 };
+	Entry upper = { pl.x - minDisparity, 0 };
+
+	// and are close to the predicted position, if there is one
+	if( predictedDisparities )
+	{
+	    const float d = (*predictedDisparities)[i];
+	    if( !std::isnan( d ) )
+	    {
+		lower.x = std::max( lower.x, pl.x - d - searchRadius );
+		upper.x = std::min( upper.x, pl.x - d + searchRadius );
+	    }
+	}
+
+	for( int b = firstBand; b <= lastBand; b++ )
+	{
+	    const std::vector<Entry> &band( bands[b] );
+	    std::vector<Entry>::const_iterator it = std::lower_bound( band.begin(), band.end(), lower );
+	    std::vector<Entry>::const_iterator end = std::lower_bound( it, band.end(), upper );
+	    for( ; it != end; ++it )
+	    {
+		const int j = it->index;
+		if( std::fabs( rightKeypoints[j].pt.y - pl.y ) < maxYDeviation )
+		    f( i, j );
+	    }
+	}
+    }
+}
+
+void EpipolarMatcher::match( const std::vector<cv::KeyPoint>& leftKeypoints, const cv::Mat& leftDescriptors,
+	const std::vector<cv::KeyPoint>& rightKeypoints, const cv::Mat& rightDescriptors,
+	std::vector<cv::DMatch>& matches, int knn, float distanceFactor,
+	const std::vector<float>* predictedDisparities )
+{
+    matches.clear();
+    if( leftDescriptors.rows != (int)leftKeypoints.size() || rightDescriptors.rows != (int)rightKeypoints.size() )
+	throw std::runtime_error( "EpipolarMatcher: number of keypoints and descriptors differ" );
+    if( leftDescriptors.empty() || rightDescriptors.empty() )
+	return;
+    if( leftDescriptors.type() != rightDescriptors.type() || leftDescriptors.cols != rightDescriptors.cols )
+	throw std::runtime_error( "EpipolarMatcher: left and right descriptors are not compatible" );
+
+    buildIndex( rightKeypoints );
+
+    leftBest.assign( leftKeypoints.size(), BestCandidates() );
+    rightBest.assign( rightKeypoints.size(), BestCandidates() );
+
+    // a single pass over all candidate pairs, updating the best two
+    // distances of both the left and the right keypoint
+    forEachCandidate( leftKeypoints, rightKeypoints, predictedDisparities, [&]( int i, int j )
+    {
+	const float distance = descriptorDistance( leftDescriptors, i, rightDescriptors, j );
+	leftBest[i].update( distance, j );
+	rightBest[j].update( distance, i );
+    } );
+
+    // cross check and ratio test
+    crossCheckCandidates( leftBest, rightBest, matches, knn, distanceFactor );
+}
+
+void EpipolarMatcher::selectCandidates( const std::vector<cv::KeyPoint>& leftKeypoints,
+	std::vector<cv::KeyPoint>& rightKeypoints,
+	const std::vector<float>* predictedDisparities )
+{
+    buildIndex( rightKeypoints );
+
+    std::vector<unsigned char> isCandidate( rightKeypoints.size(), 0 );
+    forEachCandidate( leftKeypoints, rightKeypoints, predictedDisparities, 
+	    [&isCandidate]( int, int j ) { isCandidate[j] = 1; } );
+
+    size_t count = 0;
+    for( size_t j = 0; j < rightKeypoints.size(); j++ )
+    {
+	if( isCandidate[j] )
+	    rightKeypoints[count++] = rightKeypoints[j];
+    }
+    rightKeypoints.resize( count );
+}
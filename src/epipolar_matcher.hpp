@@ -0,0 +1,101 @@
+#ifndef __STEREO_EPIPOLAR_MATCHER_HPP__
+#define __STEREO_EPIPOLAR_MATCHER_HPP__
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/features2d/features2d.hpp>
+#include <stereo/candidate_matching.hpp>
+#include <vector>
+#include <cstddef>
+
+namespace stereo
+{
+
+/**
+ * Descriptor matcher for rectified stereo images.
+ *
+ * The right keypoints are sorted into bands of rows, and within each band by
+ * their x coordinate. For a left keypoint only the right keypoints within
+ * maxYDeviation rows and within the disparity interval are compared, instead
+ * of all right keypoints.
+ *
+ * All candidate distances are computed in a single pass, which keeps the two
+ * best distances for every left and every right keypoint. From these, the
+ * matches are cross checked and optionally filtered with the same ratio test
+ * as StereoFeatures::crossCheckMatching.
+ */
+class EpipolarMatcher
+{
+public:
+    EpipolarMatcher();
+
+    /** two keypoints can only match if the difference of their rows is
+     * smaller than maxYDeviation
+     */
+    void setMaxYDeviation( float maxYDeviation );
+
+    /** two keypoints can only match if the disparity xl - xr is larger than
+     * minDisparity and not larger than maxDisparity. A maxDisparity of 0 or
+     * less does not limit the disparity.
+     */
+    void setDisparityRange( float minDisparity, float maxDisparity );
+
+    /** for left keypoints with a predicted disparity, only the right
+     * keypoints within searchRadius pixels in x of the predicted position
+     * are compared
+     */
+    void setSearchRadius( float searchRadius );
+
+    /** match the left to the right keypoints.
+     *
+     * @param knn - a value of 2 or more applies the ratio test with the
+     *              distanceFactor. Keypoints with only a single candidate
+     *              fail the ratio test.
+     * @param matches - the cross checked matches with the left keypoints as
+     *                  query and the right keypoints as train index
+     * @param predictedDisparities - optional disparity per left keypoint,
+     *              e.g. from a dense disparity image. A left keypoint is
+     *              only compared within the search radius around xl - d. An
+     *              entry of NaN searches the whole disparity interval.
+     */
+    void match( const std::vector<cv::KeyPoint>& leftKeypoints, const cv::Mat& leftDescriptors,
+	    const std::vector<cv::KeyPoint>& rightKeypoints, const cv::Mat& rightDescriptors,
+	    std::vector<cv::DMatch>& matches, int knn = 1, float distanceFactor = 2.0,
+	    const std::vector<float>* predictedDisparities = NULL );
+
+    /** remove the right keypoints, which are not a candidate for any of the
+     * left keypoints, so that no descriptors need to be computed for them.
+     * The parameters are the same as for match().
+     */
+    void selectCandidates( const std::vector<cv::KeyPoint>& leftKeypoints,
+	    std::vector<cv::KeyPoint>& rightKeypoints,
+	    const std::vector<float>* predictedDisparities = NULL );
+
+private:
+    struct Entry
+    {
+	float x;
+	int index;
+
+	bool operator < ( const Entry& other ) const { return x < other.x; }
+    };
+
+    void buildIndex( const std::vector<cv::KeyPoint>& keypoints );
+    int getBand( float y ) const;
+    /** calls f( left, right ) for every candidate pair */
+    template <class F>
+    void forEachCandidate( const std::vector<cv::KeyPoint>& leftKeypoints,
+	    const std::vector<cv::KeyPoint>& rightKeypoints,
+	    const std::vector<float>* predictedDisparities, F f ) const;
+
+    float maxYDeviation;
+    float minDisparity, maxDisparity;
+    float searchRadius;
+
+    float bandHeight;
+    std::vector<std::vector<Entry> > bands;
+    std::vector<BestCandidates> leftBest, rightBest;
+};
+
+}
+
+#endif
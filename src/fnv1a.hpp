@@ -0,0 +1,47 @@
+#ifndef __STEREO_FNV1A_HPP__
+#define __STEREO_FNV1A_HPP__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+namespace stereo
+{
+
+/** 64 bit FNV-1a hash of @param size bytes at @param data, which can be
+ * chained by passing the result of a previous call as @param hash.
+ *
+ * This is an internal header, which is not installed.
+ */
+inline uint64_t fnv1a( const void *data, size_t size, uint64_t hash = 14695981039346656037ULL )
+{
+    const uint8_t *bytes = static_cast<const uint8_t*>( data );
+    for( size_t i = 0; i < size; i++ )
+    {
+	hash ^= bytes[i];
+	hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+/** like fnv1a(), but mixing in 8 bytes per step, which is about eight times
+ * faster for large buffers. The result differs from fnv1a() for the same
+ * data.
+ */
+inline uint64_t fnv1aWords( const void *data, size_t size, uint64_t hash = 14695981039346656037ULL )
+{
+    const uint8_t *bytes = static_cast<const uint8_t*>( data );
+    size_t i = 0;
+    for( ; i + 8 <= size; i += 8 )
+    {
+	uint64_t word;
+	memcpy( &word, bytes + i, sizeof( word ) );
+	hash ^= word;
+	hash *= 1099511628211ULL;
+    }
+    return fnv1a( bytes + i, size - i, hash );
+}
+
+}
+
+#endif
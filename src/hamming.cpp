@@ -0,0 +1,106 @@
+#include "hamming.hpp"
+#include "cpu_dispatch.hpp"
+#include <stdint.h>
+#include <string.h>
+
+using namespace stereo;
+
+namespace
+{
+    typedef unsigned int (*HammingFunction)( const unsigned char*, const unsigned char*, size_t );
+
+    inline uint64_t load64( const unsigned char *p )
+    {
+	uint64_t v;
+	memcpy( &v, p, sizeof(v) );
+	return v;
+    }
+
+    inline unsigned int popcountScalar( uint64_t v )
+    {
+	v = v - ( ( v >> 1 ) & 0x5555555555555555ULL );
+	v = ( v & 0x3333333333333333ULL ) + ( ( v >> 2 ) & 0x3333333333333333ULL );
+	v = ( v + ( v >> 4 ) ) & 0x0f0f0f0f0f0f0f0fULL;
+	return ( v * 0x0101010101010101ULL ) >> 56;
+    }
+
+    unsigned int hammingScalar( const unsigned char *a, const unsigned char *b, size_t bytes )
+    {
+	unsigned int result = 0;
+	size_t i = 0;
+	for( ; i + 8 <= bytes; i += 8 )
+	    result += popcountScalar( load64( a + i ) ^ load64( b + i ) );
+	for( ; i < bytes; i++ )
+	    result += popcountScalar( a[i] ^ b[i] );
+	return result;
+    }
+
+#ifdef STEREO_X86
+    __attribute__((target("popcnt")))
+    unsigned int hammingPopcnt( const unsigned char *a, const unsigned char *b, size_t bytes )
+    {
+	unsigned int result = 0;
+	size_t i = 0;
+	for( ; i + 8 <= bytes; i += 8 )
+	    result += __builtin_popcountll( load64( a + i ) ^ load64( b + i ) );
+	for( ; i < bytes; i++ )
+	    result += __builtin_popcount( a[i] ^ b[i] );
+	return result;
+    }
+
+    __attribute__((target("avx2,popcnt")))
+    unsigned int hammingAvx2( const unsigned char *a, const unsigned char *b, size_t bytes )
+    {
+	// count the bits of each nibble with a lookup table, and sum up the
+	// bytes with sad against zero
+	const __m256i lookup = _mm256_setr_epi8(
+		0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+		0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4 );
+	const __m256i low = _mm256_set1_epi8( 0x0f );
+	__m256i sum = _mm256_setzero_si256();
+
+	size_t i = 0;
+	for( ; i + 32 <= bytes; i += 32 )
+	{
+	    const __m256i x = _mm256_xor_si256(
+		    _mm256_loadu_si256( (const __m256i*)( a + i ) ),
+		    _mm256_loadu_si256( (const __m256i*)( b + i ) ) );
+	    const __m256i counts = _mm256_add_epi8(
+		    _mm256_shuffle_epi8( lookup, _mm256_and_si256( x, low ) ),
+		    _mm256_shuffle_epi8( lookup, _mm256_and_si256( _mm256_srli_epi16( x, 4 ), low ) ) );
+	    sum = _mm256_add_epi64( sum, _mm256_sad_epu8( counts, _mm256_setzero_si256() ) );
+	}
+
+	uint64_t result =
+	    (uint64_t)_mm256_extract_epi64( sum, 0 ) + (uint64_t)_mm256_extract_epi64( sum, 1 ) +
+	    (uint64_t)_mm256_extract_epi64( sum, 2 ) + (uint64_t)_mm256_extract_epi64( sum, 3 );
+	for( ; i + 8 <= bytes; i += 8 )
+	    result += __builtin_popcountll( load64( a + i ) ^ load64( b + i ) );
+	for( ; i < bytes; i++ )
+	    result += __builtin_popcount( a[i] ^ b[i] );
+	return result;
+    }
+#endif
+
+    const CpuImplementation<HammingFunction>& getImplementation()
+    {
+	static const CpuImplementation<HammingFunction> implementations[] = {
+#ifdef STEREO_X86
+	    { &hammingAvx2, "avx2", CPU_AVX2 | CPU_POPCNT },
+	    { &hammingPopcnt, "popcnt", CPU_POPCNT },
+#endif
+	    { &hammingScalar, "scalar", 0 } };
+	static const CpuImplementation<HammingFunction> &implementation = selectCpuImplementation( implementations );
+	return implementation;
+    }
+}
+
+unsigned int stereo::hammingDistance( const unsigned char *a, const unsigned char *b, size_t bytes )
+{
+    return getImplementation().function( a, b, bytes );
+}
+
+const char* stereo::getHammingImplementation()
+{
+    return getImplementation().name;
+}
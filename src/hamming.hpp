@@ -0,0 +1,25 @@
+#ifndef __STEREO_HAMMING_HPP__
+#define __STEREO_HAMMING_HPP__
+
+#include <stddef.h>
+
+namespace stereo
+{
+
+/** @result the number of differing bits between the binary descriptors a and
+ * b, which are both @param bytes long.
+ *
+ * The implementation is selected at runtime from the instruction sets the
+ * cpu supports: AVX2, the popcnt instruction (SSE4.2) or a portable scalar
+ * version.
+ */
+unsigned int hammingDistance( const unsigned char *a, const unsigned char *b, size_t bytes );
+
+/** @result the name of the implementation used by hammingDistance(), e.g. for
+ * benchmarks ("avx2", "popcnt" or "scalar")
+ */
+const char* getHammingImplementation();
+
+}
+
+#endif
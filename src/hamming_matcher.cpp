@@ -0,0 +1,281 @@
+#include "hamming_matcher.hpp"
+#include "hamming.hpp"
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+using namespace stereo;
+
+namespace
+{
+    /** @result the bits [offset, offset + bits) of a descriptor with the
+     * given number of bytes, for bits <= 16 */
+    inline int getSubstring( const unsigned char *descriptor, int bytes, int offset, int bits )
+    {
+	const int first = offset / 8;
+	unsigned int value = 0;
+	for( int b = 0; b < 3 && first + b < bytes; b++ )
+	    value |= (unsigned int)descriptor[first + b] << ( 8 * b );
+	return ( value >> ( offset % 8 ) ) & ( ( 1u << bits ) - 1 );
+    }
+
+    /** @result the next larger integer with the same number of set bits */
+    inline unsigned int nextCombination( unsigned int mask )
+    {
+	const unsigned int lowest = mask & -mask;
+	const unsigned int ripple = mask + lowest;
+	return ( ( ( ripple ^ mask ) >> 2 ) / lowest ) | ripple;
+    }
+
+    double binomial( int n, int k )
+    {
+	double result = 1;
+	for( int i = 1; i <= k; i++ )
+	    result = result * ( n - k + i ) / i;
+	return result;
+    }
+}
+
+HammingMatcher::HammingMatcher( Mode mode )
+    : mode( mode ), trained( false ), stamp( 0 )
+{
+}
+
+void HammingMatcher::add( const std::vector<cv::Mat>& descriptors )
+{
+    for( size_t i = 0; i < descriptors.size(); i++ )
+	checkDescriptors( descriptors[i] );
+    cv::DescriptorMatcher::add( descriptors );
+    trained = false;
+}
+
+void HammingMatcher::clear()
+{
+    cv::DescriptorMatcher::clear();
+    mergedDescriptors.clear();
+    tables.clear();
+    trained = false;
+}
+
+void HammingMatcher::train()
+{
+    if( trained )
+	return;
+
+    mergedDescriptors.set( trainDescCollection );
+    if( mode == MULTI_INDEX_HASHING )
+	buildIndex();
+    trained = true;
+}
+
+cv::Ptr<cv::DescriptorMatcher> HammingMatcher::clone( bool emptyTrainData ) const
+{
+    HammingMatcher *matcher = new HammingMatcher( mode );
+    if( !emptyTrainData )
+    {
+	for( size_t i = 0; i < trainDescCollection.size(); i++ )
+	    matcher->trainDescCollection.push_back( trainDescCollection[i].clone() );
+    }
+    return matcher;
+}
+
+void HammingMatcher::checkDescriptors( const cv::Mat& descriptors ) const
+{
+    if( !descriptors.empty() && descriptors.type() != CV_8U )
+	throw std::runtime_error( "HammingMatcher: only binary descriptors of type CV_8U are supported" );
+}
+
+void HammingMatcher::buildIndex()
+{
+    const cv::Mat &train( mergedDescriptors.getDescriptors() );
+    tables.clear();
+    if( train.empty() )
+	return;
+
+    // substrings of about log2(n) bits give buckets with about one entry
+    const int totalBits = train.cols * 8;
+    const int n = train.rows;
+    const int substringBits = std::min( totalBits,
+	    std::max( 4, std::min( 16, (int)std::floor( std::log( (double)n ) / std::log( 2.0 ) + 0.5 ) ) ) );
+
+    for( int offset = 0; offset < totalBits; offset += substringBits )
+    {
+	Table table;
+	table.offset = offset;
+	table.bits = std::min( substringBits, totalBits - offset );
+
+	// count the entries per bucket, and fill them in consecutively
+	table.buckets.assign( ( 1 << table.bits ) + 1, 0 );
+	std::vector<int> keys( n );
+	for( int i = 0; i < n; i++ )
+	{
+	    keys[i] = getSubstring( train.ptr<unsigned char>( i ), train.cols, table.offset, table.bits );
+	    table.buckets[keys[i] + 1]++;
+	}
+	for( size_t b = 1; b < table.buckets.size(); b++ )
+	    table.buckets[b] += table.buckets[b - 1];
+
+	table.indices.resize( n );
+	std::vector<int> fill( table.buckets.begin(), table.buckets.end() - 1 );
+	for( int i = 0; i < n; i++ )
+	    table.indices[fill[keys[i]]++] = i;
+
+	tables.push_back( table );
+    }
+
+    visited.assign( n, 0 );
+    stamp = 0;
+}
+
+void HammingMatcher::compare( const unsigned char *query, int index, size_t k, std::vector<Candidate>& best )
+{
+    const cv::Mat &train( mergedDescriptors.getDescriptors() );
+    const unsigned int distance = hammingDistance( query, train.ptr<unsigned char>( index ), train.cols );
+    if( best.size() == k && distance >= best.back().distance )
+	return;
+
+    // insert into the sorted list of the k best candidates
+    Candidate candidate = { distance, index };
+    if( best.size() < k )
+	best.push_back( candidate );
+    else
+	best.back() = candidate;
+    for( size_t i = best.size() - 1; i > 0 && best[i].distance < best[i - 1].distance; i-- )
+	std::swap( best[i], best[i - 1] );
+}
+
+void HammingMatcher::searchBruteForce( const unsigned char *query, size_t k, std::vector<Candidate>& best )
+{
+    const int n = mergedDescriptors.getDescriptors().rows;
+    for( int i = 0; i < n; i++ )
+	compare( query, i, k, best );
+}
+
+void HammingMatcher::searchIndex( const unsigned char *query, size_t k, std::vector<Candidate>& best )
+{
+    const cv::Mat &train( mergedDescriptors.getDescriptors() );
+    const int n = train.rows;
+    const int m = tables.size();
+
+    if( ++stamp == 0 )
+    {
+	visited.assign( n, 0 );
+	stamp = 1;
+    }
+
+    std::vector<int> keys( m );
+    int maxBits = 0;
+    for( int t = 0; t < m; t++ )
+    {
+	keys[t] = getSubstring( query, train.cols, tables[t].offset, tables[t].bits );
+	maxBits = std::max( maxBits, tables[t].bits );
+    }
+
+    int numVisited = 0;
+    for( int r = 0; r <= maxBits; r++ )
+    {
+	// probing gets more expensive than comparing with all remaining
+	// descriptors at larger radii
+	double probes = 0;
+	for( int t = 0; t < m; t++ )
+	    probes += binomial( tables[t].bits, std::min( r, tables[t].bits ) );
+	if( probes > n - numVisited )
+	{
+	    for( int i = 0; i < n; i++ )
+		if( visited[i] != stamp )
+		    compare( query, i, k, best );
+	    return;
+	}
+
+	for( int t = 0; t < m; t++ )
+	{
+	    const Table &table( tables[t] );
+	    if( r > table.bits )
+		continue;
+
+	    // all keys with a substring distance of exactly r
+	    const unsigned int end = 1u << table.bits;
+	    for( unsigned int mask = ( 1u << r ) - 1; mask < end; mask = nextCombination( mask ) )
+	    {
+		const int key = keys[t] ^ mask;
+		for( int b = table.buckets[key]; b < table.buckets[key + 1]; b++ )
+		{
+		    const int index = table.indices[b];
+		    if( visited[index] == stamp )
+			continue;
+		    visited[index] = stamp;
+		    numVisited++;
+		    compare( query, index, k, best );
+		}
+		if( mask == 0 )
+		    break;
+	    }
+	}
+
+	// a descriptor with a distance below m * (r + 1) has at least one
+	// substring within a distance of r, so it has been seen already
+	if( numVisited == n || ( best.size() == k && best.back().distance < (unsigned int)( m * ( r + 1 ) ) ) )
+	    return;
+    }
+}
+
+void HammingMatcher::toMatches( int queryIdx, const std::vector<Candidate>& best, std::vector<cv::DMatch>& matches ) const
+{
+    matches.clear();
+    for( size_t i = 0; i < best.size(); i++ )
+    {
+	int imgIdx, trainIdx;
+	mergedDescriptors.getLocalIdx( best[i].index, imgIdx, trainIdx );
+	matches.push_back( cv::DMatch( queryIdx, trainIdx, imgIdx, (float)best[i].distance ) );
+    }
+}
+
+void HammingMatcher::knnMatchImpl( const cv::Mat& queryDescriptors, std::vector<std::vector<cv::DMatch> >& matches, int k,
+	const std::vector<cv::Mat>& masks, bool compactResult )
+{
+    checkDescriptors( queryDescriptors );
+    const cv::Mat &train( mergedDescriptors.getDescriptors() );
+    if( queryDescriptors.cols != train.cols )
+	throw std::runtime_error( "HammingMatcher: query and train descriptors differ in size" );
+
+    matches.resize( queryDescriptors.rows );
+    std::vector<Candidate> best;
+    for( int q = 0; q < queryDescriptors.rows; q++ )
+    {
+	best.clear();
+	const unsigned char *query = queryDescriptors.ptr<unsigned char>( q );
+	if( mode == MULTI_INDEX_HASHING && !tables.empty() )
+	    searchIndex( query, k, best );
+	else
+	    searchBruteForce( query, k, best );
+	toMatches( q, best, matches[q] );
+    }
+}
+
+void HammingMatcher::radiusMatchImpl( const cv::Mat& queryDescriptors, std::vector<std::vector<cv::DMatch> >& matches, float maxDistance,
+	const std::vector<cv::Mat>& masks, bool compactResult )
+{
+    checkDescriptors( queryDescriptors );
+    const cv::Mat &train( mergedDescriptors.getDescriptors() );
+    if( queryDescriptors.cols != train.cols )
+	throw std::runtime_error( "HammingMatcher: query and train descriptors differ in size" );
+
+    matches.resize( queryDescriptors.rows );
+    std::vector<Candidate> best;
+    for( int q = 0; q < queryDescriptors.rows; q++ )
+    {
+	best.clear();
+	const unsigned char *query = queryDescriptors.ptr<unsigned char>( q );
+	for( int i = 0; i < train.rows; i++ )
+	{
+	    const unsigned int distance = hammingDistance( query, train.ptr<unsigned char>( i ), train.cols );
+	    if( distance < maxDistance )
+	    {
+		Candidate candidate = { distance, i };
+		best.push_back( candidate );
+	    }
+	}
+	std::sort( best.begin(), best.end(), []( const Candidate& a, const Candidate& b ) { return a.distance < b.distance; } );
+	toMatches( q, best, matches[q] );
+    }
+}
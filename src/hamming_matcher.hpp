@@ -0,0 +1,83 @@
+#ifndef __STEREO_HAMMING_MATCHER_HPP__
+#define __STEREO_HAMMING_MATCHER_HPP__
+
+#include <opencv2/features2d/features2d.hpp>
+#include <vector>
+
+namespace stereo
+{
+
+/**
+ * Descriptor matcher for binary descriptors (CV_8U rows, e.g. ORB or BRIEF)
+ * using the hamming distance, with the hardware popcount selected at
+ * runtime in hammingDistance().
+ *
+ * In BRUTE_FORCE mode, each query is compared against all train
+ * descriptors. In MULTI_INDEX_HASHING mode, the train descriptors are split
+ * into substrings of about log2(n) bits, and each substring is indexed in a
+ * hash table. A query probes the tables with increasing substring radius
+ * and stops as soon as the k nearest neighbours are known to be exact, so
+ * the result is the same as with brute force, but only a fraction of the
+ * train descriptors is compared for large sets.
+ *
+ * Masks are not supported, and radiusMatch always uses brute force.
+ */
+class HammingMatcher : public cv::DescriptorMatcher
+{
+public:
+    enum Mode
+    {
+	BRUTE_FORCE,
+	MULTI_INDEX_HASHING,
+    };
+
+    explicit HammingMatcher( Mode mode = BRUTE_FORCE );
+
+    virtual void add( const std::vector<cv::Mat>& descriptors );
+    virtual void clear();
+    virtual void train();
+
+    virtual bool isMaskSupported() const { return false; }
+    virtual cv::Ptr<cv::DescriptorMatcher> clone( bool emptyTrainData = false ) const;
+
+protected:
+    virtual void knnMatchImpl( const cv::Mat& queryDescriptors, std::vector<std::vector<cv::DMatch> >& matches, int k,
+	    const std::vector<cv::Mat>& masks = std::vector<cv::Mat>(), bool compactResult = false );
+    virtual void radiusMatchImpl( const cv::Mat& queryDescriptors, std::vector<std::vector<cv::DMatch> >& matches, float maxDistance,
+	    const std::vector<cv::Mat>& masks = std::vector<cv::Mat>(), bool compactResult = false );
+
+private:
+    struct Candidate
+    {
+	unsigned int distance;
+	int index;
+    };
+
+    /** hash table for one substring, with the train indices of all buckets
+     * stored consecutively */
+    struct Table
+    {
+	int offset, bits;
+	std::vector<int> buckets;
+	std::vector<int> indices;
+    };
+
+    void checkDescriptors( const cv::Mat& descriptors ) const;
+    void buildIndex();
+    void compare( const unsigned char *query, int index, size_t k, std::vector<Candidate>& best );
+    void searchBruteForce( const unsigned char *query, size_t k, std::vector<Candidate>& best );
+    void searchIndex( const unsigned char *query, size_t k, std::vector<Candidate>& best );
+    void toMatches( int queryIdx, const std::vector<Candidate>& best, std::vector<cv::DMatch>& matches ) const;
+
+    Mode mode;
+    bool trained;
+    DescriptorCollection mergedDescriptors;
+
+    std::vector<Table> tables;
+    std::vector<unsigned int> visited;
+    unsigned int stamp;
+};
+
+}
+
+#endif
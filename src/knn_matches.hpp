@@ -0,0 +1,57 @@
+#ifndef __STEREO_KNN_MATCHES_HPP__
+#define __STEREO_KNN_MATCHES_HPP__
+
+#include <vector>
+
+namespace stereo
+{
+
+/**
+ * The k best matches of a set of query descriptors, stored in flat arrays
+ * with k slots per query, sorted by distance.
+ *
+ * In contrast to a std::vector<std::vector<cv::DMatch> >, resizing keeps the
+ * allocated memory, so a KnnMatches object which is reused for every frame
+ * does not allocate once it has reached its largest size.
+ */
+struct KnnMatches
+{
+    KnnMatches() : k( 0 ) {}
+
+    /** clear the matches and make room for rows queries with up to k matches */
+    void resize( int rows, int k )
+    {
+	this->k = k;
+	indices.resize( rows * k );
+	distances.resize( rows * k );
+	counts.assign( rows, 0 );
+    }
+
+    int size() const { return counts.size(); }
+
+    int getCount( int query ) const { return counts[query]; }
+    int getIndex( int query, int n ) const { return indices[query * k + n]; }
+    float getDistance( int query, int n ) const { return distances[query * k + n]; }
+
+    /** append a match to a query, which needs to be at least as far away as
+     * the ones before */
+    void push( int query, int index, float distance )
+    {
+	int &count( counts[query] );
+	if( count < k )
+	{
+	    indices[query * k + count] = index;
+	    distances[query * k + count] = distance;
+	    count++;
+	}
+    }
+
+    int k;
+    std::vector<int> indices;
+    std::vector<float> distances;
+    std::vector<int> counts;
+};
+
+}
+
+#endif
@@ -1,10 +1,225 @@
 #include "ransac.hpp"
+#include "cpu_dispatch.hpp"
 #include <math.h> 
 #include <boost/concept_check.hpp>
 
+using namespace stereo;
 using namespace stereo::ransac;
 using namespace Eigen;
 
+namespace
+{
+    /** @result the vector orthogonal to a, b and c, which is the
+     * generalization of the cross product to 4d. Computed from the 2x2
+     * minors of a and b. */
+    Vector4d cross4( const Vector4d& a, const Vector4d& b, const Vector4d& c )
+    {
+	const double m01 = a(0)*b(1) - a(1)*b(0);
+	const double m02 = a(0)*b(2) - a(2)*b(0);
+	const double m03 = a(0)*b(3) - a(3)*b(0);
+	const double m12 = a(1)*b(2) - a(2)*b(1);
+	const double m13 = a(1)*b(3) - a(3)*b(1);
+	const double m23 = a(2)*b(3) - a(3)*b(2);
+	return Vector4d(
+		c(1)*m23 - c(2)*m13 + c(3)*m12,
+		-c(0)*m23 + c(2)*m03 - c(3)*m02,
+		c(0)*m13 - c(1)*m03 + c(3)*m01,
+		-c(0)*m12 + c(1)*m02 - c(2)*m01 );
+    }
+
+    /** closed form for the eigenvector of the largest eigenvalue of the
+     * symmetric and traceless 4x4 matrix q.
+     *
+     * The largest root of the characteristic polynomial is found
+     * iteratively, starting from an upper bound for it. The eigenvector is
+     * orthogonal to the rows of q - lambda*I. @result false if the
+     * eigenvalue is not a single one, in which case there is no unique
+     * solution, or if it is too close to another one for an accurate result.
+     */
+    bool largestEigenvector( const Matrix4d& q, Vector4d& v )
+    {
+	// det(lambda*I - q) = lambda^4 + c2*lambda^2 + c1*lambda + c0 
+	const Matrix4d q2 = q * q;
+	const double trace2 = q2.trace();
+	const double c2 = -0.5 * trace2;
+	const double c1 = -q2.cwiseProduct( q ).sum() / 3.0;
+	const double c0 = q.determinant();
+
+	const double norm = sqrt( trace2 );
+	if( norm <= 0 )
+	    return false;
+
+	// Laguerre's method converges monotonically to the largest root when
+	// started above it, since all roots are real. As the eigenvalues sum
+	// up to zero, the largest one is at most sqrt(3/4) times the frobenius
+	// norm.
+	double lambda = sqrt( 0.75 ) * norm;
+	for( int i = 0; i < 20; i++ )
+	{
+	    const double l2 = lambda * lambda;
+	    const double f = ( l2 + c2 ) * l2 + c1 * lambda + c0;
+	    if( f == 0 )
+		break;
+	    const double df = ( 4.0 * l2 + 2.0 * c2 ) * lambda + c1;
+	    const double ddf = 12.0 * l2 + 2.0 * c2;
+	    const double g = df / f;
+	    const double h = g * g - ddf / f;
+	    const double root = sqrt( std::max( 0.0, 3.0 * ( 4.0 * h - g * g ) ) );
+	    const double denominator = g >= 0 ? g + root : g - root;
+	    if( denominator == 0 )
+		break;
+	    const double step = 4.0 / denominator;
+	    lambda -= step;
+	    if( fabs( step ) < 1e-12 * norm )
+		break;
+	}
+
+	// the derivative at the root is the product of the distances to the
+	// other eigenvalues. If one of them is close, the result is not
+	// accurate.
+	const double gap = ( 4.0 * lambda * lambda + 2.0 * c2 ) * lambda + c1;
+	if( !( gap > 1e-4 * norm * norm * norm ) )
+	    return false;
+
+	// take the best conditioned of the vectors orthogonal to three of
+	// the rows
+	const Matrix4d m = q - lambda * Matrix4d::Identity();
+	const Vector4d r0 = m.row( 0 ), r1 = m.row( 1 ), r2 = m.row( 2 ), r3 = m.row( 3 );
+	const Vector4d candidates[4] = { 
+	    cross4( r1, r2, r3 ), cross4( r0, r2, r3 ), cross4( r0, r1, r3 ), cross4( r0, r1, r2 ) };
+	int best = 0;
+	for( int i = 1; i < 4; i++ )
+	    if( candidates[i].squaredNorm() > candidates[best].squaredNorm() )
+		best = i;
+
+	const double length = candidates[best].norm();
+	if( !( length > 1e-9 * norm * norm * norm ) )
+	    return false;
+
+	v = candidates[best] / length;
+	return true;
+    }
+
+    /** the rotation and translation of the model, row major */
+    struct RigidTransform
+    {
+	double r[9], t[3];
+
+	explicit RigidTransform( const Affine3d& model )
+	{
+	    for( int i = 0; i < 3; i++ )
+	    {
+		for( int j = 0; j < 3; j++ )
+		    r[i * 3 + j] = model( i, j );
+		t[i] = model( i, 3 );
+	    }
+	}
+    };
+
+    typedef size_t (*ScoreFunction)( const PointArrays& x, const PointArrays& p, const double *scale, 
+	    const RigidTransform& m, double threshold2, size_t begin, size_t end, unsigned char *mask );
+
+    size_t scoreScalar( const PointArrays& x, const PointArrays& p, const double *scale, 
+	    const RigidTransform& m, double threshold2, size_t begin, size_t end, unsigned char *mask )
+    {
+	size_t count = 0;
+	for( size_t i = begin; i < end; i++ )
+	{
+	    const double px = p.x[i], py = p.y[i], pz = p.z[i];
+	    const double dx = x.x[i] - ( m.r[0] * px + m.r[1] * py + m.r[2] * pz + m.t[0] );
+	    const double dy = x.y[i] - ( m.r[3] * px + m.r[4] * py + m.r[5] * pz + m.t[1] );
+	    const double dz = x.z[i] - ( m.r[6] * px + m.r[7] * py + m.r[8] * pz + m.t[2] );
+	    const double limit = scale ? threshold2 * scale[i] : threshold2;
+	    mask[i] = dx * dx + dy * dy + dz * dz < limit;
+	    count += mask[i];
+	}
+	return count;
+    }
+
+#ifdef STEREO_X86
+    __attribute__((target("avx")))
+    size_t scoreAvx( const PointArrays& x, const PointArrays& p, const double *scale, 
+	    const RigidTransform& m, double threshold2, size_t begin, size_t end, unsigned char *mask )
+    {
+	__m256d r[9], t[3];
+	for( int i = 0; i < 9; i++ )
+	    r[i] = _mm256_set1_pd( m.r[i] );
+	for( int i = 0; i < 3; i++ )
+	    t[i] = _mm256_set1_pd( m.t[i] );
+	const __m256d vthreshold2 = _mm256_set1_pd( threshold2 );
+
+	// four samples at once
+	size_t count = 0;
+	size_t i = begin;
+	for( ; i + 4 <= end; i += 4 )
+	{
+	    const __m256d px = _mm256_loadu_pd( &p.x[i] );
+	    const __m256d py = _mm256_loadu_pd( &p.y[i] );
+	    const __m256d pz = _mm256_loadu_pd( &p.z[i] );
+
+	    const __m256d qx = _mm256_add_pd( _mm256_add_pd( _mm256_mul_pd( r[0], px ), _mm256_mul_pd( r[1], py ) ), 
+		    _mm256_add_pd( _mm256_mul_pd( r[2], pz ), t[0] ) );
+	    const __m256d qy = _mm256_add_pd( _mm256_add_pd( _mm256_mul_pd( r[3], px ), _mm256_mul_pd( r[4], py ) ), 
+		    _mm256_add_pd( _mm256_mul_pd( r[5], pz ), t[1] ) );
+	    const __m256d qz = _mm256_add_pd( _mm256_add_pd( _mm256_mul_pd( r[6], px ), _mm256_mul_pd( r[7], py ) ), 
+		    _mm256_add_pd( _mm256_mul_pd( r[8], pz ), t[2] ) );
+
+	    const __m256d dx = _mm256_sub_pd( _mm256_loadu_pd( &x.x[i] ), qx );
+	    const __m256d dy = _mm256_sub_pd( _mm256_loadu_pd( &x.y[i] ), qy );
+	    const __m256d dz = _mm256_sub_pd( _mm256_loadu_pd( &x.z[i] ), qz );
+	    const __m256d d2 = _mm256_add_pd( _mm256_add_pd( _mm256_mul_pd( dx, dx ), _mm256_mul_pd( dy, dy ) ), 
+		    _mm256_mul_pd( dz, dz ) );
+
+	    const __m256d limit = scale ? _mm256_mul_pd( vthreshold2, _mm256_loadu_pd( scale + i ) ) : vthreshold2;
+	    const int bits = _mm256_movemask_pd( _mm256_cmp_pd( d2, limit, _CMP_LT_OQ ) );
+	    for( int k = 0; k < 4; k++ )
+		mask[i + k] = ( bits >> k ) & 1;
+	    count += __builtin_popcount( bits );
+	}
+
+	if( i < end )
+	    count += scoreScalar( x, p, scale, m, threshold2, i, end, mask );
+	return count;
+    }
+#endif
+
+    const CpuImplementation<ScoreFunction>& getScoreFunction()
+    {
+	static const CpuImplementation<ScoreFunction> implementations[] = {
+#ifdef STEREO_X86
+	    { &scoreAvx, "avx", CPU_AVX },
+#endif
+	    { &scoreScalar, "scalar", 0 } };
+	static const CpuImplementation<ScoreFunction> &implementation = selectCpuImplementation( implementations );
+	return implementation;
+    }
+}
+
+void PointArrays::assign( const std::vector<Vector3d>& points )
+{
+    x.resize( points.size() );
+    y.resize( points.size() );
+    z.resize( points.size() );
+    for( size_t i = 0; i < points.size(); i++ )
+    {
+	x[i] = points[i].x();
+	y[i] = points[i].y();
+	z[i] = points[i].z();
+    }
+}
+
+size_t stereo::ransac::scoreTransform( const PointArrays& x, const PointArrays& p, const double *scale, 
+	const Affine3d& model, double threshold2, size_t begin, size_t end, unsigned char *mask )
+{
+    assert( x.size() == p.size() && end <= x.size() );
+    return getScoreFunction().function( x, p, scale, RigidTransform( model ), threshold2, begin, end, mask );
+}
+
+const char* stereo::ransac::getScoreImplementation()
+{
+    return getScoreFunction().name;
+}
+
 
 void Pairs::add( const Vector3d& a, const Vector3d& b, double dist )
 {
@@ -69,33 +284,36 @@ Affine3d Pairs::getTransform()
 
     sigma_px = sigma_px * n_inv - mu_p*mu_x.transpose();
 
+    mse = mu_d;
+
+    return getTransform( mu_x, mu_p, sigma_px );
+}
+
+Affine3d Pairs::getTransform( const Vector3d& mu_x, const Vector3d& mu_p, const Matrix3d& sigma_px )
+{
     // form the symmetric 4x4 matrix Q
     Matrix3d A = sigma_px-sigma_px.transpose();
     Vector3d delta = Vector3d( A(1,2), A(2,0), A(0,1) );
 
     Matrix4d q_px;
     q_px << sigma_px.trace(), delta.transpose(), 
-	 delta, A - Matrix3d::Identity() * sigma_px.trace();
-
-    // do an eigenvalue decomposition of Q
-    Quaterniond q_R;
-    EigenSolver<Matrix4d> eigenSolver(q_px);
-    double max_eig = eigenSolver.eigenvalues().real().maxCoeff();
-    for(int i=0;i<eigenSolver.eigenvalues().rows();i++) {
-	if(eigenSolver.eigenvalues()(i) == max_eig) {
-	    Vector4d max_eigv = eigenSolver.eigenvectors().col(i).real();
-	    q_R = Quaterniond( max_eigv(0), max_eigv(1), max_eigv(2), max_eigv(3) );
-	    break;
-	}
+	 delta, sigma_px + sigma_px.transpose() - Matrix3d::Identity() * sigma_px.trace();
+
+    // the rotation is the eigenvector of the largest eigenvalue of Q. Use
+    // the closed form, and the iterative solver only if it is not unique
+    // (e.g. for collinear points). The eigenvalues of the solver are
+    // sorted in increasing order.
+    Vector4d max_eigv;
+    if( !largestEigenvector( q_px, max_eigv ) )
+    {
+	SelfAdjointEigenSolver<Matrix4d> eigenSolver( q_px );
+	max_eigv = eigenSolver.eigenvectors().col( 3 );
     }
+    const Quaterniond q_R( max_eigv(0), max_eigv(1), max_eigv(2), max_eigv(3) );
 
     // resulting transformation that will align p to x, if applied to p 
     Vector3d q_T = mu_x - q_R * mu_p;
-    Affine3d t( Translation3d( q_T ) * q_R );
-
-    mse = mu_d;
-    
-    return t;
+    return Affine3d( Translation3d( q_T ) * q_R );
 }
 
 size_t Pairs::size() const 
@@ -115,3 +333,75 @@ void Pairs::clear()
     p.clear();
 }
 
+
+ProsacSampler::ProsacSampler( size_t nSamples, size_t kernelSize, size_t growthLimit )
+    : nSamples( nSamples ), kernelSize( kernelSize ), growthLimit( growthLimit ),
+    n( kernelSize ), t( 0 ), growth( nSamples + 1, 0 )
+{
+    // expected number of samples out of growthLimit, which only contain
+    // correspondences of the first n ones (T_n in the paper)
+    double tn = growthLimit;
+    for( size_t i = 0; i < kernelSize; i++ )
+	tn *= static_cast<double>( kernelSize - i ) / ( nSamples - i );
+
+    growth[kernelSize] = 1;
+    for( size_t i = kernelSize; i < nSamples; i++ )
+    {
+	const double tnNext = tn * ( i + 1 ) / ( i + 1 - kernelSize );
+	growth[i + 1] = growth[i] + std::max( 1.0, ceil( tnNext - tn ) );
+	tn = tnNext;
+    }
+}
+
+Sprt::Sprt( double epsilon, double delta, double modelCost )
+    : epsilon( epsilon ), delta( delta ), modelCost( modelCost ), 
+    lambda( 1.0 ), sumConsistent( 0 ), sumTested( 0 )
+{
+    updateThreshold();
+}
+
+void Sprt::updateThreshold()
+{
+    consistentFactor = delta / epsilon;
+    inconsistentFactor = ( 1.0 - delta ) / ( 1.0 - epsilon );
+
+    // the threshold A is the solution of A = modelCost * C + 1 + log(A),
+    // which is found by fixed point iteration
+    const double c = ( 1.0 - delta ) * log( ( 1.0 - delta ) / ( 1.0 - epsilon ) ) 
+	+ delta * log( delta / epsilon );
+    threshold = modelCost * c + 1.0;
+    for( int i = 0; i < 10; i++ )
+    {
+	const double next = modelCost * c + 1.0 + log( threshold );
+	const bool converged = fabs( next - threshold ) < 1e-6;
+	threshold = next;
+	if( converged )
+	    break;
+    }
+}
+
+void Sprt::rejected( size_t consistent, size_t tested )
+{
+    sumConsistent += consistent;
+    sumTested += tested;
+
+    // delta is the mean ratio of consistent samples of the rejected
+    // hypotheses. It has to stay below epsilon for the test to work.
+    const double estimate = std::min( std::max( static_cast<double>( sumConsistent ) / sumTested, 1e-4 ), epsilon * 0.5 );
+    if( fabs( estimate - delta ) > 0.05 * delta )
+    {
+	delta = estimate;
+	updateThreshold();
+    }
+}
+
+void Sprt::accepted( size_t inliers, size_t nSamples )
+{
+    const double ratio = static_cast<double>( inliers ) / nSamples;
+    if( ratio > epsilon )
+    {
+	epsilon = std::min( ratio, 0.99 );
+	delta = std::min( delta, epsilon * 0.5 );
+	updateThreshold();
+    }
+}
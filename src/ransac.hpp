@@ -2,10 +2,17 @@
 #define __STEREO_RANSAC_HPP__
 
 #include <stdlib.h>
+#include <stdint.h>
+#include <algorithm>
+#include <atomic>
 #include <iostream>
+#include <random>
 #include <vector>
 #include <Eigen/LU> 
 #include <Eigen/Eigenvalues> 
+#include <Eigen/StdVector> 
+
+#include "thread_pool.hpp"
 
 namespace stereo
 {
@@ -13,6 +20,7 @@ namespace ransac
 {
 
 typedef std::vector<size_t> vector_size_t;
+typedef std::vector<unsigned char> vector_mask_t;
 
 
 class Pairs
@@ -34,6 +42,13 @@ public:
      */
     Eigen::Affine3d getTransform();
 
+    /** same as above, but from the means of the points in x and p, and the
+     * cross-covariance sum((p-mu_p)*(x-mu_x)^T)/n. Only uses fixed size
+     * matrices, so there are no heap allocations.
+     */
+    static Eigen::Affine3d getTransform( const Eigen::Vector3d& mu_x, const Eigen::Vector3d& mu_p, 
+	    const Eigen::Matrix3d& sigma_px );
+
     double getMeanSquareError() const;
 
     /** will return the number of pairs in the object
@@ -61,21 +76,67 @@ public:
     double mse;
 };
 
-struct FitTransform
+/**
+ * The 3d points of a fit model as structure of arrays, so that the samples
+ * can be processed in batches with simd instructions.
+ */
+struct PointArrays
+{
+    std::vector<double> x, y, z;
+
+    void assign( const std::vector<Eigen::Vector3d>& points );
+    size_t size() const { return x.size(); }
+};
+
+/** test the samples [begin, end) against the transform model, which is
+ * applied to the points p. The sample i is an inlier if
+ *
+ *   |x_i - model * p_i|^2 < threshold2 * scale_i
+ *
+ * where scale is optional and 1 if NULL. The result of each sample is
+ * written to mask[i].
+ *
+ * Uses AVX if the cpu supports it.
+ *
+ * @result the number of inliers in the range
+ */
+size_t scoreTransform( const PointArrays& x, const PointArrays& p, const double *scale, 
+	const Eigen::Affine3d& model, double threshold2, size_t begin, size_t end, unsigned char *mask );
+
+/** @result the name of the scoreTransform kernel in use ("avx" or "scalar") */
+const char* getScoreImplementation();
+
+/**
+ * Common part of the fit models for a transform between two point sets,
+ * with the error function given by the derived class as
+ *
+ *   double testSample( size_t index, const Eigen::Affine3d& model ) const
+ *   const double* getErrorScale() const
+ *
+ * which are called without virtual dispatch. The error scale is the factor
+ * of the squared threshold per sample for the batch scoring, or NULL for
+ * none.
+ */
+template <typename Derived>
+struct FitTransformBase
 {
     typedef Eigen::Affine3d Model;
     typedef double Real;
 
     const std::vector<Eigen::Vector3d>& x, p;
     double errorThreshold;
+    /// copies of x and p for the batch scoring
+    PointArrays xa, pa;
 
-    FitTransform( const std::vector<Eigen::Vector3d>& x, const std::vector<Eigen::Vector3d>& p, double errorThreshold = 0.1 )
+    FitTransformBase( const std::vector<Eigen::Vector3d>& x, const std::vector<Eigen::Vector3d>& p, double errorThreshold )
 	: x( x ), p( p ), errorThreshold( errorThreshold ) 
     {
 	assert( x.size() == p.size() );
+	xa.assign( x );
+	pa.assign( p );
     }
 
-    virtual ~FitTransform() {};
+    const Derived& derived() const { return static_cast<const Derived&>( *this ); }
 
     size_t getSampleCount( void ) const
     {
@@ -90,22 +151,64 @@ struct FitTransform
 	    return false;
 	}
 
-	stereo::ransac::Pairs pairs;
+	// minimal sample of the ransac
+	if( useIndices.size() == 3 )
+	    return fitModel<3>( &useIndices[0], model );
+
+	// accumulate the moments of the sample directly, instead of copying
+	// the points into a Pairs object
+	Eigen::Vector3d mu_x( Eigen::Vector3d::Zero() ), mu_p( Eigen::Vector3d::Zero() );
+	Eigen::Matrix3d sigma_px( Eigen::Matrix3d::Zero() );
 	for( size_t i = 0; i < useIndices.size(); i++ )
 	{
 	    const size_t index = useIndices[i];
 	    const Eigen::Vector3d& v1 = x[index];
 	    const Eigen::Vector3d& v2 = p[index];
-	    pairs.add( v1, v2, (v2-v1).norm() ); 
+	    mu_x += v1;
+	    mu_p += v2;
+	    sigma_px += v2 * v1.transpose();
 	}
+	const double n_inv = 1.0 / useIndices.size();
+	mu_x *= n_inv;
+	mu_p *= n_inv;
+	sigma_px = sigma_px * n_inv - mu_p * mu_x.transpose();
 
 	// get the model
-	Eigen::Affine3d m = pairs.getTransform();
+	Eigen::Affine3d m = Pairs::getTransform( mu_x, mu_p, sigma_px );
 
 	// test if the model is valid 
-	for( size_t i = 0; i < useIndices.size(); i++ )
+	return validateModel( &useIndices[0], useIndices.size(), m, model );
+    }
+
+    /** same as above, for a sample with a fixed size of N. The points of the
+     * sample are kept in fixed size matrices on the stack.
+     */
+    template <int N>
+    bool fitModel( const size_t* useIndices, Eigen::Affine3d& model ) const
+    {
+	Eigen::Matrix<double, 3, N> sx, sp;
+	for( int i = 0; i < N; i++ )
 	{
-	    double dist = testSample( useIndices[i], m ); 
+	    sx.col( i ) = x[useIndices[i]];
+	    sp.col( i ) = p[useIndices[i]];
+	}
+	const Eigen::Vector3d mu_x = sx.rowwise().mean();
+	const Eigen::Vector3d mu_p = sp.rowwise().mean();
+	sx.colwise() -= mu_x;
+	sp.colwise() -= mu_p;
+	const Eigen::Matrix3d sigma_px = sp * sx.transpose() / N;
+
+	Eigen::Affine3d m = Pairs::getTransform( mu_x, mu_p, sigma_px );
+	return validateModel( useIndices, N, m, model );
+    }
+
+    /** set model to m, if all samples of the given indices are within the
+     * error threshold of m */
+    bool validateModel( const size_t* useIndices, size_t n, const Eigen::Affine3d& m, Eigen::Affine3d& model ) const
+    {
+	for( size_t i = 0; i < n; i++ )
+	{
+	    double dist = derived().testSample( useIndices[i], m ); 
 	    if( dist > errorThreshold )
 	    {
 		return false;
@@ -116,7 +219,33 @@ struct FitTransform
 	return true;
     }
 
-    virtual double testSample( size_t index, const Eigen::Affine3d& model ) const
+    /** test the samples [begin, end) in one batch. Sets mask[i] to 1 if
+     * the error of sample i is below threshold, and 0 otherwise. 
+     * @result the number of inliers in the range
+     */
+    size_t testSamples( const Eigen::Affine3d& model, double threshold, vector_mask_t& mask, 
+	    size_t begin, size_t end ) const
+    {
+	assert( mask.size() >= end );
+	return scoreTransform( xa, pa, derived().getErrorScale(), model, threshold * threshold, begin, end, &mask[0] );
+    }
+
+    /** same as above for all samples */
+    size_t testSamples( const Eigen::Affine3d& model, double threshold, vector_mask_t& mask ) const
+    {
+	mask.resize( getSampleCount() );
+	return testSamples( model, threshold, mask, 0, getSampleCount() );
+    }
+};
+
+struct FitTransform : public FitTransformBase<FitTransform>
+{
+    FitTransform( const std::vector<Eigen::Vector3d>& x, const std::vector<Eigen::Vector3d>& p, double errorThreshold = 0.1 )
+	: FitTransformBase<FitTransform>( x, p, errorThreshold ) 
+    {
+    }
+
+    double testSample( size_t index, const Eigen::Affine3d& model ) const
     {
 	const Eigen::Vector3d& v1 = x[index];
 	const Eigen::Vector3d& v2 = model * p[index];
@@ -124,32 +253,37 @@ struct FitTransform
 	const double dist = (v2-v1).norm(); 
 	return dist;
     }
+
+    const double* getErrorScale() const { return NULL; }
 };
 
-struct FitTransformUncertain : public FitTransform
+struct FitTransformUncertain : public FitTransformBase<FitTransformUncertain>
 {
     const std::vector<float>& x_e, p_e;
+    /// e1^2 + e2^2 per sample
+    std::vector<double> errorScale;
 
     FitTransformUncertain( const std::vector<Eigen::Vector3d>& x, const std::vector<Eigen::Vector3d>& p, 
 	    const std::vector<float>& x_e, const std::vector<float>& p_e, double errorThreshold = 0.1 )
-	: FitTransform( x, p, errorThreshold ), x_e( x_e ), p_e( p_e )
+	: FitTransformBase<FitTransformUncertain>( x, p, errorThreshold ), x_e( x_e ), p_e( p_e ),
+	errorScale( x.size() )
     {
+	assert( x_e.size() == x.size() && p_e.size() == x.size() );
+	for( size_t i = 0; i < x.size(); i++ )
+	    errorScale[i] = (double)x_e[i] * x_e[i] + (double)p_e[i] * p_e[i];
     }
 
-    virtual ~FitTransformUncertain() {};
-
-    virtual double testSample( size_t index, const Eigen::Affine3d& model ) const
+    double testSample( size_t index, const Eigen::Affine3d& model ) const
     {
 	const Eigen::Vector3d& v1 = x[index];
 	const Eigen::Vector3d& v2 = model * p[index];
 
-	const float e1 = x_e[index];
-	const float e2 = p_e[index];
-
 	// TODO this is a very crude normalization for the error
-	const double dist = (v2-v1).norm() / sqrt(pow(e1,2) + pow(e2,2)); 
+	const double dist = (v2-v1).norm() / sqrt( errorScale[index] ); 
 	return dist;
     }
+
+    const double* getErrorScale() const { return errorScale.empty() ? NULL : &errorScale[0]; }
 };
 
 //
@@ -158,34 +292,232 @@ struct FitTransformUncertain : public FitTransform
 // http://code.google.com/p/mrpt/
 //
 
+/**
+ * Small and fast random number generator (xorshift64*) for the sampling.
+ * Its state is a single 64 bit integer, so it is cheap to have one per
+ * thread or per call.
+ */
+class FastRandom
+{
+public:
+    explicit FastRandom( uint64_t seed = 0 ) { this->seed( seed ); }
+
+    /** set the state from the seed with splitmix64, so that similar seeds
+     * give unrelated sequences */
+    void seed( uint64_t seed )
+    {
+	uint64_t z = seed + 0x9E3779B97F4A7C15ULL;
+	z = ( z ^ ( z >> 30 ) ) * 0xBF58476D1CE4E5B9ULL;
+	z = ( z ^ ( z >> 27 ) ) * 0x94D049BB133111EBULL;
+	state = z ^ ( z >> 31 );
+	if( !state )
+	    state = 0x9E3779B97F4A7C15ULL;
+    }
+
+    uint64_t next()
+    {
+	state ^= state >> 12;
+	state ^= state << 25;
+	state ^= state >> 27;
+	return state * 0x2545F4914F6CDD1DULL;
+    }
+
+    /** @result a random number in [0, n) for n < 2^32 */
+    size_t uniform( size_t n )
+    {
+	return ( ( next() >> 32 ) * n ) >> 32;
+    }
+
+private:
+    uint64_t state;
+};
+
+/** draw p_pick different indices out of p_size. The indices are drawn
+ * directly and redrawn if they are already part of the sample, which only
+ * needs O(p_pick) random numbers for p_pick much smaller than p_size, and no
+ * memory besides p_ind.
+ */
 template <typename T>
-void pickRandomIndex( T p_size, T p_pick, vector_size_t& p_ind )
+void pickRandomIndex( T p_size, T p_pick, vector_size_t& p_ind, FastRandom& rng )
 {
     assert( p_size >= p_pick );
 
-    vector_size_t a( p_size );
-    for( size_t i = 0; i < p_size; i++ )
-	a[i] = i;
-
-    std::random_shuffle( a.begin(), a.end() );
     p_ind.resize( p_pick );
     for( size_t i = 0 ; i < p_pick; i++ )
-	p_ind[i] = a[i];
+    {
+	bool unique = false;
+	while( !unique )
+	{
+	    p_ind[i] = rng.uniform( p_size );
+	    unique = std::find( p_ind.begin(), p_ind.begin() + i, p_ind[i] ) == p_ind.begin() + i;
+	}
+    }
+}
+
+/** set p_inliers to the indices of the non-zero elements of the mask */
+inline void getInlierIndices( const vector_mask_t& mask, vector_size_t& p_inliers )
+{
+    p_inliers.clear();
+    for( size_t i = 0; i < mask.size(); i++ )
+	if( mask[i] )
+	    p_inliers.push_back( i );
 }
 
+/**
+ * Sampler of PROSAC (Chum and Matas, "Matching with PROSAC - progressive
+ * sample consensus", 2005).
+ *
+ * Instead of drawing the samples uniformly from all correspondences, they are
+ * drawn from a subset of the correspondences with the best quality (e.g. the
+ * lowest descriptor distance), which grows with the number of iterations. The
+ * first sample consists of the kernelSize best correspondences, and after
+ * growthLimit iterations the sampling is the same as the uniform one.
+ */
+class ProsacSampler
+{
+public:
+    ProsacSampler( size_t nSamples, size_t kernelSize, size_t growthLimit );
+
+    /** draw the next sample.
+     *
+     * @param order - all sample indices, sorted by quality with the best first
+     * @param p_ind - the drawn sample indices
+     */
+    void sample( const vector_size_t& order, vector_size_t& p_ind, FastRandom& rng )
+    {
+	assert( order.size() == nSamples );
+
+	t++;
+	if( t > growthLimit )
+	{
+	    // equivalent to uniform sampling from here on
+	    pickRandomIndex( nSamples, kernelSize, p_ind, rng );
+	    for( size_t i = 0; i < kernelSize; i++ )
+		p_ind[i] = order[p_ind[i]];
+	    return;
+	}
+
+	if( t > growth[n] && n < nSamples )
+	    n++;
+
+	// either all from the current subset, or the newest correspondence of
+	// the subset together with kernelSize-1 of the ones before
+	const bool includeNewest = growth[n] >= t;
+	const size_t drawFrom = includeNewest ? n - 1 : n;
+	const size_t drawCount = includeNewest ? kernelSize - 1 : kernelSize;
+
+	pickRandomIndex( drawFrom, drawCount, p_ind, rng );
+	if( includeNewest )
+	    p_ind.push_back( n - 1 );
+
+	for( size_t i = 0; i < kernelSize; i++ )
+	    p_ind[i] = order[p_ind[i]];
+    }
+
+    /** @result the size of the subset the samples are currently drawn from */
+    size_t getSubsetSize() const { return n; }
+
+private:
+    size_t nSamples, kernelSize, growthLimit;
+    /// current subset size and iteration
+    size_t n, t;
+    /// number of iterations after which the subset has size n, 
+    /// T'_n in the paper
+    vector_size_t growth;
+};
+
+/**
+ * Sequential probability ratio test for the evaluation of hypotheses (Matas
+ * and Chum, "Randomized RANSAC with sequential probability ratio test",
+ * 2005).
+ *
+ * While the samples are tested against a hypothesis, the likelihood ratio of
+ * the hypothesis being bad versus good is updated, and the hypothesis is
+ * rejected as soon as it exceeds the decision threshold A. This way, bad
+ * hypotheses are usually rejected after a few samples, instead of testing
+ * all of them.
+ *
+ * epsilon is the probability of a sample to be consistent with a good
+ * hypothesis (the inlier ratio), and delta the probability of being
+ * consistent with a bad one. epsilon is raised to the inlier ratio of the
+ * best hypothesis so far, and delta is estimated from the rejected
+ * hypotheses.
+ */
+class Sprt
+{
+public:
+    /** @param modelCost - time to fit a hypothesis in units of the time to
+     *                     test a single sample
+     */
+    Sprt( double epsilon = 0.1, double delta = 0.01, double modelCost = 200.0 );
+
+    /** start the evaluation of a new hypothesis */
+    void begin() { lambda = 1.0; }
+
+    /** add the result of a sample test to the current hypothesis
+     * @result false if the hypothesis should be rejected
+     */
+    bool update( bool consistent )
+    {
+	lambda *= consistent ? consistentFactor : inconsistentFactor;
+	return lambda <= threshold;
+    }
+
+    /** update delta after a hypothesis has been rejected after tested
+     * samples, of which consistent were consistent with it */
+    void rejected( size_t consistent, size_t tested );
+
+    /** update epsilon after a new best hypothesis has been found */
+    void accepted( size_t inliers, size_t nSamples );
+
+    /** @result the decision threshold A. The probability of rejecting a good
+     * hypothesis is about 1/A.
+     */
+    double getThreshold() const { return threshold; }
+
+private:
+    void updateThreshold();
+
+    double epsilon, delta, modelCost;
+    double threshold, consistentFactor, inconsistentFactor;
+    double lambda;
+    size_t sumConsistent, sumTested;
+};
+
+/** update the number of iterations needed to pick a sample without outliers
+ * with high propability, given the best number of inliers so far */
+inline size_t updateSoftIterLimit( size_t ninliers, size_t nSamples, size_t p_kernelSize )
+{
+    float f =  ninliers / static_cast<float>( nSamples );
+    float p = 1 -  pow( f, static_cast<float>( p_kernelSize ) );
+    float eps = std::numeric_limits<float>::epsilon();
+    p = std::max( eps, p);	// Avoid division by -Inf
+    p = std::min( 1-eps, p);	// Avoid division by 0.
+    return log(1-p) / log(p);
+}
+
+/** ransac for a single model. 
+ *
+ * All buffers are allocated before the first iteration, the inliers of a
+ * hypothesis are marked in a mask, which is swapped with the one of the best
+ * hypothesis, and only converted to indices at the end.
+ */
 template<typename TModelFit>
 bool ransacSingleModel( const TModelFit& p_state,
 	size_t p_kernelSize,
 	const typename TModelFit::Real& p_fitnessThreshold,
 	typename TModelFit::Model& p_bestModel,
 	vector_size_t& p_inliers,
-        size_t hardIterLimit = 100 )
+        size_t hardIterLimit = 100,
+	unsigned int seed = 0 )
 {
     size_t bestScore = 0;
     size_t iter = 0;
     size_t softIterLimit = 1; // will be updated by the size of inliers
     size_t nSamples = p_state.getSampleCount();
     vector_size_t ind( p_kernelSize );
+    vector_mask_t mask( nSamples ), bestMask( nSamples );
+    FastRandom rng( seed );
 
     while ( iter < softIterLimit && iter < hardIterLimit )
     {
@@ -194,41 +526,341 @@ bool ransacSingleModel( const TModelFit& p_state,
 	size_t i = 0;
 	while ( degenerate )
 	{
-	    pickRandomIndex( nSamples, p_kernelSize, ind );
+	    pickRandomIndex( nSamples, p_kernelSize, ind, rng );
 	    degenerate = !p_state.fitModel( ind, currentModel );
 	    i++;
 	    if( i > hardIterLimit )
 		return false;
 	}
 
-	vector_size_t inliers;
+	// Find the number of inliers to this model.
+	const size_t ninliers = p_state.testSamples( currentModel, p_fitnessThreshold, mask );
+	assert( ninliers > 0 );
 
-	for( size_t i = 0; i < nSamples; i++ )
+	if ( ninliers > bestScore )
 	{
-	    if( p_state.testSample( i, currentModel ) < p_fitnessThreshold )
-		inliers.push_back( i );
+	    bestScore = ninliers;
+	    p_bestModel = currentModel;
+	    mask.swap( bestMask );
+
+	    // Update the estimation of maxIter to pick dataset with no outliers at propability p
+	    softIterLimit = updateSoftIterLimit( ninliers, nSamples, p_kernelSize );
 	}
-	assert( inliers.size() > 0 );
 
-	// Find the number of inliers to this model.
-	const size_t ninliers = inliers.size();
+	iter++;
+    }
+
+    if( bestScore > 0 )
+	getInlierIndices( bestMask, p_inliers );
+
+    return true;
+}
+
+/** options of ransacModel */
+struct RansacOptions
+{
+    RansacOptions() : sprt( false ), seed( 0 ) {}
+
+    /** all sample indices sorted by quality, with the best first. If not
+     * empty, the samples are drawn with the ProsacSampler, otherwise
+     * uniformly.
+     */
+    vector_size_t prosacOrder;
+
+    /** if set to true, the hypotheses are evaluated with the Sprt */
+    bool sprt;
+
+    /** seed of the random number generator */
+    unsigned int seed;
+};
+
+/** counters of a run of ransacModel */
+struct RansacStatistics
+{
+    RansacStatistics() : samples( 0 ), iterations( 0 ), bestIteration( 0 ), rejected( 0 ), tests( 0 ) {}
+
+    /// number of drawn samples, including the degenerate ones
+    size_t samples;
+    /// number of hypotheses
+    size_t iterations;
+    /// hypothesis, at which the final model has been found
+    size_t bestIteration;
+    /// number of hypotheses rejected by the sprt
+    size_t rejected;
+    /// number of tested samples
+    size_t tests;
+};
+
+/**
+ * Same as ransacSingleModel, but with the sampling and the evaluation of
+ * the hypotheses given by the options, and with an own random number
+ * generator.
+ *
+ * With the sprt, a good hypothesis is rejected with the propability 1/A,
+ * for which the number of iterations is raised accordingly.
+ */
+template<typename TModelFit>
+bool ransacModel( const TModelFit& p_state,
+	size_t p_kernelSize,
+	const typename TModelFit::Real& p_fitnessThreshold,
+	typename TModelFit::Model& p_bestModel,
+	vector_size_t& p_inliers,
+	const RansacOptions& options,
+        size_t hardIterLimit = 100,
+	RansacStatistics *statistics = NULL )
+{
+    size_t bestScore = 0;
+    size_t iter = 0;
+    size_t softIterLimit = 1; // will be updated by the size of inliers
+    size_t nSamples = p_state.getSampleCount();
+    if( nSamples < p_kernelSize )
+	return false;
+
+    FastRandom rng( options.seed );
+    const bool prosac = !options.prosacOrder.empty();
+    ProsacSampler sampler( nSamples, p_kernelSize, hardIterLimit );
+    Sprt sprt;
+    vector_size_t ind( p_kernelSize );
+    vector_mask_t mask( nSamples ), bestMask( nSamples );
+    RansacStatistics stats;
+
+    // rejected hypotheses don't update softIterLimit, so it is only used
+    // once a hypothesis has been accepted
+    while ( ( iter < softIterLimit || bestScore == 0 ) && iter < hardIterLimit )
+    {
+	bool degenerate = true;
+	typename TModelFit::Model currentModel;
+	size_t i = 0;
+	while ( degenerate )
+	{
+	    if( prosac )
+		sampler.sample( options.prosacOrder, ind, rng );
+	    else
+		pickRandomIndex( nSamples, p_kernelSize, ind, rng );
+	    degenerate = !p_state.fitModel( ind, currentModel );
+	    stats.samples++;
+	    i++;
+	    if( i > hardIterLimit )
+	    {
+		if( statistics )
+		    *statistics = stats;
+		return false;
+	    }
+	}
+
+	iter++;
+	stats.iterations++;
+
+	size_t ninliers = 0;
+	bool rejected = false;
+	if( options.sprt )
+	{
+	    // the samples are tested one by one, until the hypothesis is
+	    // rejected
+	    sprt.begin();
+	    for( i = 0; i < nSamples; i++ )
+	    {
+		const bool consistent = p_state.testSample( i, currentModel ) < p_fitnessThreshold;
+		mask[i] = consistent;
+		ninliers += consistent;
+		if( !sprt.update( consistent ) )
+		{
+		    rejected = true;
+		    i++;
+		    break;
+		}
+	    }
+	}
+	else
+	{
+	    ninliers = p_state.testSamples( currentModel, p_fitnessThreshold, mask );
+	    i = nSamples;
+	}
+	stats.tests += i;
+
+	if( rejected )
+	{
+	    sprt.rejected( ninliers, i );
+	    stats.rejected++;
+	    continue;
+	}
 
 	if ( ninliers > bestScore )
 	{
 	    bestScore = ninliers;
 	    p_bestModel = currentModel;
-	    p_inliers = inliers;
+	    mask.swap( bestMask );
+	    stats.bestIteration = iter;
 
-	    // Update the estimation of maxIter to pick dataset with no outliers at propability p
-	    float f =  ninliers / static_cast<float>( nSamples );
-	    float p = 1 -  pow( f, static_cast<float>( p_kernelSize ) );
-	    float eps = std::numeric_limits<float>::epsilon();
-	    p = std::max( eps, p);	// Avoid division by -Inf
-	    p = std::min( 1-eps, p);	// Avoid division by 0.
-	    softIterLimit = log(1-p) / log(p);
+	    softIterLimit = updateSoftIterLimit( ninliers, nSamples, p_kernelSize );
+	    if( options.sprt )
+	    {
+		sprt.accepted( ninliers, nSamples );
+		softIterLimit /= 1.0 - 1.0 / sprt.getThreshold();
+	    }
 	}
+    }
 
-	iter++;
+    if( bestScore > 0 )
+	getInlierIndices( bestMask, p_inliers );
+
+    if( statistics )
+	*statistics = stats;
+
+    return true;
+}
+
+/**
+ * Parallel version of ransacSingleModel, which generates and scores the
+ * hypotheses on numThreads tasks of a ThreadPool.
+ *
+ * The iterations are processed in rounds, in which every thread evaluates a
+ * fixed number of hypotheses, drawn from its own random number generator
+ * seeded with (seed, thread index). The best inlier count found so far is
+ * shared between the threads, so that the scoring of a hypothesis stops
+ * after the first block of samples, after which it can't reach it anymore.
+ * After each round, the best model is selected (the one with the most
+ * inliers, and of those the one with the lowest iteration index),
+ * softIterLimit is updated and all threads stop if it has been reached. 
+ *
+ * For this reason, the result does only depend on the seed and numThreads,
+ * and not on the scheduling of the threads.
+ */
+template<typename TModelFit>
+bool ransacParallelModel( const TModelFit& p_state,
+	size_t p_kernelSize,
+	const typename TModelFit::Real& p_fitnessThreshold,
+	typename TModelFit::Model& p_bestModel,
+	vector_size_t& p_inliers,
+	ThreadPool& pool,
+	size_t numThreads,
+	unsigned int seed = 0,
+        size_t hardIterLimit = 100 )
+{
+    // number of hypotheses per thread and round
+    const size_t roundSize = 16;
+    // number of samples, which are scored in one batch before the check if
+    // the hypothesis can still win
+    const size_t blockSize = 64;
+
+    // only allocated by the aligned_allocator of the vector below
+    struct Worker
+    {
+	FastRandom rng;
+	vector_size_t ind;
+	vector_mask_t mask, bestMask;
+	typename TModelFit::Model bestModel;
+	size_t bestScore, bestIter;
+	bool failed;
+    };
+
+    numThreads = std::max( numThreads, (size_t)1 );
+    const size_t nSamples = p_state.getSampleCount();
+    if( nSamples < p_kernelSize )
+	return false;
+
+    std::vector<Worker, Eigen::aligned_allocator<Worker> > workers( numThreads );
+    for( size_t t = 0; t < numThreads; t++ )
+    {
+	workers[t].rng.seed( ( (uint64_t)seed << 32 ) | t );
+	workers[t].ind.resize( p_kernelSize );
+	workers[t].mask.resize( nSamples );
+	workers[t].bestMask.resize( nSamples );
+	workers[t].bestScore = 0;
+	workers[t].bestIter = 0;
+	workers[t].failed = false;
+    }
+
+    std::atomic<size_t> sharedBestScore( 0 );
+    size_t bestScore = 0;
+    size_t best = 0;
+    size_t iter = 0;
+    size_t softIterLimit = 1; // will be updated by the size of inliers
+
+    while ( iter < softIterLimit && iter < hardIterLimit )
+    {
+	const size_t roundIters = std::min( numThreads * roundSize, hardIterLimit - iter );
+	const size_t roundEnd = iter + roundIters;
+
+	TaskGroup tasks( pool );
+	for( size_t t = 0; t < numThreads; t++ )
+	{
+	    Worker &w( workers[t] );
+	    const size_t first = iter + t;
+	    tasks.run( [&, first]()
+	    {
+		// the iterations are assigned to the threads round robin
+		for( size_t it = first; it < roundEnd; it += numThreads )
+		{
+		    bool degenerate = true;
+		    typename TModelFit::Model currentModel;
+		    size_t i = 0;
+		    while ( degenerate )
+		    {
+			pickRandomIndex( nSamples, p_kernelSize, w.ind, w.rng );
+			degenerate = !p_state.fitModel( w.ind, currentModel );
+			i++;
+			if( i > hardIterLimit )
+			{
+			    w.failed = true;
+			    return;
+			}
+		    }
+
+		    // models with less inliers than the best one can't be
+		    // selected, so the scoring can stop early for them
+		    const size_t sharedBest = sharedBestScore.load();
+		    bool pruned = false;
+		    size_t ninliers = 0;
+		    for( size_t begin = 0; begin < nSamples; begin += blockSize )
+		    {
+			const size_t end = std::min( begin + blockSize, nSamples );
+			ninliers += p_state.testSamples( currentModel, p_fitnessThreshold, w.mask, begin, end );
+			if( ninliers + nSamples - end < sharedBest )
+			{
+			    pruned = true;
+			    break;
+			}
+		    }
+
+		    if ( !pruned && ninliers > w.bestScore )
+		    {
+			w.bestScore = ninliers;
+			w.bestIter = it;
+			w.bestModel = currentModel;
+			w.bestMask.swap( w.mask );
+
+			size_t current = sharedBestScore.load();
+			while( ninliers > current && !sharedBestScore.compare_exchange_weak( current, ninliers ) );
+		    }
+		}
+	    } );
+	}
+	tasks.wait();
+
+	for( size_t t = 0; t < numThreads; t++ )
+	{
+	    const Worker &w( workers[t] );
+	    if( w.failed )
+		return false;
+
+	    if( w.bestScore > bestScore || ( w.bestScore == bestScore && w.bestScore > 0 && w.bestIter < workers[best].bestIter ) )
+	    {
+		bestScore = w.bestScore;
+		best = t;
+	    }
+	}
+
+	if( bestScore > 0 )
+	    softIterLimit = updateSoftIterLimit( bestScore, nSamples, p_kernelSize );
+
+	iter = roundEnd;
+    }
+
+    if( bestScore > 0 )
+    {
+	p_bestModel = workers[best].bestModel;
+	getInlierIndices( workers[best].bestMask, p_inliers );
     }
 
     return true;
@@ -0,0 +1,338 @@
+#include "rectification_cache.h"
+#include "fnv1a.hpp"
+#include <stereo/config.h>
+
+#include <opencv2/core/version.hpp>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <vector>
+
+using namespace stereo;
+
+namespace
+{
+
+const char CACHE_MAGIC[8] = { 'S', 'T', 'R', 'M', 'A', 'P', 'S', 0 };
+const uint32_t CACHE_VERSION = 3;
+/// identifies how the maps are produced. The version of the map producer
+/// has to be increased if the way initCv() is called changes, the
+/// frame_helper version covers changes of initCv() itself.
+const uint32_t MAPS_PRODUCER_VERSION = 1;
+const char MAPS_PRODUCER[] = "frame_helper " STEREO_FRAME_HELPER_VERSION;
+const size_t CACHE_ALIGNMENT = 64;
+
+const size_t NUM_CALIB_PARAMS = 2 * 8 + 6;
+const size_t NUM_MATRICES = 15;
+
+struct CacheHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t matCount;
+    uint64_t key;
+    int32_t width;
+    int32_t height;
+    double params[NUM_CALIB_PARAMS];
+    char cvVersion[32];
+    uint32_t producerVersion;
+    char producer[44];
+    /// checksum of the map data, which is part of the header checksum
+    uint64_t payloadChecksum;
+    uint64_t checksum;
+};
+
+struct CacheMatrix
+{
+    int32_t type;
+    int32_t rows;
+    int32_t cols;
+    int32_t reserved;
+    uint64_t offset;
+    uint64_t bytes;
+};
+
+void getCalibrationParams( const frame_helper::StereoCalibration& calib, double *params )
+{
+    const frame_helper::CameraCalibration *cams[2] = { &calib.camLeft, &calib.camRight };
+    for( size_t i = 0; i < 2; i++ )
+    {
+	double *p = params + i * 8;
+	p[0] = cams[i]->fx; p[1] = cams[i]->fy;
+	p[2] = cams[i]->cx; p[3] = cams[i]->cy;
+	p[4] = cams[i]->d0; p[5] = cams[i]->d1;
+	p[6] = cams[i]->d2; p[7] = cams[i]->d3;
+    }
+    double *e = params + 16;
+    e[0] = calib.extrinsic.tx; e[1] = calib.extrinsic.ty; e[2] = calib.extrinsic.tz;
+    e[3] = calib.extrinsic.rx; e[4] = calib.extrinsic.ry; e[5] = calib.extrinsic.rz;
+}
+
+/** all the matrices that StereoCalibrationCv::initCv() fills */
+template <class Calib, class Mat>
+void getMatrices( Calib& calib, Mat **mats )
+{
+    Mat *m[NUM_MATRICES] = {
+	&calib.camLeft.camMatrix, &calib.camLeft.distCoeffs,
+	&calib.camLeft.map1, &calib.camLeft.map2,
+	&calib.camRight.camMatrix, &calib.camRight.distCoeffs,
+	&calib.camRight.map1, &calib.camRight.map2,
+	&calib.R, &calib.T, &calib.R1, &calib.R2, &calib.P1, &calib.P2, &calib.Q };
+    std::copy( m, m + NUM_MATRICES, mats );
+}
+
+void fillHeader( const frame_helper::StereoCalibration& calib, const cv::Size& size, CacheHeader& header )
+{
+    memset( &header, 0, sizeof( header ) );
+    memcpy( header.magic, CACHE_MAGIC, sizeof( header.magic ) );
+    header.version = CACHE_VERSION;
+    header.matCount = NUM_MATRICES;
+    header.width = size.width;
+    header.height = size.height;
+    getCalibrationParams( calib, header.params );
+    strncpy( header.cvVersion, CV_VERSION, sizeof( header.cvVersion ) - 1 );
+    header.producerVersion = MAPS_PRODUCER_VERSION;
+    strncpy( header.producer, MAPS_PRODUCER, sizeof( header.producer ) - 1 );
+    header.key = RectificationCache::getKey( calib, size );
+}
+
+/** checksum of the data of all matrices, in the order of the entries. It
+ * is computed over 8 byte words, so that validating the maps costs only a
+ * fraction of computing them. */
+uint64_t getPayloadChecksum( const uint8_t * const *data, const CacheMatrix *mats )
+{
+    uint64_t hash = fnv1a( NULL, 0 );
+    for( size_t i = 0; i < NUM_MATRICES; i++ )
+	hash = fnv1aWords( data[i], mats[i].bytes, hash );
+    return hash;
+}
+
+uint64_t getChecksum( const CacheHeader& header, const CacheMatrix *mats )
+{
+    CacheHeader h( header );
+    h.checksum = 0;
+    return fnv1a( mats, sizeof( CacheMatrix ) * NUM_MATRICES, fnv1a( &h, sizeof( h ) ) );
+}
+
+}
+
+RectificationCache::RectificationCache( const std::string& directory )
+    : directory( directory ), mapping( NULL ), mappingSize( 0 )
+{
+}
+
+RectificationCache::~RectificationCache()
+{
+    unmap();
+}
+
+void RectificationCache::unmap()
+{
+    if( mapping )
+	munmap( mapping, mappingSize );
+    mapping = NULL;
+    mappingSize = 0;
+}
+
+uint64_t RectificationCache::getKey( const frame_helper::StereoCalibration& calib, const cv::Size& imageSize )
+{
+    double params[NUM_CALIB_PARAMS];
+    getCalibrationParams( calib, params );
+    const int32_t size[2] = { imageSize.width, imageSize.height };
+
+    uint64_t hash = fnv1a( &CACHE_VERSION, sizeof( CACHE_VERSION ) );
+    hash = fnv1a( params, sizeof( params ), hash );
+    hash = fnv1a( size, sizeof( size ), hash );
+    hash = fnv1a( CV_VERSION, strlen( CV_VERSION ), hash );
+    hash = fnv1a( &MAPS_PRODUCER_VERSION, sizeof( MAPS_PRODUCER_VERSION ), hash );
+    hash = fnv1a( MAPS_PRODUCER, strlen( MAPS_PRODUCER ), hash );
+    return hash;
+}
+
+std::string RectificationCache::getFileName( uint64_t key ) const
+{
+    char name[32];
+    snprintf( name, sizeof( name ), "%016llx.rectmap", (unsigned long long)key );
+    return directory + "/" + name;
+}
+
+bool RectificationCache::initCv( frame_helper::StereoCalibrationCv& calib )
+{
+    if( !isEnabled() )
+    {
+	calib.initCv();
+	return false;
+    }
+
+    if( load( calib ) )
+	return true;
+
+    calib.initCv();
+    store( calib );
+
+    return false;
+}
+
+bool RectificationCache::load( frame_helper::StereoCalibrationCv& calib )
+{
+    if( !isEnabled() )
+	return false;
+
+    const cv::Size size = calib.getImageSize();
+    CacheHeader expected;
+    fillHeader( calib.getCalibration(), size, expected );
+
+    const int fd = open( getFileName( expected.key ).c_str(), O_RDONLY );
+    if( fd < 0 )
+	return false;
+
+    struct stat st;
+    const size_t min_size = sizeof( CacheHeader ) + sizeof( CacheMatrix ) * NUM_MATRICES;
+    if( fstat( fd, &st ) != 0 || (size_t)st.st_size < min_size )
+    {
+	close( fd );
+	return false;
+    }
+
+    // map private and writable, so that accidental writes to the maps are
+    // copy-on-write and never end up in the cache file
+    void *data = mmap( NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0 );
+    close( fd );
+    if( data == MAP_FAILED )
+	return false;
+
+    const CacheHeader &header( *static_cast<const CacheHeader*>( data ) );
+    const CacheMatrix *entries = reinterpret_cast<const CacheMatrix*>( static_cast<const uint8_t*>( data ) + sizeof( CacheHeader ) );
+
+    // compare the complete header and not only the key, so a hash collision
+    // or a stale file can never provide the maps of another calibration
+    bool valid =
+	memcmp( header.magic, expected.magic, sizeof( header.magic ) ) == 0 &&
+	header.version == expected.version &&
+	header.matCount == expected.matCount &&
+	header.key == expected.key &&
+	header.width == expected.width &&
+	header.height == expected.height &&
+	memcmp( header.params, expected.params, sizeof( header.params ) ) == 0 &&
+	memcmp( header.cvVersion, expected.cvVersion, sizeof( header.cvVersion ) ) == 0 &&
+	header.producerVersion == expected.producerVersion &&
+	memcmp( header.producer, expected.producer, sizeof( header.producer ) ) == 0 &&
+	header.checksum == getChecksum( header, entries );
+
+    for( size_t i = 0; valid && i < NUM_MATRICES; i++ )
+    {
+	const CacheMatrix &e( entries[i] );
+	valid = e.rows >= 0 && e.cols >= 0 &&
+	    e.offset % CACHE_ALIGNMENT == 0 &&
+	    e.offset <= (uint64_t)st.st_size && e.bytes <= (uint64_t)st.st_size - e.offset &&
+	    e.bytes == (uint64_t)e.rows * e.cols * CV_ELEM_SIZE( e.type );
+    }
+
+    // the header only describes the maps, so also check that the file ends
+    // after the last map and that the map data has not been changed
+    if( valid && entries[NUM_MATRICES - 1].offset + entries[NUM_MATRICES - 1].bytes != (uint64_t)st.st_size )
+	valid = false;
+    if( valid )
+    {
+	const uint8_t *payload[NUM_MATRICES];
+	for( size_t i = 0; i < NUM_MATRICES; i++ )
+	    payload[i] = static_cast<const uint8_t*>( data ) + entries[i].offset;
+	valid = header.payloadChecksum == getPayloadChecksum( payload, entries );
+    }
+
+    if( !valid )
+    {
+	munmap( data, st.st_size );
+	return false;
+    }
+
+    cv::Mat *mats[NUM_MATRICES];
+    getMatrices( calib, mats );
+    for( size_t i = 0; i < NUM_MATRICES; i++ )
+    {
+	const CacheMatrix &e( entries[i] );
+	if( e.bytes == 0 )
+	    *mats[i] = cv::Mat();
+	else
+	    *mats[i] = cv::Mat( e.rows, e.cols, e.type, static_cast<uint8_t*>( data ) + e.offset );
+    }
+
+    // the previous mapping is not referenced by the calibration anymore
+    unmap();
+    mapping = data;
+    mappingSize = st.st_size;
+
+    return true;
+}
+
+bool RectificationCache::store( const frame_helper::StereoCalibrationCv& calib )
+{
+    if( !isEnabled() )
+	return false;
+
+    CacheHeader header;
+    fillHeader( calib.getCalibration(), calib.getImageSize(), header );
+
+    const cv::Mat *src[NUM_MATRICES];
+    getMatrices( calib, src );
+
+    std::vector<cv::Mat> mats( NUM_MATRICES );
+    std::vector<CacheMatrix> entries( NUM_MATRICES );
+    uint64_t offset = sizeof( CacheHeader ) + sizeof( CacheMatrix ) * NUM_MATRICES;
+    for( size_t i = 0; i < NUM_MATRICES; i++ )
+    {
+	mats[i] = src[i]->isContinuous() ? *src[i] : src[i]->clone();
+
+	CacheMatrix &e( entries[i] );
+	memset( &e, 0, sizeof( e ) );
+	e.type = mats[i].type();
+	e.rows = mats[i].rows;
+	e.cols = mats[i].cols;
+	e.bytes = mats[i].total() * mats[i].elemSize();
+	offset = ( offset + CACHE_ALIGNMENT - 1 ) / CACHE_ALIGNMENT * CACHE_ALIGNMENT;
+	e.offset = offset;
+	offset += e.bytes;
+    }
+    const uint8_t *payload[NUM_MATRICES];
+    for( size_t i = 0; i < NUM_MATRICES; i++ )
+	payload[i] = mats[i].data;
+    header.payloadChecksum = getPayloadChecksum( payload, &entries[0] );
+    header.checksum = getChecksum( header, &entries[0] );
+
+    // write to a unique temporary file and rename it, which is atomic, so
+    // readers never see a partially written cache file
+    const std::string fileName = getFileName( header.key );
+    std::ostringstream tmpName;
+    tmpName << fileName << ".tmp." << getpid();
+
+    std::ofstream out( tmpName.str().c_str(), std::ios::binary | std::ios::trunc );
+    out.write( reinterpret_cast<const char*>( &header ), sizeof( header ) );
+    out.write( reinterpret_cast<const char*>( &entries[0] ), sizeof( CacheMatrix ) * NUM_MATRICES );
+    for( size_t i = 0; i < NUM_MATRICES; i++ )
+    {
+	const std::streamoff pos = out.tellp();
+	if( pos >= 0 && (uint64_t)pos < entries[i].offset )
+	{
+	    const std::vector<char> padding( entries[i].offset - pos, 0 );
+	    out.write( &padding[0], padding.size() );
+	}
+	if( entries[i].bytes )
+	    out.write( reinterpret_cast<const char*>( mats[i].data ), entries[i].bytes );
+    }
+    out.close();
+
+    if( !out || rename( tmpName.str().c_str(), fileName.c_str() ) != 0 )
+    {
+	std::cerr << "RectificationCache: could not write cache file " << fileName << std::endl;
+	unlink( tmpName.str().c_str() );
+	return false;
+    }
+
+    return true;
+}
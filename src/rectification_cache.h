@@ -0,0 +1,97 @@
+#ifndef __STEREO_RECTIFICATION_CACHE_H__
+#define __STEREO_RECTIFICATION_CACHE_H__
+
+#include <frame_helper/CalibrationCv.h>
+#include <stdint.h>
+#include <string>
+
+namespace stereo {
+
+/**
+ * On-disk cache for the undistort/rectify maps of a stereo calibration.
+ *
+ * StereoCalibrationCv::initCv() recomputes the rectification maps every time,
+ * which is noticeable at high resolutions. This class stores the result of
+ * initCv() in a binary file in the cache directory, keyed by a hash of the
+ * calibration parameters, the image size, and the versions of OpenCV and
+ * of the frame_helper which computes the maps. On a hit the file is mmap'ed
+ * and the matrices of the calibration object point directly into the
+ * mapping, so the mapping is owned by this object and has to outlive the
+ * calibration object that was filled by it.
+ *
+ * A cache file is only used if its header matches the requested calibration
+ * and image size exactly, so hash collisions or stale files lead to a
+ * recomputation and not to wrong maps. The same holds for truncated files
+ * and changed map data, which are detected with the file size and a checksum
+ * of the maps. Files are written to a temporary name
+ * and renamed, so concurrent writers never produce a partial file.
+ */
+class RectificationCache
+{
+public:
+    /** @param directory - directory in which the cache files are stored.
+     *                     It needs to exist and be writable. An empty
+     *                     directory disables the cache.
+     */
+    explicit RectificationCache( const std::string& directory = std::string() );
+    ~RectificationCache();
+
+    /** change the cache directory. This does not invalidate the maps of a
+     * calibration object which has been loaded before.
+     */
+    void setDirectory( const std::string& directory ) { this->directory = directory; }
+    const std::string& getDirectory() const { return directory; }
+
+    /** @result true if a cache directory has been set */
+    bool isEnabled() const { return !directory.empty(); }
+
+    /**
+     * initialize the given calibration object, which needs to have the
+     * calibration and the image size set. Will either load the maps from
+     * the cache, or call initCv() and store the result in the cache. If the
+     * cache is disabled, this is the same as calling initCv().
+     *
+     * @result true if the maps were loaded from the cache
+     */
+    bool initCv( frame_helper::StereoCalibrationCv& calib );
+
+    /**
+     * try to load the maps for the calibration and image size of the given
+     * object from the cache.
+     *
+     * @result true if a valid cache entry was found
+     */
+    bool load( frame_helper::StereoCalibrationCv& calib );
+
+    /**
+     * store the matrices of an initialized calibration object in the cache
+     *
+     * @result true if the cache file was written
+     */
+    bool store( const frame_helper::StereoCalibrationCv& calib );
+
+    /**
+     * @result the cache key for the given calibration and image size
+     */
+    static uint64_t getKey( const frame_helper::StereoCalibration& calib, const cv::Size& imageSize );
+
+    /**
+     * @result the full path of the cache file for the given key
+     */
+    std::string getFileName( uint64_t key ) const;
+
+private:
+    RectificationCache( const RectificationCache& );
+    RectificationCache& operator=( const RectificationCache& );
+
+    void unmap();
+
+    std::string directory;
+
+    void *mapping;
+    size_t mappingSize;
+};
+
+}
+
+#endif
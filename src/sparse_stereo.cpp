@@ -1,10 +1,13 @@
 #include "sparse_stereo.hpp"
 #include <Eigen/Core>
 #include <iostream>
+#include <limits>
+#include <cmath>
 #include <opencv2/core/eigen.hpp>
+#include <opencv2/video/tracking.hpp>
 #include "ransac.hpp"
 #include "psurf.h"
-#include <thread>
+#include "hamming_matcher.hpp"
 
 #ifdef OPENCV_HAS_SURF_GPU
 #include <opencv2/gpu/gpu.hpp>
@@ -29,9 +32,8 @@ Eigen::Vector2d cv2eigen( const cv::Point& point )
 
 
 StereoFeatures::StereoFeatures()
-    : dist_left( NULL ), dist_right( NULL )
+    : nextTrackId( 0 ), hasMotionPrior( false ), dist_left( NULL ), dist_right( NULL )
 {
-    descriptorMatcher = cv::DescriptorMatcher::create("FlannBased");
     initDetector( config.targetNumFeatures );
     setConfiguration( FeatureConfiguration() );
     use_gpu_detector = false;
@@ -58,8 +60,31 @@ void StereoFeatures::setConfiguration( const FeatureConfiguration &config )
     else if( config.descriptorType == stereo::DESCRIPTOR_SURF )
 	descriptorExtractor = new cv::SurfDescriptorExtractor(4, 3, false);
 #endif
+    else if( config.descriptorType == stereo::DESCRIPTOR_ORB )
+	descriptorExtractor = new cv::OrbDescriptorExtractor();
+    else if( config.descriptorType == stereo::DESCRIPTOR_BRIEF )
+	descriptorExtractor = new cv::BriefDescriptorExtractor( 32 );
     else
 	throw std::runtime_error( "Unknown descriptorType" );
+
+    // binary descriptors are matched with the hamming distance
+    if( isBinaryDescriptor( config.descriptorType ) )
+	descriptorMatcher = new HammingMatcher( config.multiIndexHashing ? 
+		HammingMatcher::MULTI_INDEX_HASHING : HammingMatcher::BRUTE_FORCE );
+    else
+	descriptorMatcher = cv::DescriptorMatcher::create("FlannBased");
+
+    // the cached indices belong to the previous matcher
+    indexCache.clear();
+    // and the tracked descriptors to the previous descriptor type
+    resetTracking();
+}
+
+ThreadPool& StereoFeatures::getThreadPool()
+{
+    if( !threadPool )
+	threadPool = ThreadPool::getDefault();
+    return *threadPool;
 }
 
 void StereoFeatures::setDistanceImages( 
@@ -185,68 +210,198 @@ void StereoFeatures::initDetector( size_t lastNumFeatures )
 
 void StereoFeatures::findFeatures_threading( const cv::Mat &image, FeatureInfo& info, bool left_frame, int crop_left, int crop_right )
 {
-  // parameter for border overlap (to minimize aliasing at borders)
-  int border = 50;
+  // the gpu detector works on the whole image
+  if( use_gpu_detector )
+  {
+    findFeatures2( image, info, left_frame, crop_left, crop_right );
+    return;
+  }
+
+  // region of the image after cropping, all keypoints are reported in
+  // coordinates of the full image
   int start = crop_left;
   if(!left_frame)
     start = crop_right;
-  cv::Mat image_c(image, cv::Rect(start, 0, image.size().width - crop_left - crop_right, image.size().height));
-  // create sub-images
-  cv::Mat sub1( image_c, cv::Rect( 0, 0, image_c.size().width / 2 + border, image_c.size().height / 2 + border ) );
-  cv::Mat sub2( image_c, cv::Rect( image_c.size().width / 2 - border, 0, image_c.size().width / 2 + border, image_c.size().height / 2 + border) );
-  cv::Mat sub3( image_c, cv::Rect( 0, image_c.size().height / 2 - border, image_c.size().width / 2 + border, image_c.size().height / 2 + border) );
-  cv::Mat sub4( image_c, cv::Rect( image_c.size().width / 2 - border, image_c.size().height / 2 - border, image_c.size().width / 2 + border, image_c.size().height / 2 + border) );
-  // create temporary storages
-  FeatureInfo info1, info2, info3, info4;
-
-  // run threads
-  std::thread t1(&StereoFeatures::findFeatures2, this, sub1, std::ref(info1), left_frame, crop_left, crop_right);
-  std::thread t2(&StereoFeatures::findFeatures2, this, sub2, std::ref(info2), left_frame, crop_left, crop_right);
-  std::thread t3(&StereoFeatures::findFeatures2, this, sub3, std::ref(info3), left_frame, crop_left, crop_right);
-  std::thread t4(&StereoFeatures::findFeatures2, this, sub4, std::ref(info4), left_frame, crop_left, crop_right);
-
-  // wait for finishing
-  t1.join();
-  t2.join();
-  t3.join();
-  t4.join();
+  const cv::Rect region(start, 0, image.size().width - crop_left - crop_right, image.size().height);
+
+  // split the region into tilesX x tilesY core regions, which cover the
+  // region without overlap. Each core region is processed as a task.
+  const int tilesX = std::max( 1, std::min( config.tilesX, region.width ) );
+  const int tilesY = std::max( 1, std::min( config.tilesY, region.height ) );
+  std::vector<cv::Rect> cores;
+  for( int ty = 0; ty < tilesY; ty++ )
+  {
+    for( int tx = 0; tx < tilesX; tx++ )
+    {
+      const int x0 = region.x + region.width * tx / tilesX, x1 = region.x + region.width * (tx + 1) / tilesX;
+      const int y0 = region.y + region.height * ty / tilesY, y1 = region.y + region.height * (ty + 1) / tilesY;
+      cores.push_back( cv::Rect( x0, y0, x1 - x0, y1 - y0 ) );
+    }
+  }
+  std::vector<FeatureInfo> tiles( cores.size() );
 
-  // now copy the keypoints from temp storage into return value. For the last 3, add x/y offset.
-  for(size_t i = 0; i < info1.keypoints.size(); ++i)
+  TaskGroup tasks( getThreadPool() );
+  for( size_t i = 0; i < cores.size(); ++i )
   {
-    cv::KeyPoint kp = info1.keypoints[i];
-    kp.pt.x += start;
-    info.keypoints.push_back(kp);
+    const cv::Rect &core( cores[i] );
+    FeatureInfo &tile( tiles[i] );
+    tasks.run( [&image, region, core, &tile, left_frame, this]() { detectFeaturesInTile( image, region, core, tile, left_frame ); } );
   }
+  tasks.wait();
 
-  for(size_t i = 0; i < info2.keypoints.size(); ++i)
+  // the feature budget is distributed over the whole region, so the
+  // selection is done on all tiles at once, before any descriptor is computed
+  const bool guided = !left_frame && useDenseGuidance();
+  if( config.gridBucketing || guided )
   {
-    cv::KeyPoint kp = info2.keypoints[i];
-    kp.pt.x += image_c.size().width / 2 - border + start;
-    info.keypoints.push_back(kp);
+    std::vector<cv::KeyPoint> keypoints;
+    for( size_t i = 0; i < tiles.size(); ++i )
+      keypoints.insert( keypoints.end(), tiles[i].keypoints.begin(), tiles[i].keypoints.end() );
+
+    if( config.gridBucketing )
+      selectBucketedFeatures( keypoints, region );
+    // only describe the right features which can be matched
+    if( guided )
+      epipolarMatcher.selectCandidates( leftFeatures.keypoints, keypoints, &predictedDisparities );
+
+    // give the selected keypoints back to the tiles owning them
+    for( size_t i = 0; i < tiles.size(); ++i )
+      tiles[i].keypoints.clear();
+    for( size_t i = 0; i < keypoints.size(); ++i )
+    {
+      const cv::Point pt( keypoints[i].pt.x, keypoints[i].pt.y );
+      size_t idx = 0;
+      while( idx + 1 < cores.size() && !cores[idx].contains( pt ) )
+	idx++;
+      tiles[idx].keypoints.push_back( keypoints[i] );
+    }
   }
 
-  for(size_t i = 0; i < info3.keypoints.size(); ++i)
+  for( size_t i = 0; i < cores.size(); ++i )
   {
-    cv::KeyPoint kp = info3.keypoints[i];
-    kp.pt.x += start;
-    kp.pt.y += image_c.size().height / 2 - border;
-    info.keypoints.push_back(kp);
+    const cv::Rect &core( cores[i] );
+    FeatureInfo &tile( tiles[i] );
+    tasks.run( [&image, region, core, &tile, this]() { describeFeaturesInTile( image, region, core, tile ); } );
   }
 
-  for(size_t i = 0; i < info4.keypoints.size(); ++i)
+  // wait for finishing
+  tasks.wait();
+
+  // merge the tiles, which contain no duplicates due to the ownership of
+  // the core regions
+  info.keypoints.clear();
+  info.descriptors = cv::Mat();
+  info.detectorTime = base::Time();
+  info.descriptorTime = base::Time();
+  for( size_t i = 0; i < tiles.size(); ++i )
   {
-    cv::KeyPoint kp = info4.keypoints[i];
-    kp.pt.x += image_c.size().width / 2 - border + start;
-    kp.pt.y += image_c.size().height / 2 - border;
-    info.keypoints.push_back(kp);
+    info.keypoints.insert( info.keypoints.end(), tiles[i].keypoints.begin(), tiles[i].keypoints.end() );
+    if( !tiles[i].keypoints.empty() )
+      info.descriptors.push_back( tiles[i].descriptors );
+    // accumulated over all tiles
+    info.detectorTime = info.detectorTime + tiles[i].detectorTime;
+    info.descriptorTime = info.descriptorTime + tiles[i].descriptorTime;
   }
+}
+
+static cv::Rect getTileRect( const cv::Rect &region, const cv::Rect &core, int overlap )
+{
+    // the detector and descriptor see the core region plus the overlap, so
+    // that keypoints near the core border get their full support region
+    overlap = std::max( 0, overlap );
+    return cv::Rect( core.x - overlap, core.y - overlap,
+	    core.width + 2 * overlap, core.height + 2 * overlap ) & region;
+}
+
+void StereoFeatures::detectFeaturesInTile( const cv::Mat &image, const cv::Rect &region, const cv::Rect &core, FeatureInfo& info, bool left_frame )
+{
+    const cv::Rect tile = getTileRect( region, core, config.tileOverlap );
+    const cv::Mat sub( image, tile );
+    const cv::Mat &mask( left_frame ? leftDetectionMask : rightDetectionMask );
+
+    clock_t start = clock();
+    std::vector<cv::KeyPoint> keypoints;
+    if( mask.empty() )
+	detector->detect( sub, keypoints );
+    else
+    {
+	// nothing to detect if the mask is not set anywhere in the tile
+	const cv::Mat subMask( mask, tile );
+	if( cv::countNonZero( subMask ) > 0 )
+	    detector->detect( sub, keypoints, subMask );
+    }
 
-  // copy descriptors from temp storage into return value
-  info.descriptors.push_back(info1.descriptors);
-  info.descriptors.push_back(info2.descriptors);
-  info.descriptors.push_back(info3.descriptors);
-  info.descriptors.push_back(info4.descriptors);
+    // a keypoint is owned by the tile whose core region contains its
+    // centre, and is reported in image coordinates
+    info.keypoints.clear();
+    for( size_t i = 0; i < keypoints.size(); ++i )
+    {
+	cv::KeyPoint kp = keypoints[i];
+	kp.pt.x += tile.x;
+	kp.pt.y += tile.y;
+	if( kp.pt.x >= core.x && kp.pt.x < core.x + core.width && kp.pt.y >= core.y && kp.pt.y < core.y + core.height )
+	    info.keypoints.push_back( kp );
+    }
+    clock_t finish = clock();
+    info.detectorTime = base::Time::fromSeconds( (finish - start) / (CLOCKS_PER_SEC * 1.0) );
+}
+
+void StereoFeatures::describeFeaturesInTile( const cv::Mat &image, const cv::Rect &region, const cv::Rect &core, FeatureInfo& info )
+{
+    const cv::Rect tile = getTileRect( region, core, config.tileOverlap );
+    const cv::Mat sub( image, tile );
+
+    clock_t start = clock();
+    // move the keypoints from image to tile coordinates and back
+    for( size_t i = 0; i < info.keypoints.size(); ++i )
+    {
+	info.keypoints[i].pt.x -= tile.x;
+	info.keypoints[i].pt.y -= tile.y;
+    }
+    descriptorExtractor->compute( sub, info.keypoints, info.descriptors );
+    for( size_t i = 0; i < info.keypoints.size(); ++i )
+    {
+	info.keypoints[i].pt.x += tile.x;
+	info.keypoints[i].pt.y += tile.y;
+    }
+    clock_t finish = clock();
+    info.descriptorTime = base::Time::fromSeconds( (finish - start) / (CLOCKS_PER_SEC * 1.0) );
+}
+
+static bool compareResponse( const cv::KeyPoint &a, const cv::KeyPoint &b )
+{
+    return a.response > b.response;
+}
+
+void StereoFeatures::selectBucketedFeatures( std::vector<cv::KeyPoint> &keypoints, const cv::Rect &region ) const
+{
+    const int bucketsX = std::max( 1, config.bucketsX );
+    const int bucketsY = std::max( 1, config.bucketsY );
+    const size_t numCells = bucketsX * bucketsY;
+    const size_t budget = std::max( 1, (config.targetNumFeatures + (int)numCells - 1) / (int)numCells );
+
+    // sort the keypoints into their cells
+    std::vector<std::vector<cv::KeyPoint> > cells( numCells );
+    for( size_t i = 0; i < keypoints.size(); ++i )
+    {
+	const cv::KeyPoint &kp( keypoints[i] );
+	const int cx = std::max( 0, std::min( bucketsX - 1, (int)((kp.pt.x - region.x) * bucketsX / region.width) ) );
+	const int cy = std::max( 0, std::min( bucketsY - 1, (int)((kp.pt.y - region.y) * bucketsY / region.height) ) );
+	cells[cy * bucketsX + cx].push_back( kp );
+    }
+
+    // keep the strongest keypoints of each cell
+    keypoints.clear();
+    for( size_t c = 0; c < numCells; ++c )
+    {
+	std::vector<cv::KeyPoint> &cell( cells[c] );
+	if( cell.size() > budget )
+	{
+	    std::nth_element( cell.begin(), cell.begin() + (budget - 1), cell.end(), compareResponse );
+	    cell.resize( budget );
+	}
+	keypoints.insert( keypoints.end(), cell.begin(), cell.end() );
+    }
 }
 
 
@@ -264,16 +419,35 @@ void StereoFeatures::findFeatures2( const cv::Mat &image, FeatureInfo& info, boo
     if(!use_gpu_detector)
     {
         start = clock();
-        detector->detect( image_c, info.keypoints);
+        const cv::Mat &mask( left_frame ? leftDetectionMask : rightDetectionMask );
+        if( mask.empty() )
+          detector->detect( image_c, info.keypoints);
+        else
+        {
+          // nothing to detect if the mask is not set anywhere in the image
+          const cv::Mat mask_c( mask, cv::Rect(start_left, 0, image_c.size().width, image_c.size().height) );
+          if( cv::countNonZero( mask_c ) > 0 )
+            detector->detect( image_c, info.keypoints, mask_c );
+        }
         // correct the keypoint position by the cropping factor
         for(size_t i = 0; i < info.keypoints.size(); ++i)
         {
           info.keypoints[i].pt.x += start_left;
         }
+        // only keep the best features per grid cell before describing them
+        if( config.gridBucketing )
+        {
+          const cv::Rect region( start_left, 0, image_c.size().width, image_c.size().height );
+          selectBucketedFeatures( info.keypoints, region );
+        }
+        // only describe the right features which can be matched
+        if( !left_frame && useDenseGuidance() )
+          epipolarMatcher.selectCandidates( leftFeatures.keypoints, info.keypoints, &predictedDisparities );
         finish = clock();
         info.detectorTime = base::Time::fromSeconds( (finish - start) / (CLOCKS_PER_SEC * 1.0) );
         start = clock();
-        descriptorExtractor->compute( image_c, info.keypoints, info.descriptors );
+        // the keypoints are in image coordinates at this point
+        descriptorExtractor->compute( image, info.keypoints, info.descriptors );
         finish = clock();
         info.descriptorTime = base::Time::fromSeconds( (finish - start) / (CLOCKS_PER_SEC * 1.0) );
     }
@@ -317,18 +491,224 @@ void StereoFeatures::findFeatures2( const cv::Mat &image, FeatureInfo& info, boo
 #endif
 }
 
-void StereoFeatures::processFramePair( const cv::Mat &left_image, const cv::Mat &right_image, StereoFeatureArray *stereo_features )
+void StereoFeatures::processFramePair( const cv::Mat &left_image, const cv::Mat &right_image, StereoFeatureArray *stereo_features,
+	const base::Time &time )
 {
+    // the output is cleared first, so that a frame pair for which the
+    // matching fails results in no features with the time of this pair.
+    // Clearing the features keeps the time.
     stereoFeatures.clear();
+    if( stereo_features )
+	stereo_features->clear();
+    ( stereo_features ? *stereo_features : stereoFeatures ).time = time.isNull() ? base::Time::now() : time;
+
+    // track the features of the last pair, which limits the detection to
+    // the regions without enough tracks
+    const bool tracking = config.tracking && !config.leftOnly;
+    if( tracking )
+	trackFeatures( left_image, right_image );
+    else
+	resetTracking();
 
     findFeatures( left_image, right_image );
-    if(!getPutativeStereoCorrespondences())
+
+    // the depth of the left features is taken from the distance image
+    if( config.leftOnly )
+    {
+	calculateDepthInformationFromDistanceImage(stereo_features);
+	return;
+    }
+
+    // with tracking, there may be only few new features
+    if(!getPutativeStereoCorrespondences() && !tracking)
     {
       std::cout << "stereo::getPutativeStereoCorrespondences: returned false." << std::endl;
       return;
     }
     refineFeatureCorrespondences();
+    if( tracking )
+	mergeTrackedFeatures();
     calculateDepthInformationBetweenCorrespondences(stereo_features);
+    if( tracking )
+	updateTracks( left_image, right_image );
+}
+
+void StereoFeatures::resetTracking()
+{
+    trackingLeftImage.release();
+    trackingRightImage.release();
+    trackedLeft.keypoints.clear();
+    trackedLeft.descriptors.release();
+    trackedRight.keypoints.clear();
+    trackedRight.descriptors.release();
+    leftDetectionMask.release();
+    rightDetectionMask.release();
+}
+
+/** copy the keypoints and descriptor rows with the given indices */
+static void selectFeatures( const FeatureInfo &source, const std::vector<int> &indices, FeatureInfo &target )
+{
+    target.keypoints.clear();
+    target.keypoints.reserve( indices.size() );
+    cv::Mat descriptors( indices.size(), source.descriptors.cols, source.descriptors.type() );
+    for( size_t i = 0; i < indices.size(); i++ )
+    {
+	target.keypoints.push_back( source.keypoints[indices[i]] );
+	cv::Mat row = descriptors.row( i );
+	source.descriptors.row( indices[i] ).copyTo( row );
+    }
+    target.descriptors = descriptors;
+}
+
+void StereoFeatures::trackPoints( const cv::Mat &prevImage, const cv::Mat &image, 
+	const std::vector<cv::Point2f> &prev, std::vector<cv::Point2f> &next, std::vector<uchar> &status ) const
+{
+    const cv::Size winSize( config.trackingWindowSize, config.trackingWindowSize );
+    std::vector<float> err;
+    cv::calcOpticalFlowPyrLK( prevImage, image, prev, next, 
+	    status, err, winSize, config.trackingPyramidLevels );
+    if( config.maxTrackingError <= 0 )
+	return;
+
+    // track the points back into the previous image, the tracks which
+    // don't end up at their start have drifted
+    std::vector<cv::Point2f> back;
+    std::vector<uchar> backStatus;
+    cv::calcOpticalFlowPyrLK( image, prevImage, next, back, 
+	    backStatus, err, winSize, config.trackingPyramidLevels );
+    for( size_t i = 0; i < prev.size(); i++ )
+    {
+	const cv::Point2f d = back[i] - prev[i];
+	if( !backStatus[i] || d.dot( d ) > config.maxTrackingError * config.maxTrackingError )
+	    status[i] = 0;
+    }
+}
+
+void StereoFeatures::trackFeatures( const cv::Mat &leftImage, const cv::Mat &rightImage )
+{
+    // without tracks or after a change of the image size, all features are
+    // detected again
+    if( trackedLeft.keypoints.empty() || trackingLeftImage.size() != leftImage.size() 
+	    || trackingRightImage.size() != rightImage.size() )
+    {
+	resetTracking();
+	return;
+    }
+
+    std::vector<cv::Point2f> prevLeft, prevRight, nextLeft, nextRight;
+    cv::KeyPoint::convert( trackedLeft.keypoints, prevLeft );
+    cv::KeyPoint::convert( trackedRight.keypoints, prevRight );
+    std::vector<uchar> statusLeft, statusRight;
+    trackPoints( trackingLeftImage, leftImage, prevLeft, nextLeft, statusLeft );
+    trackPoints( trackingRightImage, rightImage, prevRight, nextRight, statusRight );
+
+    // keep the tracks which are found in both images and still fulfill the
+    // epipolar constraint
+    const cv::Rect bounds( 0, 0, leftImage.cols, leftImage.rows );
+    const cv::Rect_<float> boundsf( 0, 0, leftImage.cols, leftImage.rows );
+    std::vector<int> kept;
+    for( size_t i = 0; i < prevLeft.size(); i++ )
+    {
+	if( !statusLeft[i] || !statusRight[i] )
+	    continue;
+	const cv::Point2f &pl( nextLeft[i] ), &pr( nextRight[i] );
+	if( !boundsf.contains( pl ) || !boundsf.contains( pr ) )
+	    continue;
+	const double ydev = fabs( pl.y - pr.y );
+	const double disparity = pl.x - pr.x;
+	if( ydev >= config.maxStereoYDeviation || disparity <= 0 || disparity <= config.minStereoDisparity
+		|| ( config.maxStereoDisparity > 0 && disparity > config.maxStereoDisparity ) )
+	    continue;
+
+	trackedLeft.keypoints[i].pt = pl;
+	trackedRight.keypoints[i].pt = pr;
+	kept.push_back( i );
+    }
+    FeatureInfo left, right;
+    selectFeatures( trackedLeft, kept, left );
+    selectFeatures( trackedRight, kept, right );
+    trackedLeft = left;
+    trackedRight = right;
+
+    // count the tracks per cell, and detect in the cells with too few
+    const int bucketsX = std::max( 1, config.bucketsX );
+    const int bucketsY = std::max( 1, config.bucketsY );
+    std::vector<int> counts( bucketsX * bucketsY, 0 );
+    for( size_t i = 0; i < trackedLeft.keypoints.size(); i++ )
+    {
+	const cv::Point2f &pt( trackedLeft.keypoints[i].pt );
+	const int cx = std::min( bucketsX - 1, (int)(pt.x * bucketsX / leftImage.cols) );
+	const int cy = std::min( bucketsY - 1, (int)(pt.y * bucketsY / leftImage.rows) );
+	counts[cy * bucketsX + cx]++;
+    }
+
+    leftDetectionMask = cv::Mat::zeros( leftImage.size(), CV_8U );
+    rightDetectionMask = cv::Mat::zeros( rightImage.size(), CV_8U );
+    for( int cy = 0; cy < bucketsY; cy++ )
+    {
+	for( int cx = 0; cx < bucketsX; cx++ )
+	{
+	    if( counts[cy * bucketsX + cx] >= config.minTracksPerCell )
+		continue;
+
+	    const int x0 = leftImage.cols * cx / bucketsX, x1 = leftImage.cols * (cx + 1) / bucketsX;
+	    const int y0 = leftImage.rows * cy / bucketsY, y1 = leftImage.rows * (cy + 1) / bucketsY;
+	    leftDetectionMask( cv::Rect( x0, y0, x1 - x0, y1 - y0 ) ).setTo( 255 );
+
+	    // the matches of the left cell are on the same rows of the right
+	    // image, anywhere left of the cell
+	    const cv::Rect rows = cv::Rect( 0, y0 - config.maxStereoYDeviation, 
+		    x1, y1 - y0 + 2 * config.maxStereoYDeviation ) & bounds;
+	    rightDetectionMask( rows ).setTo( 255 );
+	}
+    }
+
+    // don't detect the tracked features again
+    const int radius = std::max( 1, config.trackingWindowSize / 2 );
+    for( size_t i = 0; i < trackedLeft.keypoints.size(); i++ )
+    {
+	cv::circle( leftDetectionMask, trackedLeft.keypoints[i].pt, radius, cv::Scalar( 0 ), -1 );
+	cv::circle( rightDetectionMask, trackedRight.keypoints[i].pt, radius, cv::Scalar( 0 ), -1 );
+    }
+}
+
+void StereoFeatures::mergeTrackedFeatures()
+{
+    // the new stereo features get new ids
+    for( size_t i = 0; i < stereoMatches.size(); i++ )
+    {
+	const int id = nextTrackId++;
+	leftFeatures.keypoints[stereoMatches[i].queryIdx].class_id = id;
+	rightFeatures.keypoints[stereoMatches[i].trainIdx].class_id = id;
+    }
+
+    // the tracked features are appended, with their descriptors from the
+    // frame they were detected in
+    const int leftOffset = leftFeatures.keypoints.size(), rightOffset = rightFeatures.keypoints.size();
+    for( size_t i = 0; i < trackedLeft.keypoints.size(); i++ )
+	stereoMatches.push_back( cv::DMatch( leftOffset + i, rightOffset + i, 0 ) );
+    if( !trackedLeft.keypoints.empty() )
+    {
+	leftFeatures.keypoints.insert( leftFeatures.keypoints.end(), trackedLeft.keypoints.begin(), trackedLeft.keypoints.end() );
+	leftFeatures.descriptors.push_back( trackedLeft.descriptors );
+	rightFeatures.keypoints.insert( rightFeatures.keypoints.end(), trackedRight.keypoints.begin(), trackedRight.keypoints.end() );
+	rightFeatures.descriptors.push_back( trackedRight.descriptors );
+    }
+}
+
+void StereoFeatures::updateTracks( const cv::Mat &leftImage, const cv::Mat &rightImage )
+{
+    leftImage.copyTo( trackingLeftImage );
+    rightImage.copyTo( trackingRightImage );
+
+    std::vector<int> leftIndices, rightIndices;
+    for( size_t i = 0; i < stereoMatches.size(); i++ )
+    {
+	leftIndices.push_back( stereoMatches[i].queryIdx );
+	rightIndices.push_back( stereoMatches[i].trainIdx );
+    }
+    selectFeatures( leftFeatures, leftIndices, trackedLeft );
+    selectFeatures( rightFeatures, rightIndices, trackedRight );
 }
 
 void StereoFeatures::findFeatures( const cv::Mat &leftImage, const cv::Mat &rightImage, int use_threading, int crop_left, int crop_right )
@@ -350,51 +730,74 @@ void StereoFeatures::findFeatures( const cv::Mat &leftImage, const cv::Mat &righ
     if( dist_left && psurf )
 	psurf->setDistanceImage( dist_left );
 
-    std::thread *t1 = NULL, *t2 = NULL;
     leftFeatures.keypoints.clear();
     rightFeatures.keypoints.clear();
+    // the matches of the last frame pair refer to the old features
+    putativeMatches.clear();
+    stereoMatches.clear();
+    predictedDisparities.clear();
+
+    // with the dense guidance, the right features are selected based on
+    // the left ones, so the right image can only be described afterwards
+    const bool guided = useDenseGuidance();
+    if( guided )
+	setupEpipolarMatcher();
+
+    // the tasks are run on the persistent thread pool, the group waits for
+    // them at the latest when it goes out of scope
+    TaskGroup tasks( getThreadPool() );
 
     switch(use_threading)
     {
-      case 2: // use internal and external threading (e.g. one thread per stereo image and four threads per individual image = 8 threads)
-        t1 = new std::thread(&StereoFeatures::findFeatures_threading, this, leftImage, std::ref(leftFeatures), true, crop_left, crop_right);
+      case 2: // use internal and external threading (one task per stereo image and one task per tile, see FeatureConfiguration::tilesX/tilesY)
+        tasks.run( [&]() { findFeatures_threading( leftImage, leftFeatures, true, crop_left, crop_right ); } );
         break;
-      case 1: // only use external threading (e.g. one thread per stereo image = 2 threads
-        t1 = new std::thread(&StereoFeatures::findFeatures2, this, leftImage, std::ref(leftFeatures), true, crop_left, crop_right);
+      case 1: // only use external threading (e.g. one task per stereo image = 2 tasks
+        tasks.run( [&]() { findFeatures2( leftImage, leftFeatures, true, crop_left, crop_right ); } );
         break;
       default: // use no threading
         findFeatures2( leftImage, leftFeatures, true, crop_left, crop_right );
         break;
     }
 
-    if( dist_right && psurf ) 
-	psurf->setDistanceImage( dist_right );
-
-    switch(use_threading)
+    if( guided )
     {
-      case 2: // use internal and external threading (e.g. one thread per stereo image and four threads per individual image = 8 threads)
-        t2 = new std::thread(&StereoFeatures::findFeatures_threading, this, rightImage, std::ref(rightFeatures), false, crop_left, crop_right);
-        break;
-      case 1: // only use external threading (e.g. one thread per stereo image = 2 threads
-        t2 = new std::thread(&StereoFeatures::findFeatures2, this, rightImage, std::ref(rightFeatures), false, crop_left, crop_right);
-        break;
-      default: // use no threading
-        findFeatures2( rightImage, rightFeatures, false, crop_left, crop_right );
-        break;
+	tasks.wait();
+	predictDisparities( leftFeatures.keypoints, predictedDisparities );
     }
 
-    if(use_threading > 0)
+    // in the left only mode, the right image is not used at all
+    if( config.leftOnly )
+    {
+	rightFeatures.descriptors = cv::Mat();
+    }
+    else
     {
-      t1->join();
-      t2->join();
+	if( dist_right && psurf ) 
+	    psurf->setDistanceImage( dist_right );
 
-      delete t1;
-      delete t2;
+	switch(use_threading)
+	{
+	  case 2: // use internal and external threading (one task per stereo image and one task per tile, see FeatureConfiguration::tilesX/tilesY)
+	    tasks.run( [&]() { findFeatures_threading( rightImage, rightFeatures, false, crop_left, crop_right ); } );
+	    break;
+	  case 1: // only use external threading (e.g. one task per stereo image = 2 tasks
+	    tasks.run( [&]() { findFeatures2( rightImage, rightFeatures, false, crop_left, crop_right ); } );
+	    break;
+	  default: // use no threading
+	    findFeatures2( rightImage, rightFeatures, false, crop_left, crop_right );
+	    break;
+	}
     }
 
-    if( config.adaptiveDetectorParam )
+    tasks.wait();
+
+    // with grid bucketing, the detector is kept and the number of features
+    // is limited per cell instead. With the detection masks of the tracking,
+    // the number of features says nothing about the detector threshold.
+    if( config.adaptiveDetectorParam && !config.gridBucketing && leftDetectionMask.empty() )
     {
-	size_t lastNumFeatures = 
+	size_t lastNumFeatures = config.leftOnly ? leftFeatures.keypoints.size() :
 	    std::min( leftFeatures.keypoints.size(), rightFeatures.keypoints.size() );
 
 	initDetector( lastNumFeatures );
@@ -403,8 +806,9 @@ void StereoFeatures::findFeatures( const cv::Mat &leftImage, const cv::Mat &righ
     if( config.debugImage )
     {
 	debugRightOffset = leftImage.size().width;
+	const cv::Size rightSize = config.leftOnly ? cv::Size() : rightImage.size();
 	cv::Size debugSize = 
-	    cv::Size(debugRightOffset + rightImage.size().width , leftImage.size().height);
+	    cv::Size(debugRightOffset + rightSize.width , leftImage.size().height);
 
 	debugImage.create( debugSize, CV_8UC3 );
 
@@ -415,18 +819,21 @@ void StereoFeatures::findFeatures( const cv::Mat &leftImage, const cv::Mat &righ
 		leftRoi,
 		CV_GRAY2BGR );
 
-	cv::Mat rightRoi( debugImage, cv::Rect( debugRightOffset, 0, rightImage.size().width, rightImage.size().height ) );  
-	cv::cvtColor( 
-		rightImage,
-		rightRoi,
-		CV_GRAY2BGR );
+	if( !config.leftOnly )
+	{
+	    cv::Mat rightRoi( debugImage, cv::Rect( debugRightOffset, 0, rightImage.size().width, rightImage.size().height ) );  
+	    cv::cvtColor( 
+		    rightImage,
+		    rightRoi,
+		    CV_GRAY2BGR );
+	}
     }
 }
 
 /** check if a match for knn > 1 is robust, by making sure, the distance to the
  * next match is further away than the first by a specific factor.
  */
-bool robustMatch( std::vector<cv::DMatch>& matches, float distanceFactor = 2.0 )
+bool robustMatch( const std::vector<cv::DMatch>& matches, float distanceFactor = 2.0 )
 {
     if( matches.size() >= 2 )
     {
@@ -443,13 +850,56 @@ bool robustMatch( std::vector<cv::DMatch>& matches, float distanceFactor = 2.0 )
  */
 void StereoFeatures::crossCheckMatching( const cv::Mat& descriptors1, const cv::Mat& descriptors2, std::vector<cv::DMatch>& filteredMatches12, int knn, float distanceFactor )
 {
+  if( useBruteForceMatching( descriptors1, descriptors2 ) )
+  {
+    // both directions from a single distance matrix
+    bruteForceMatcher.knnMatch( descriptors1, descriptors2, knnMatches12, knnMatches21, &getThreadPool() );
+    crossCheckMatching( knnMatches12, knnMatches21, filteredMatches12, knn, distanceFactor );
+    return;
+  }
+
   std::vector<std::vector<cv::DMatch> > matches12, matches21;
   descriptorMatcher->knnMatch( descriptors1, descriptors2, matches12, knn );
   descriptorMatcher->knnMatch( descriptors2, descriptors1, matches21, knn );
   crossCheckMatching(matches12, matches21, filteredMatches12, knn, distanceFactor);
 }
 
-void StereoFeatures::crossCheckMatching( std::vector<std::vector<cv::DMatch> > matches12, std::vector<std::vector<cv::DMatch> > matches21, std::vector<cv::DMatch>& filteredMatches12, int knn, float distanceFactor)
+bool StereoFeatures::useBruteForceMatching( const cv::Mat& descriptors1, const cv::Mat& descriptors2 ) const
+{
+  // small sets of descriptors can be faster to match exhaustively than
+  // with the two indices of the descriptor matcher. The multi-index hashing
+  // is an explicit choice for binary descriptors, so it is kept.
+  const int type = descriptors1.type();
+  if( type == CV_8U && config.multiIndexHashing )
+      return false;
+  return type == descriptors2.type() && ( type == CV_32F || type == CV_8U ) &&
+      (double)descriptors1.rows * descriptors2.rows <= config.bruteForceMatchLimit;
+}
+
+void StereoFeatures::crossCheckMatching( const cv::Mat& descriptors1, const base::Time& time1, 
+	const cv::Mat& descriptors2, const base::Time& time2,
+	std::vector<cv::DMatch>& filteredMatches12, int knn, float distanceFactor )
+{
+  // without the frame times, or without an index to reuse, there is
+  // nothing to cache
+  if( time1.isNull() || time2.isNull() || useBruteForceMatching( descriptors1, descriptors2 ) )
+  {
+    crossCheckMatching( descriptors1, descriptors2, filteredMatches12, knn, distanceFactor );
+    return;
+  }
+
+  // the previous frame is looked up first, so it is not evicted by the
+  // current frame
+  cv::Ptr<cv::DescriptorMatcher> matcher1 = indexCache.get( descriptorMatcher, time1, descriptors1 );
+  cv::Ptr<cv::DescriptorMatcher> matcher2 = indexCache.get( descriptorMatcher, time2, descriptors2 );
+
+  std::vector<std::vector<cv::DMatch> > matches12, matches21;
+  matcher2->knnMatch( descriptors1, matches12, knn );
+  matcher1->knnMatch( descriptors2, matches21, knn );
+  crossCheckMatching(matches12, matches21, filteredMatches12, knn, distanceFactor);
+}
+
+void StereoFeatures::crossCheckMatching( const std::vector<std::vector<cv::DMatch> >& matches12, const std::vector<std::vector<cv::DMatch> >& matches21, std::vector<cv::DMatch>& filteredMatches12, int knn, float distanceFactor)
 {
     filteredMatches12.clear();
     for( size_t m = 0; m < matches12.size(); m++ )
@@ -459,14 +909,14 @@ void StereoFeatures::crossCheckMatching( std::vector<std::vector<cv::DMatch> > m
 
 	if( !matches12[m].empty() )
 	{
-	    cv::DMatch &forward = matches12[m][0];
+	    const cv::DMatch &forward = matches12[m][0];
 
 	    if( knn > 1 && !robustMatch( matches21[forward.trainIdx], distanceFactor ) )
 		continue;
 
 	    if( !matches21[forward.trainIdx].empty() )
 	    {
-		cv::DMatch backward = matches21[forward.trainIdx][0];
+		const cv::DMatch &backward = matches21[forward.trainIdx][0];
 
                 if( backward.trainIdx == forward.queryIdx )
                 {
@@ -477,9 +927,97 @@ void StereoFeatures::crossCheckMatching( std::vector<std::vector<cv::DMatch> > m
     }
 }
 
+/** the same as robustMatch for the matches of a query in a KnnMatches */
+static bool robustMatch( const KnnMatches& matches, int query, float distanceFactor )
+{
+    return matches.getCount( query ) >= 2 && 
+	matches.getDistance( query, 0 ) * distanceFactor < matches.getDistance( query, 1 );
+}
+
+void StereoFeatures::crossCheckMatching( const KnnMatches& matches12, const KnnMatches& matches21, std::vector<cv::DMatch>& filteredMatches12, int knn, float distanceFactor)
+{
+    filteredMatches12.clear();
+    for( int query = 0; query < matches12.size(); query++ )
+    {
+	if( matches12.getCount( query ) == 0 )
+	    continue;
+	if( knn > 1 && !robustMatch( matches12, query, distanceFactor ) )
+	    continue;
+
+	const int train = matches12.getIndex( query, 0 );
+	if( matches21.getCount( train ) == 0 )
+	    continue;
+	if( knn > 1 && !robustMatch( matches21, train, distanceFactor ) )
+	    continue;
+
+	if( matches21.getIndex( train, 0 ) == query )
+	    filteredMatches12.push_back( cv::DMatch( query, train, matches12.getDistance( query, 0 ) ) );
+    }
+}
+
+bool StereoFeatures::useDenseGuidance() const
+{
+    return config.stereoMatcher == STEREO_MATCHER_DENSE_GUIDED && dist_left && !use_gpu_detector;
+}
+
+void StereoFeatures::setupEpipolarMatcher()
+{
+    epipolarMatcher.setMaxYDeviation( config.maxStereoYDeviation );
+    epipolarMatcher.setDisparityRange( config.minStereoDisparity, config.maxStereoDisparity );
+    epipolarMatcher.setSearchRadius( config.denseGuidedSearchRadius );
+}
+
+bool StereoFeatures::getDistance( const cv::Point2f &pt, float &distance ) const
+{
+    // bilinear interpolation between the four neighbouring pixels, which
+    // all need to be valid
+    const int x = floor( pt.x ), y = floor( pt.y );
+    if( x < 0 || y < 0 || x + 1 >= (int)dist_left->width || y + 1 >= (int)dist_left->height )
+	return false;
+
+    const float *row0 = &dist_left->data[ y * dist_left->width + x ];
+    const float *row1 = row0 + dist_left->width;
+    const float d[4] = { row0[0], row0[1], row1[0], row1[1] };
+    float dmin = std::numeric_limits<float>::infinity(), dmax = 0;
+    for( int i = 0; i < 4; i++ )
+    {
+	// NaN fails this test as well
+	if( !( d[i] > 0 && d[i] < std::numeric_limits<float>::infinity() ) )
+	    return false;
+	dmin = std::min( dmin, d[i] );
+	dmax = std::max( dmax, d[i] );
+    }
+
+    // don't interpolate across depth discontinuities, where the result
+    // would lie between foreground and background
+    if( dmax > dmin * (1.0f + config.maxDistanceJump) )
+	return false;
+
+    const float fx = pt.x - x, fy = pt.y - y;
+    distance = (1.0f - fy) * ((1.0f - fx) * d[0] + fx * d[1]) 
+	+ fy * ((1.0f - fx) * d[2] + fx * d[3]);
+    return true;
+}
+
+void StereoFeatures::predictDisparities( const std::vector<cv::KeyPoint> &keypoints, std::vector<float> &disparities ) const
+{
+    // the inverse of the conversion in DenseStereo::getDistanceImages
+    const frame_helper::StereoCalibration &stereoCalib( calib.getCalibration() );
+    const float distFactor = fabs( stereoCalib.camLeft.fx * stereoCalib.extrinsic.tx );
+
+    disparities.resize( keypoints.size() );
+    for( size_t i = 0; i < keypoints.size(); i++ )
+    {
+	float distance;
+	disparities[i] = getDistance( keypoints[i].pt, distance ) ? 
+	    distFactor / distance : 
+	    std::numeric_limits<float>::quiet_NaN();
+    }
+}
+
 bool StereoFeatures::getPutativeStereoCorrespondences()
 {
-    std::vector<cv::DMatch> stereoCorrespondences;
+    putativeMatches.clear();
     if(leftFeatures.descriptors.rows < 5 || rightFeatures.descriptors.rows < 5)
     {
 	std::cerr << "GetPutativeStereoCorrespondences_Descriptor: At least 5 features are needed left and right, currently " <<
@@ -494,8 +1032,22 @@ bool StereoFeatures::getPutativeStereoCorrespondences()
     // is unavailable
     if(!use_gpu_detector)
     {
-        // do good cross check matching
-        crossCheckMatching( leftFeatures.descriptors, rightFeatures.descriptors, stereoCorrespondences, config.knn, config.distanceFactor);
+        if( config.stereoMatcher == STEREO_MATCHER_EPIPOLAR || config.stereoMatcher == STEREO_MATCHER_DENSE_GUIDED )
+        {
+            // only match features on the same rows of the rectified images,
+            // and close to the disparity of the dense stereo if available
+            setupEpipolarMatcher();
+            const bool guided = useDenseGuidance() && predictedDisparities.size() == leftFeatures.keypoints.size();
+            epipolarMatcher.match( leftFeatures.keypoints, leftFeatures.descriptors,
+                    rightFeatures.keypoints, rightFeatures.descriptors,
+                    putativeMatches, config.knn, config.distanceFactor,
+                    guided ? &predictedDisparities : NULL );
+        }
+        else
+        {
+            // do good cross check matching
+            crossCheckMatching( leftFeatures.descriptors, rightFeatures.descriptors, putativeMatches, config.knn, config.distanceFactor);
+        }
     }
 #ifdef OPENCV_HAS_SURF_GPU
     else
@@ -514,34 +1066,12 @@ bool StereoFeatures::getPutativeStereoCorrespondences()
             std::vector<std::vector<cv::DMatch> >matches21;
             cv::gpu::BruteForceMatcher_GPU< cv::L2<float> >::knnMatchDownload(trainIdx2, distance2, matches21);
             // use the gpu generated data for a cross check match
-            crossCheckMatching(matches12, matches21, stereoCorrespondences, config.knn, config.distanceFactor);
+            crossCheckMatching(matches12, matches21, putativeMatches, config.knn, config.distanceFactor);
     }
 #endif
 
-    // resize the descriptor matrices
-    leftPutativeMatches.descriptors.create( stereoCorrespondences.size(),
-	    leftFeatures.descriptors.cols, leftFeatures.descriptors.type());
-    rightPutativeMatches.descriptors.create( stereoCorrespondences.size(),
-	    rightFeatures.descriptors.cols, rightFeatures.descriptors.type());
-
-    // purge the two old putative matches arrays
-    leftPutativeMatches.keypoints.clear();
-    rightPutativeMatches.keypoints.clear();
-
-    // extract all matched descriptors and points into the putative matces vector
-    for(size_t i = 0; i < stereoCorrespondences.size(); i++ )
-    {
-        int q_i = stereoCorrespondences.at(i).queryIdx; 
-        leftPutativeMatches.keypoints.push_back(leftFeatures.keypoints[q_i]); 
-        cv::Mat curRow = leftPutativeMatches.descriptors.row(i);
-        leftFeatures.descriptors.row(q_i).copyTo(curRow);
-
-        int t_i = stereoCorrespondences.at(i).trainIdx; 
-        rightPutativeMatches.keypoints.push_back(rightFeatures.keypoints[t_i]); 
-        curRow = rightPutativeMatches.descriptors.row(i);
-        rightFeatures.descriptors.row(t_i).copyTo(curRow);
-    }
-
+    // the matches only refer to the features, descriptors are not copied
+    // until the final stereo features are created
     return true;
 }
 
@@ -549,8 +1079,13 @@ bool StereoFeatures::refineFeatureCorrespondences()
 {
     // extract the 2d points from the keypoint lists
     vector<cv::Point2f> points1, points2;
-    cv::KeyPoint::convert(leftPutativeMatches.keypoints, points1);
-    cv::KeyPoint::convert(rightPutativeMatches.keypoints, points2);
+    points1.reserve( putativeMatches.size() );
+    points2.reserve( putativeMatches.size() );
+    for(size_t i = 0; i < putativeMatches.size(); i++ )
+    {
+	points1.push_back( leftFeatures.keypoints[putativeMatches[i].queryIdx].pt );
+	points2.push_back( rightFeatures.keypoints[putativeMatches[i].trainIdx].pt );
+    }
 
     vector<uchar> matchesMask;
     // the number of correctly matched points will be contained in this integer
@@ -565,13 +1100,11 @@ bool StereoFeatures::refineFeatureCorrespondences()
 	case FILTER_HOMOGRAPHY:
         {
             // check if there are enough points for homography extraction
-            if(leftPutativeMatches.keypoints.size() < 4 || rightPutativeMatches.keypoints.size() < 4)	
+            if(putativeMatches.size() < 4)	
             {
                 cout << "RefineFeatureCorrespondences(HOMOGRAPHY): " 
-		     << "At least 4 features are needed left and right, currently " 
-		     << leftPutativeMatches.keypoints.size() << "left and " 
-		     << rightPutativeMatches.keypoints.size()
-		     << " right detected!" << endl;
+		     << "At least 4 matches are needed, currently " 
+		     << putativeMatches.size() << " found!" << endl;
 		runDefault = true;
                 break;
             }
@@ -581,12 +1114,12 @@ bool StereoFeatures::refineFeatureCorrespondences()
             // create the mask: transform the left points using the homography, and compare the result with the right points. If that is equal (or very near) it is an inlier.
             cv::Mat transformed_left_points;
             // create the mask list, which contains the inliers
-            matchesMask = vector<uchar>( leftPutativeMatches.keypoints.size(), 0 );
+            matchesMask = vector<uchar>( putativeMatches.size(), 0 );
     
             perspectiveTransform(cv::Mat(points1), transformed_left_points, H12);
-            for(size_t i = 0; i < leftPutativeMatches.keypoints.size(); i++ )
+            for(size_t i = 0; i < putativeMatches.size(); i++ )
             {
-                if(norm(rightPutativeMatches.keypoints[i].pt - transformed_left_points.at<cv::Point2f>(i,0)) < 4 ) // inlier
+                if(norm(points2[i] - transformed_left_points.at<cv::Point2f>(i,0)) < 4 ) // inlier
                 {
                     matchesMask[i] = 1;
                     numberOfGood++;
@@ -597,11 +1130,10 @@ bool StereoFeatures::refineFeatureCorrespondences()
         case FILTER_FUNDAMENTAL:
         {
             // check if there are enough points for fundamental matrix extraction
-            if(leftPutativeMatches.keypoints.size() < 8 || rightPutativeMatches.keypoints.size() < 8)	
+            if(putativeMatches.size() < 8)	
             {
-                cout << "RefineFeatureCorrespondences(FUNDAMENTAL): At least 8 features are needed left and right, currently " 
-		    << leftPutativeMatches.keypoints.size() << " left and " 
-		    << rightPutativeMatches.keypoints.size() << " right detected!" << endl;
+                cout << "RefineFeatureCorrespondences(FUNDAMENTAL): At least 8 matches are needed, currently " 
+		    << putativeMatches.size() << " found!" << endl;
 		runDefault = true;
                 break;
             }
@@ -616,11 +1148,11 @@ bool StereoFeatures::refineFeatureCorrespondences()
         }
         case FILTER_STEREO:
             // just check, if the epipolar geometry is maintained for each match
-            matchesMask = vector<uchar>( leftPutativeMatches.keypoints.size(), 0 );
+            matchesMask = vector<uchar>( putativeMatches.size(), 0 );
             for(size_t i = 0; i < matchesMask.size(); i++)
             {
-		const double ydev = fabs( leftPutativeMatches.keypoints[i].pt.y - rightPutativeMatches.keypoints[i].pt.y );
-		const double disparity = leftPutativeMatches.keypoints[i].pt.x - rightPutativeMatches.keypoints[i].pt.x;
+		const double ydev = fabs( points1[i].y - points2[i].y );
+		const double disparity = points1[i].x - points2[i].x;
                 if( ydev < config.maxStereoYDeviation && disparity > 0 )
                 {
                     matchesMask[i] = 1;
@@ -639,34 +1171,19 @@ bool StereoFeatures::refineFeatureCorrespondences()
     if( runDefault )
     {
         // no filter selected, make all matches positive.
-        numberOfGood = leftPutativeMatches.keypoints.size();
-        matchesMask = vector<uchar>( leftPutativeMatches.keypoints.size(), 1 );
+        numberOfGood = putativeMatches.size();
+        matchesMask = vector<uchar>( putativeMatches.size(), 1 );
     }
 
-    assert( matchesMask.size() == leftPutativeMatches.keypoints.size() );
+    assert( matchesMask.size() == putativeMatches.size() );
 
-    // resize the descriptor matrices
-    leftMatches.descriptors.create(numberOfGood, leftPutativeMatches.descriptors.cols, leftPutativeMatches.descriptors.type());
-    rightMatches.descriptors.create(numberOfGood, rightPutativeMatches.descriptors.cols, rightPutativeMatches.descriptors.type());
-
-    // purge the two old matches arrays
-    leftMatches.keypoints.clear();
-    rightMatches.keypoints.clear();
-
-    int counter = 0;
-    // extract all matched putative descriptors and points into the matces vector
-    for(size_t i = 0; i < leftPutativeMatches.keypoints.size(); i++ )
+    // keep the matches which passed the filter
+    stereoMatches.clear();
+    stereoMatches.reserve( numberOfGood );
+    for(size_t i = 0; i < putativeMatches.size(); i++ )
     {
         if(matchesMask[i] == 1)
-        {
-            leftMatches.keypoints.push_back(leftPutativeMatches.keypoints[i]); 
-            cv::Mat curRow = leftMatches.descriptors.row(counter);
-            leftPutativeMatches.descriptors.row(i).copyTo(curRow);
-            rightMatches.keypoints.push_back(rightPutativeMatches.keypoints[i]); 
-            curRow = rightMatches.descriptors.row(counter);
-            rightPutativeMatches.descriptors.row(i).copyTo(curRow);
-            counter++;
-        }
+            stereoMatches.push_back( putativeMatches[i] );
     }
 
     if( config.debugImage )
@@ -674,23 +1191,25 @@ bool StereoFeatures::refineFeatureCorrespondences()
 	// draw left inter-frame correspondences
 	cv::Scalar color = cv::Scalar(0, 255, 0);
 	int width = 1;
-	for(size_t i = 0; i < leftMatches.keypoints.size() && i < rightMatches.keypoints.size(); i++ )
+	for(size_t i = 0; i < stereoMatches.size(); i++ )
 	{
+	    const cv::KeyPoint &left( leftFeatures.keypoints[stereoMatches[i].queryIdx] );
+	    const cv::KeyPoint &right( rightFeatures.keypoints[stereoMatches[i].trainIdx] );
 	    cv::Point center1, center2;
-	    center1 = leftMatches.keypoints[i].pt;
-	    center2 = rightMatches.keypoints[i].pt;
+	    center1 = left.pt;
+	    center2 = right.pt;
 	    center2.x += debugRightOffset;
 	    cv::line( debugImage, center1, center2, color, width);
 
-	    int lradius = cvRound(leftMatches.keypoints[i].size*1.2/9.*2);
+	    int lradius = cvRound(left.size*1.2/9.*2);
 	    cv::circle( debugImage, center1, lradius + 2, cvScalar(0, 0, 255), 1, 8, 0 );
 
-	    int rradius = cvRound(rightMatches.keypoints[i].size*1.2/9.*2);
+	    int rradius = cvRound(right.size*1.2/9.*2);
 	    cv::circle( debugImage, center2, rradius + 2, cvScalar(0, 0, 255), 1, 8, 0 );
 	}
     }
 
-//    std::cout << "Number of refined stereo matches: " << counter << std::endl;
+//    std::cout << "Number of refined stereo matches: " << stereoMatches.size() << std::endl;
     return !runDefault;
 }
 
@@ -704,8 +1223,7 @@ void StereoFeatures::calculateDepthInformationBetweenCorrespondences(StereoFeatu
 
     stereo_feature_pointer->clear();
 
-    // currently we always use the surf descriptor (might change)
-    stereo_feature_pointer->descriptorType = stereo::DESCRIPTOR_SURF;
+    stereo_feature_pointer->descriptorType = config.descriptorType;
 
     // get Q Projection Matrix as Eigen
     Eigen::Matrix4d Q;
@@ -714,69 +1232,128 @@ void StereoFeatures::calculateDepthInformationBetweenCorrespondences(StereoFeatu
     stereo_feature_pointer->mean_z_value = 0;
 
     // loop through all features available
-    for(size_t i = 0; i < leftMatches.keypoints.size(); i++)
+    for(size_t i = 0; i < stereoMatches.size(); i++)
     {
+	const int leftIdx = stereoMatches[i].queryIdx;
+	const cv::KeyPoint &left( leftFeatures.keypoints[leftIdx] );
+	const cv::KeyPoint &right( rightFeatures.keypoints[stereoMatches[i].trainIdx] );
+
         //ok, we found a match. put all the necessary data into the new data structure
-        Eigen::Vector4d v;
-        // build the 3d point
-        v[0] = leftMatches.keypoints[i].pt.x;
-        v[1] = leftMatches.keypoints[i].pt.y;
-        v[2] = rightMatches.keypoints[i].pt.x - leftMatches.keypoints[i].pt.x; // disparity
-	v[3] = 1.0;
-
-	// perform projection to 3d space
-	// and change to meters instead of mm
-	Eigen::Vector4d vh = Q * v;
-	vh *= .001/vh[3];
-
-	// TODO for the time being take only left keypoints. However, it might
-	// be better to take the keypoint with the strongest response
-	cv::KeyPoint kp;
-	// calculate the keypointSize from the calibration matrix's fx parameter 
-	//  correct for unit and scale by distance (z.value)
-	const double keypointSize = leftMatches.keypoints[i].size 
-	    / calib.camLeft.camMatrix.at<double>(0,0) * vh[2];
-	kp.size = keypointSize;
-	kp.angle = leftMatches.keypoints[i].angle;
-	kp.response = leftMatches.keypoints[i].response;
-	kp.pt = leftMatches.keypoints[i].pt ;
-
-	stereo_feature_pointer->push_back( 
-		vh.head<3>(), kp, 
-		Eigen::Map<StereoFeatureArray::Descriptor>( 
-		    leftMatches.descriptors.ptr<float>(i), leftMatches.descriptors.cols ) );
-        // keep a running average of the mean z position
-        stereo_feature_pointer->mean_z_value += vh[2];
+	addStereoFeature( *stereo_feature_pointer, Q, leftIdx, left.pt.x - right.pt.x );
     }
-    if(leftMatches.keypoints.size() > 0)
-      stereo_feature_pointer->mean_z_value /= (double)(leftMatches.keypoints.size());
+    if(stereoMatches.size() > 0)
+      stereo_feature_pointer->mean_z_value /= (double)(stereoMatches.size());
 std::cout << "****************************************** mean_z: " << stereo_feature_pointer->mean_z_value  / -100.0 << "m" << std::endl;
 }
 
+void StereoFeatures::calculateDepthInformationFromDistanceImage(StereoFeatureArray *stereo_features)
+{
+    if( !dist_left )
+	throw std::runtime_error( "calculateDepthInformationFromDistanceImage: no left distance image set, see setDistanceImages()" );
+
+    StereoFeatureArray *stereo_feature_pointer = &stereoFeatures;
+    if(stereo_features)
+      stereo_feature_pointer = stereo_features;
+
+    stereo_feature_pointer->clear();
+    stereo_feature_pointer->descriptorType = config.descriptorType;
+
+    Eigen::Matrix4d Q;
+    cv2eigen( calib.Q, Q );
+
+    stereo_feature_pointer->mean_z_value = 0;
+
+    // the distance is converted back to the disparity, so that the points
+    // are projected with Q in the same way as the triangulated ones
+    std::vector<float> disparities;
+    predictDisparities( leftFeatures.keypoints, disparities );
+    for(size_t i = 0; i < disparities.size(); i++)
+    {
+	// features without a valid distance are dropped
+	if( std::isnan( disparities[i] ) )
+	    continue;
+
+	addStereoFeature( *stereo_feature_pointer, Q, i, disparities[i] );
+    }
+    if(stereo_feature_pointer->size() > 0)
+      stereo_feature_pointer->mean_z_value /= (double)(stereo_feature_pointer->size());
+}
+
+void StereoFeatures::addStereoFeature( StereoFeatureArray &features, const Eigen::Matrix4d &Q, int leftIdx, double disparity )
+{
+    const cv::KeyPoint &left( leftFeatures.keypoints[leftIdx] );
+
+    Eigen::Vector4d v;
+    // build the 3d point
+    v[0] = left.pt.x;
+    v[1] = left.pt.y;
+    v[2] = -disparity; // right x - left x
+    v[3] = 1.0;
+
+    // perform projection to 3d space
+    // and change to meters instead of mm
+    Eigen::Vector4d vh = Q * v;
+    vh *= .001/vh[3];
+
+    // TODO for the time being take only left keypoints. However, it might
+    // be better to take the keypoint with the strongest response
+    cv::KeyPoint kp;
+    // calculate the keypointSize from the calibration matrix's fx parameter 
+    //  correct for unit and scale by distance (z.value)
+    const double keypointSize = left.size 
+	/ calib.camLeft.camMatrix.at<double>(0,0) * vh[2];
+    kp.size = keypointSize;
+    kp.angle = left.angle;
+    kp.response = left.response;
+    kp.pt = left.pt ;
+    // the class_id is only used as the track id of the tracking mode
+    kp.class_id = config.tracking && !config.leftOnly ? left.class_id : -1;
+
+    // the descriptor is copied directly from the detected features
+    if( features.isBinary() )
+	features.push_back( vh.head<3>(), kp, leftFeatures.descriptors.row(leftIdx) );
+    else
+	features.push_back( 
+		vh.head<3>(), kp, 
+		Eigen::Map<StereoFeatureArray::Descriptor>( 
+		    leftFeatures.descriptors.ptr<float>(leftIdx), leftFeatures.descriptors.cols ) );
+    // keep a running average of the mean z position
+    features.mean_z_value += vh[2];
+}
+
+std::vector<float> StereoFeatures::getStereoDisparities() const
+{
+    std::vector<float> disparities;
+    disparities.reserve( stereoMatches.size() );
+    for( size_t i = 0; i < stereoMatches.size(); i++ )
+	disparities.push_back( leftFeatures.keypoints[stereoMatches[i].queryIdx].pt.x 
+		- rightFeatures.keypoints[stereoMatches[i].trainIdx].pt.x );
+    return disparities;
+}
+
 void StereoFeatures::calculateInterFrameCorrespondences( const StereoFeatureArray& frame1, const StereoFeatureArray& frame2, int filterMethod )
 {
     // get features as cv::Mat from arrays
-    // need to const cast here, as opencv doesn't provide a way to supply a const void *
-    const cv::Mat feat1 = 
-	cv::Mat( frame1.size(), frame1.descriptorSize, cv::DataType<float>::type, const_cast<float*>(&frame1.descriptors[0]) ); 
-    const cv::Mat feat2 = 
-	cv::Mat( frame2.size(), frame2.descriptorSize, cv::DataType<float>::type, const_cast<float*>(&frame2.descriptors[0]) ); 
+    const cv::Mat feat1 = frame1.getDescriptors();
+    const cv::Mat feat2 = frame2.getDescriptors();
 
     std::vector<Eigen::Vector3d> p1, p2;
     std::copy( frame1.points.begin(), frame1.points.end(), std::back_inserter( p1 ) );
     std::copy( frame2.points.begin(), frame2.points.end(), std::back_inserter( p2 ) );
 
-    calculateInterFrameCorrespondences( feat1, frame1.keypoints, p1, feat2, frame2.keypoints, p2, filterMethod );
+    calculateInterFrameCorrespondences( feat1, frame1.keypoints, p1, feat2, frame2.keypoints, p2, filterMethod, frame1.time, frame2.time );
 }
 
 void StereoFeatures::calculateInterFrameCorrespondences( 
 	const cv::Mat& feat1, const std::vector<cv::KeyPoint>& keyp1, const std::vector<Eigen::Vector3d>& points1,
 	const cv::Mat& feat2, const std::vector<cv::KeyPoint>& keyp2, const std::vector<Eigen::Vector3d>& points2, 
-	int filterMethod )
+	int filterMethod, const base::Time& time1, const base::Time& time2 )
 {
     int numberOfGood = 0;
     std::vector<cv::DMatch> leftCorrespondences;
     std::vector<uchar> matches_mask;
+    const int requestedFilterMethod = filterMethod;
+    bool predicted = false;
 
     const int minFeatures = 5;
     if( feat1.rows < minFeatures || feat2.rows < minFeatures )
@@ -790,9 +1367,12 @@ void StereoFeatures::calculateInterFrameCorrespondences(
     }
     else
     {
-        // do cross check matching and pre filtering of features
-	crossCheckMatching( feat1, feat2, 
-		leftCorrespondences, config.knn, config.distanceFactor );
+        // do cross check matching and pre filtering of features, if
+        // possible only around the positions predicted from the motion
+	predicted = predictedMatching( feat1, points1, feat2, keyp2, leftCorrespondences );
+	if( !predicted )
+	    crossCheckMatching( feat1, time1, feat2, time2, 
+		    leftCorrespondences, config.knn, config.distanceFactor );
 
 	// match the features by size
 	// TODO do properly
@@ -842,7 +1422,27 @@ void StereoFeatures::calculateInterFrameCorrespondences(
 	    if( x.size() >= 3 )
 	    {
 		stereo::ransac::FitTransformUncertain fit( x, p, e1, e2, DIST_THRESHOLD );
-		stereo::ransac::ransacSingleModel( fit, 3, DIST_THRESHOLD, best_model, best_inliers, config.isometryFilterMaxSteps );
+		if( config.isometryFilterThreads > 1 )
+		    stereo::ransac::ransacParallelModel( fit, 3, DIST_THRESHOLD, best_model, best_inliers, 
+			    getThreadPool(), config.isometryFilterThreads, config.isometryFilterSeed, config.isometryFilterMaxSteps );
+		else if( config.isometryFilterSampler == RANSAC_SAMPLER_PROSAC || config.isometryFilterSprt )
+		{
+		    stereo::ransac::RansacOptions options;
+		    options.sprt = config.isometryFilterSprt;
+		    options.seed = config.isometryFilterSeed;
+		    if( config.isometryFilterSampler == RANSAC_SAMPLER_PROSAC )
+		    {
+			// the correspondences with the lowest descriptor distance first
+			options.prosacOrder.resize( x.size() );
+			for( size_t i = 0; i < x.size(); i++ )
+			    options.prosacOrder[i] = i;
+			std::stable_sort( options.prosacOrder.begin(), options.prosacOrder.end(), 
+				[&]( size_t a, size_t b ) { return leftCorrespondences[a].distance < leftCorrespondences[b].distance; } );
+		    }
+		    stereo::ransac::ransacModel( fit, 3, DIST_THRESHOLD, best_model, best_inliers, options, config.isometryFilterMaxSteps );
+		}
+		else
+		    stereo::ransac::ransacSingleModel( fit, 3, DIST_THRESHOLD, best_model, best_inliers, config.isometryFilterMaxSteps, config.isometryFilterSeed );
 
 		correspondenceTransform = best_model;
 	    }
@@ -947,9 +1547,54 @@ void StereoFeatures::calculateInterFrameCorrespondences(
 //    cout << "Number of detected Features: " << keyp1.size() << " Number of putative inter-frame matches: " 
 //	<< leftCorrespondences.size() << " number of filtered inter-frame matches: " << correspondences.size() << endl;
 
+    if( predicted && correspondences.size() < (size_t)config.minInterFrameInliers )
+    {
+	// the prediction did not hold, so match all features
+	hasMotionPrior = false;
+	calculateInterFrameCorrespondences( feat1, keyp1, points1, feat2, keyp2, points2, requestedFilterMethod, time1, time2 );
+	return;
+    }
+
+    // the motion of this pair of frames is the prior for the next one
+    if( filterMethod == FILTER_ISOMETRY && correspondences.size() >= (size_t)config.minInterFrameInliers )
+    {
+	motionPrior = correspondenceTransform;
+	hasMotionPrior = true;
+    }
+
     return;
 }
 
+bool StereoFeatures::predictedMatching( const cv::Mat& feat1, const std::vector<Eigen::Vector3d>& points1,
+	const cv::Mat& feat2, const std::vector<cv::KeyPoint>& keyp2, std::vector<cv::DMatch>& matches )
+{
+    if( !config.predictedInterFrameSearch || !hasMotionPrior || calib.Q.empty() )
+	return false;
+
+    // points1 = motion * points2
+    const Eigen::Affine3d motion = motionPrior.inverse();
+
+    // the inverse of the projection with Q in addStereoFeature, which
+    // scales x - cx, y - cy and f by the same factor
+    Eigen::Matrix4d Q;
+    cv2eigen( calib.Q, Q );
+    const double f = Q(2,3), cx = -Q(0,3), cy = -Q(1,3);
+
+    std::vector<cv::Point2f> predicted( points1.size() );
+    for( size_t i = 0; i < points1.size(); i++ )
+    {
+	const Eigen::Vector3d p = motion * points1[i];
+	if( fabs( p.z() ) > 1e-9 )
+	    predicted[i] = cv::Point2f( p.x() / p.z() * f + cx, p.y() / p.z() * f + cy );
+	else
+	    predicted[i] = cv::Point2f( std::numeric_limits<float>::quiet_NaN(), std::numeric_limits<float>::quiet_NaN() );
+    }
+
+    windowMatcher.setRadius( config.interFrameSearchRadius );
+    windowMatcher.match( predicted, feat1, keyp2, feat2, matches, config.knn, config.distanceFactor );
+    return true;
+}
+
 cv::Mat StereoFeatures::getInterFrameDebugImage( const cv::Mat& debug1, const StereoFeatureArray& frame1, const cv::Mat& debug2, const StereoFeatureArray& frame2, std::vector<std::pair<long,long> > *correspondence )
 {
     // throw warning message if used incorrectly
@@ -3,6 +3,11 @@
 
 #include <stereo/config.h>
 #include <stereo/sparse_stereo_types.h>
+#include <stereo/thread_pool.hpp>
+#include <stereo/epipolar_matcher.hpp>
+#include <stereo/window_matcher.hpp>
+#include <stereo/brute_force_matcher.hpp>
+#include <stereo/descriptor_index_cache.hpp>
 #include <frame_helper/CalibrationCv.h>
 #include <base/Time.hpp>
 #include <base/Eigen.hpp>
@@ -44,6 +49,13 @@ public:
      */
     void setDetectorConfiguration( const DetectorConfiguration &detector_config );
 
+    /** Set the thread pool used for the threaded feature detection. The
+     * same pool can be shared by several instances, e.g. for multiple
+     * cameras on the same host. If no pool is set, the process wide
+     * ThreadPool::getDefault() is used.
+     */
+    void setThreadPool( const std::shared_ptr<ThreadPool>& pool ) { threadPool = pool; }
+
     /** optionally set the distance images before each call to process frame 
      * pair, in order to perform a perspective undistort of the features
      * before running the descriptor.
@@ -57,10 +69,21 @@ public:
     /** Perform the processing on a stereo frame pair.
      * This will perform feature detection, description, matching and filtering 
      * based on the configuration given in the configuration class.
-     * If the optional last parameter is given, it will not work in class internal 
+     * If the optional parameter stereo_features is given, it will not work in class internal 
      * storage, but in the storage provided.
+     * The time is stored in the resulting StereoFeatureArray, and identifies
+     * the frame in the descriptor index cache of
+     * calculateInterFrameCorrespondences. If it is not given, the time of
+     * the call is used.
      */
-    void processFramePair( const cv::Mat &left_image, const cv::Mat &right_image, StereoFeatureArray *stereo_features = NULL );
+    void processFramePair( const cv::Mat &left_image, const cv::Mat &right_image, StereoFeatureArray *stereo_features = NULL,
+	    const base::Time &time = base::Time() );
+
+    /** drop all tracks of the tracking mode, so that the features of the
+     * next frame pair are detected from scratch, e.g. after a gap in the
+     * image stream.
+     */
+    void resetTracking();
      
     /** Get the result of the last stereo image processing step.
      */
@@ -74,13 +97,30 @@ public:
      */
     FeatureInfo& getFeatureInfoRight() { return rightFeatures; }
 
+    /** Get the disparities (left x - right x) in pixels of the stereo
+     * correspondences of the last processed frame pair, e.g. to set the
+     * disparity range of the dense stereo processing of the same pair.
+     */
+    std::vector<float> getStereoDisparities() const;
+
     /** calculate the relation between two stereo pairs
      */
     void calculateInterFrameCorrespondences( const StereoFeatureArray& frame1, const StereoFeatureArray& frame2, int filterMethod );
+
+    /** calculate the relation between two stereo pairs. If the times of the
+     * frames are given, the descriptor indices of the frames are kept in a
+     * cache, so that the index of the current frame is reused when it is the
+     * previous frame of the next call.
+     */
     void calculateInterFrameCorrespondences( 
 	    const cv::Mat& feat1, const std::vector<cv::KeyPoint>& keyp1, const std::vector<Eigen::Vector3d>& points1,
 	    const cv::Mat& feat2, const std::vector<cv::KeyPoint>& keyp2, const std::vector<Eigen::Vector3d>& points2, 
-	    int filterMethod );
+	    int filterMethod, const base::Time& time1 = base::Time(), const base::Time& time2 = base::Time() );
+
+    /** number of inter-frame matches, for which the descriptor index of a
+     * frame was found in the cache, and for which it had to be built */
+    size_t getIndexCacheHits() const { return indexCache.getHits(); }
+    size_t getIndexCacheMisses() const { return indexCache.getMisses(); }
 
     /** Get the correspondences of the last interframe calculation 
      * @return - a vector of an std::pair, where first is an index to frame1 and
@@ -94,6 +134,14 @@ public:
      */
     base::Affine3d getInterFrameCorrespondenceTransform() { return correspondenceTransform; }
 
+    /** Set the expected motion for the next interframe correspondence
+     * calculation, in the same convention as the transform returned by
+     * getInterFrameCorrespondenceTransform(), e.g. from odometry. Only used if
+     * predictedInterFrameSearch is set in the configuration. Without it, the
+     * transform of the last calculation is used.
+     */
+    void setInterFrameMotionPrior( const base::Affine3d& transform ) { motionPrior = transform; hasMotionPrior = true; }
+
     /** get the debug image for a stereo pair, if debugImage has been 
      * activated in the configuration.
      *
@@ -107,39 +155,115 @@ public:
     cv::Mat getInterFrameDebugImage( const cv::Mat& debug1, const StereoFeatureArray& frame1, const cv::Mat& debug2, const StereoFeatureArray& frame2 , std::vector<std::pair<long,long> > *correspondence = NULL);
 
 public:
-    // use threading parameter: 0 for no threads, 1 for 2 threads (one per image), 2 for 8 threads (4 per image).
+    // use threading parameter: 0 for no threads, 1 for 2 tasks (one per image), 2 for one task per image
+    // and one per tile of the image (see FeatureConfiguration::tilesX/tilesY), which are run on the thread pool.
     void findFeatures( const cv::Mat &left_image, const cv::Mat &right_image, int use_threading = 1, int crop_left = 0, int crop_right = 0); 
     bool getPutativeStereoCorrespondences();
     bool refineFeatureCorrespondences();
     void calculateDepthInformationBetweenCorrespondences(StereoFeatureArray *stereo_features = NULL);
+    /** create the stereo features from the left features only, with the
+     * depth taken from the left distance image. Features without a valid
+     * distance are dropped. */
+    void calculateDepthInformationFromDistanceImage(StereoFeatureArray *stereo_features = NULL);
 
     void crossCheckMatching( const cv::Mat& descriptors1, const cv::Mat& descriptors2, 
 	    std::vector<cv::DMatch>& filteredMatches12, int knn = 1, float distanceFactor = 2.0 );
+    /** cross check matching with the cached descriptor indices of the frames
+     * with the given times. Without the times, or when the descriptors are
+     * matched exhaustively, this is the same as the overload without times.
+     */
+    void crossCheckMatching( const cv::Mat& descriptors1, const base::Time& time1, 
+	    const cv::Mat& descriptors2, const base::Time& time2,
+	    std::vector<cv::DMatch>& filteredMatches12, int knn = 1, float distanceFactor = 2.0 );
 
     cv::Mat getHomography() { return homography;}
 
 protected:
+    ThreadPool& getThreadPool();
     void initDetector( size_t lastNumFeatures );
     void findFeatures2( const cv::Mat &image, FeatureInfo& info, bool left_frame = true, int crop_left = 0, int crop_right = 0 );
     void findFeatures_threading( const cv::Mat &image, FeatureInfo& info, bool left_frame = true, int crop_left = 0, int crop_right = 0);
+    void detectFeaturesInTile( const cv::Mat &image, const cv::Rect &region, const cv::Rect &core, FeatureInfo& info, bool left_frame );
+    void describeFeaturesInTile( const cv::Mat &image, const cv::Rect &region, const cv::Rect &core, FeatureInfo& info );
+
+    /** reduce the keypoints to the strongest ones per grid cell of the region */
+    void selectBucketedFeatures( std::vector<cv::KeyPoint> &keypoints, const cv::Rect &region ) const;
+
+    /** true if the stereo matching is guided by the left distance image */
+    bool useDenseGuidance() const;
+    void setupEpipolarMatcher();
+    /** the distance at a subpixel position of the left distance image,
+     * interpolated bilinearly. Fails if one of the neighbouring pixels is
+     * invalid, or if they differ by more than config.maxDistanceJump. */
+    bool getDistance( const cv::Point2f &pt, float &distance ) const;
+    /** disparity of each keypoint from the left distance image, or NaN if
+     * there is no valid distance at its position */
+    void predictDisparities( const std::vector<cv::KeyPoint> &keypoints, std::vector<float> &disparities ) const;
+    /** track the points from the previous image into the image with
+     * pyramidal Lucas-Kanade. The status is cleared for the points which
+     * are lost, or which fail the forward-backward check of
+     * config.maxTrackingError. */
+    void trackPoints( const cv::Mat &prevImage, const cv::Mat &image, 
+	    const std::vector<cv::Point2f> &prev, std::vector<cv::Point2f> &next, std::vector<uchar> &status ) const;
+    /** track the features of the last frame pair into the given images,
+     * and set the detection masks to the cells with too few tracks */
+    void trackFeatures( const cv::Mat &leftImage, const cv::Mat &rightImage );
+    /** assign ids to the new stereo matches, and add the tracked features
+     * to the features and stereo matches of the current pair */
+    void mergeTrackedFeatures();
+    /** keep the stereo matches of the current pair as tracks for the next */
+    void updateTracks( const cv::Mat &leftImage, const cv::Mat &rightImage );
 
-    void crossCheckMatching( std::vector<std::vector<cv::DMatch> > matches12, std::vector<std::vector<cv::DMatch> > matches21, std::vector<cv::DMatch>& filteredMatches12, int knn = 1, float distanceFactor = 2.0);
+    /** add the left feature with the given disparity (left x - right x) to
+     * the features, with its 3d point projected by Q */
+    void addStereoFeature( StereoFeatureArray &features, const Eigen::Matrix4d &Q, int leftIdx, double disparity );
+
+    /** match the features of frame1 only to the features of frame2 around
+     * their position predicted with the motion prior.
+     * @result false if there is no prior, in which case nothing is matched
+     */
+    bool predictedMatching( const cv::Mat& feat1, const std::vector<Eigen::Vector3d>& points1,
+	    const cv::Mat& feat2, const std::vector<cv::KeyPoint>& keyp2, std::vector<cv::DMatch>& matches );
+
+    bool useBruteForceMatching( const cv::Mat& descriptors1, const cv::Mat& descriptors2 ) const;
+    void crossCheckMatching( const std::vector<std::vector<cv::DMatch> >& matches12, const std::vector<std::vector<cv::DMatch> >& matches21, std::vector<cv::DMatch>& filteredMatches12, int knn = 1, float distanceFactor = 2.0);
+    void crossCheckMatching( const KnnMatches& matches12, const KnnMatches& matches21, std::vector<cv::DMatch>& filteredMatches12, int knn = 1, float distanceFactor = 2.0);
 
     frame_helper::StereoCalibrationCv calib;
     FeatureConfiguration config;
     DetectorConfiguration detectorParams;
 
     FeatureInfo leftFeatures, rightFeatures;
-    FeatureInfo leftPutativeMatches, rightPutativeMatches;
-    FeatureInfo leftMatches, rightMatches;
+    /// stereo correspondences as indices into leftFeatures (queryIdx) and
+    /// rightFeatures (trainIdx), before and after the refinement
+    std::vector<cv::DMatch> putativeMatches;
+    std::vector<cv::DMatch> stereoMatches;
+    /// disparities of the left features predicted by the dense stereo
+    std::vector<float> predictedDisparities;
+
+    /// state of the tracking mode: the images of the last pair, and the
+    /// tracked features, where the i-th left and right feature form a pair
+    cv::Mat trackingLeftImage, trackingRightImage;
+    FeatureInfo trackedLeft, trackedRight;
+    int nextTrackId;
+    /// if not empty, features are only detected where the mask is set
+    cv::Mat leftDetectionMask, rightDetectionMask;
 
     StereoFeatureArray stereoFeatures;
     std::vector<std::pair<long,long> > correspondences;
     base::Affine3d correspondenceTransform;
+    base::Affine3d motionPrior;
+    bool hasMotionPrior;
 
     cv::Ptr<cv::FeatureDetector> detector;
     cv::Ptr<cv::DescriptorExtractor> descriptorExtractor;
     cv::Ptr<cv::DescriptorMatcher> descriptorMatcher;
+    EpipolarMatcher epipolarMatcher;
+    WindowMatcher windowMatcher;
+    BruteForceMatcher bruteForceMatcher;
+    /// match buffers, which are reused for every frame
+    KnnMatches knnMatches12, knnMatches21;
+    DescriptorIndexCache indexCache;
  
     cv::Mat homography;
 
@@ -149,6 +273,7 @@ protected:
     bool use_gpu_detector;
     cv::gpu::GpuMat descriptors_gpu_left;
     cv::gpu::GpuMat descriptors_gpu_right;
+    std::shared_ptr<ThreadPool> threadPool;
 };
 
 }
@@ -31,12 +31,34 @@ enum FILTER
     FILTER_ISOMETRY,
 };
 
+enum STEREO_MATCHER
+{
+    STEREO_MATCHER_FLANN,
+    STEREO_MATCHER_EPIPOLAR,
+    STEREO_MATCHER_DENSE_GUIDED,
+};
+
+enum RANSAC_SAMPLER
+{
+    RANSAC_SAMPLER_UNIFORM,
+    RANSAC_SAMPLER_PROSAC,
+};
+
 enum DESCRIPTOR
 {
     DESCRIPTOR_SURF = 1,
     DESCRIPTOR_PSURF = 2,
+    DESCRIPTOR_ORB = 3,
+    DESCRIPTOR_BRIEF = 4,
 };
 
+/** @result true for descriptors with a binary representation (CV_8U),
+ * which are matched with the hamming distance */
+inline bool isBinaryDescriptor( DESCRIPTOR type )
+{
+    return type == DESCRIPTOR_ORB || type == DESCRIPTOR_BRIEF;
+}
+
 
 struct DetectorConfiguration
 {
@@ -65,7 +87,33 @@ struct FeatureConfiguration
       distanceFactor( 2.0 ),
       isometryFilterMaxSteps( 1000 ),
       isometryFilterThreshold( 0.1 ),
+      isometryFilterThreads( 1 ),
+      isometryFilterSeed( 0 ),
+      isometryFilterSampler( RANSAC_SAMPLER_UNIFORM ),
+      isometryFilterSprt( false ),
       adaptiveDetectorParam( false ),
+      tilesX( 2 ),
+      tilesY( 2 ),
+      tileOverlap( 50 ),
+      gridBucketing( false ),
+      bucketsX( 8 ),
+      bucketsY( 6 ),
+      minStereoDisparity( 0 ),
+      maxStereoDisparity( 0 ),
+      stereoMatcher( STEREO_MATCHER_FLANN ),
+      denseGuidedSearchRadius( 4 ),
+      leftOnly( false ),
+      maxDistanceJump( 0.1 ),
+      tracking( false ),
+      minTracksPerCell( 2 ),
+      trackingWindowSize( 21 ),
+      trackingPyramidLevels( 3 ),
+      maxTrackingError( 1.0 ),
+      predictedInterFrameSearch( false ),
+      interFrameSearchRadius( 30 ),
+      minInterFrameInliers( 10 ),
+      multiIndexHashing( false ),
+      bruteForceMatchLimit( 250000 ),
       descriptorType( DESCRIPTOR_SURF ),
       detectorType( DETECTOR_SURF ),
       filterType( FILTER_STEREO )
@@ -88,7 +136,9 @@ struct FeatureConfiguration
     /** number of neares neighbours to check for feature correspondence.  a
      * value of 1 will just check the next neighbour. A value of 2 will check
      * the two nearest neighbours and apply the distanceFactor criterion for
-     * filtering correspondences.
+     * filtering correspondences. Features without a second neighbour are
+     * then rejected, also by the matchers which only compare a window of
+     * candidates.
      */
     int knn;
 
@@ -109,9 +159,161 @@ struct FeatureConfiguration
      */
     double isometryFilterThreshold;
 
+    /** number of threads of the ransac of the isometry filter. With more
+     * than one thread, the hypotheses are generated and scored in parallel
+     * on the thread pool, each thread with its own random number stream.
+     * The result only depends on isometryFilterSeed and the number of
+     * threads.
+     */
+    int isometryFilterThreads;
+    unsigned int isometryFilterSeed;
+
+    /** sampling of the hypotheses of the isometry filter. With
+     * RANSAC_SAMPLER_PROSAC, the samples are first drawn from the
+     * correspondences with the lowest descriptor distance. 
+     */
+    RANSAC_SAMPLER isometryFilterSampler;
+
+    /** if set to true, the hypotheses of the isometry filter are evaluated
+     * with a sequential probability ratio test, which rejects bad
+     * hypotheses after a few samples. 
+     *
+     * The sampler and the sprt are only used by the single threaded ransac,
+     * so isometryFilterThreads should be 1.
+     */
+    bool isometryFilterSprt;
+
     bool adaptiveDetectorParam;
     DetectorConfiguration detectorConfig;
 
+    /** number of tiles in x and y direction, in which the images are split
+     * for the tiled feature detection (threading mode 2 of findFeatures).
+     * Each tile is processed as a separate task.
+     */
+    int tilesX, tilesY;
+
+    /** overlap in pixels between neighbouring tiles. Each tile is processed
+     * with this border around it, but only keeps the keypoints in its own
+     * region, so there are no duplicates. Should be at least the support
+     * radius of the detector and descriptor.
+     */
+    int tileOverlap;
+
+    /** if set to true, the detector is created once with the parameters of
+     * the DetectorConfiguration, which should be permissive, and only the
+     * targetNumFeatures / (bucketsX * bucketsY) strongest keypoints of each
+     * grid cell are kept, before the descriptors are computed. This saves
+     * the descriptor computation for the dropped keypoints, but not the
+     * detection. Replaces adaptiveDetectorParam.
+     */
+    bool gridBucketing;
+
+    /** number of grid cells in x and y direction for the gridBucketing
+     */
+    int bucketsX, bucketsY;
+
+    /** disparity interval for the stereo matches. Only used by the
+     * STEREO_MATCHER_EPIPOLAR and STEREO_MATCHER_DENSE_GUIDED, which only
+     * consider matches with a disparity larger than minStereoDisparity and
+     * not larger than maxStereoDisparity. A maxStereoDisparity of 0 does not
+     * limit the disparity.
+     */
+    float minStereoDisparity, maxStereoDisparity;
+
+    /** matcher for the stereo correspondences. STEREO_MATCHER_FLANN matches
+     * all left against all right features, STEREO_MATCHER_EPIPOLAR only
+     * compares features within maxStereoYDeviation rows and the disparity
+     * interval, which assumes rectified images. STEREO_MATCHER_DENSE_GUIDED
+     * works like STEREO_MATCHER_EPIPOLAR, but uses the left distance image
+     * given with setDistanceImages, e.g. from the DenseStereo of the same
+     * pair, to predict the position of each left feature in the right image.
+     * Descriptors are only computed for the right features close to a
+     * prediction. Where the distance image has no valid value, the whole
+     * epipolar band is searched.
+     */
+    STEREO_MATCHER stereoMatcher;
+
+    /** distance in pixels along the epipolar line from the predicted
+     * position, within which a right feature is considered as a match for
+     * STEREO_MATCHER_DENSE_GUIDED.
+     */
+    float denseGuidedSearchRadius;
+
+    /** if set to true, processFramePair only detects and describes the
+     * features of the left image, and takes their depth from the left
+     * distance image given with setDistanceImages. There is no right
+     * feature detection and no stereo matching. The resulting
+     * StereoFeatureArray is the same as in the stereo mode.
+     */
+    bool leftOnly;
+
+    /** maximum relative difference between the neighbouring pixels of the
+     * distance image, for which the distance is interpolated. Features on
+     * larger depth discontinuities get no depth from the distance image.
+     */
+    float maxDistanceJump;
+
+    /** if set to true, the stereo features of the last frame pair are
+     * tracked into the current pair with pyramidal Lucas-Kanade, on the left
+     * and right image. Tracks which violate the epipolar constraint or
+     * maxTrackingError are dropped. The detector only runs in the cells of
+     * the bucketsX x bucketsY grid which contain less than minTracksPerCell
+     * tracks, and descriptors are only computed for the new features. Each
+     * stereo feature keeps its id in the class_id of its keypoint while it
+     * is tracked, without tracking the class_id is -1. Not used in the
+     * leftOnly mode.
+     */
+    bool tracking;
+
+    /** number of tracks per grid cell, below which new features are
+     * detected in the cell
+     */
+    int minTracksPerCell;
+
+    /** size in pixels of the search window on each pyramid level, and the
+     * number of pyramid levels of the tracking
+     */
+    int trackingWindowSize, trackingPyramidLevels;
+
+    /** maximum distance in pixels between the start of a track and the
+     * position it is tracked back to from the current pair. Tracks which
+     * fail this forward-backward check have drifted, e.g. because they got
+     * occluded. A value of 0 disables the check, which halves the cost of
+     * the tracking.
+     */
+    float maxTrackingError;
+
+    /** if set to true, calculateInterFrameCorrespondences transforms the 3d
+     * points of frame1 with the expected motion, which is the transform of
+     * the last call or the one given with setInterFrameMotionPrior, and
+     * projects them into frame2. A feature is then only matched to the
+     * features of frame2 within interFrameSearchRadius pixels of its
+     * predicted position. If less than minInterFrameInliers correspondences
+     * are left after the filtering, the matching is repeated with all
+     * features.
+     */
+    bool predictedInterFrameSearch;
+    float interFrameSearchRadius;
+    int minInterFrameInliers;
+
+    /** only used for binary descriptors. If set to true, the hamming matcher
+     * uses a multi-index hash table instead of brute force, which pays off
+     * for large numbers of features.
+     */
+    bool multiIndexHashing;
+
+    /** descriptors are matched exhaustively with the BruteForceMatcher
+     * instead of with the descriptor matcher (FLANN, or the hamming matcher
+     * for binary descriptors), if the number of descriptor pairs (features1
+     * * features2) is not larger than this limit. For small sets this can be
+     * faster than building the indices, benchmark_matching compares both on
+     * the target machine. The default of 250000 (500 x 500 features) stays
+     * below the set sizes for which the indices, the multi-index hashing
+     * and the descriptor index cache pay off. A limit of 0 always uses the
+     * descriptor matcher, as does multiIndexHashing for binary descriptors.
+     */
+    int bruteForceMatchLimit;
+
     DESCRIPTOR descriptorType;
     DETECTOR detectorType;
     FILTER filterType;
@@ -125,17 +327,28 @@ public:
     typedef float Scalar;
     typedef Eigen::Matrix<Scalar, Eigen::Dynamic, 1, Eigen::DontAlign> Descriptor;
 
+    /** number of elements of a descriptor, floats for descriptors and
+     * bytes for binaryDescriptors
+     */
     int descriptorSize;
     DESCRIPTOR descriptorType;
 
     std::vector<base::Vector3d> points;
     std::vector<cv::KeyPoint> keypoints;
+    /** descriptors of non-binary descriptor types */
     std::vector<Scalar> descriptors;
+    /** descriptors of binary descriptor types, see isBinaryDescriptor() */
+    std::vector<uint8_t> binaryDescriptors;
     std::vector<int> source_frame;
 
     double mean_z_value;
 
-    StereoFeatureArray() : descriptorSize(0) {}
+    StereoFeatureArray() : descriptorSize(0), descriptorType(DESCRIPTOR_SURF) {}
+
+    bool isBinary() const
+    {
+	return isBinaryDescriptor( descriptorType );
+    }
 
     void push_back( const base::Vector3d& point, const cv::KeyPoint& keypoint, const Descriptor& descriptor, int _source_frame = -1 ) 
     {
@@ -149,7 +362,32 @@ public:
 
 	// try to have some efficiency in copying the descriptor data
 	descriptors.resize( descriptors.size() + descriptorSize );
-	memcpy( &descriptors[0] + descriptors.size() - descriptorSize, descriptor.data(), descriptorSize ); 
+	memcpy( &descriptors[0] + descriptors.size() - descriptorSize, descriptor.data(), descriptorSize * sizeof(Scalar) ); 
+
+        source_frame.push_back(_source_frame);
+    }
+
+    /** add a feature with a descriptor given as a single row matrix, which
+     * is CV_32F for non-binary and CV_8U for binary descriptor types
+     */
+    void push_back( const base::Vector3d& point, const cv::KeyPoint& keypoint, const cv::Mat& descriptor, int _source_frame = -1 ) 
+    {
+	if( !isBinary() )
+	{
+	    push_back( point, keypoint, Eigen::Map<const Descriptor>( descriptor.ptr<Scalar>(), descriptor.cols ), _source_frame );
+	    return;
+	}
+
+	points.push_back( point );
+	keypoints.push_back( keypoint );
+
+	if( descriptorSize == 0 )
+	    descriptorSize = descriptor.cols;
+
+	assert( descriptor.type() == CV_8U && descriptorSize == descriptor.cols );
+
+	const uint8_t *data = descriptor.ptr<uint8_t>();
+	binaryDescriptors.insert( binaryDescriptors.end(), data, data + descriptorSize );
 
         source_frame.push_back(_source_frame);
     }
@@ -164,6 +402,22 @@ public:
 	return Eigen::Map<const Descriptor>( &descriptors[index*descriptorSize], descriptorSize ); 
     }
 
+    const uint8_t* getBinaryDescriptor( size_t index ) const
+    {
+	return &binaryDescriptors[index*descriptorSize];
+    }
+
+    /** @result all descriptors as a matrix with one row per feature, which
+     * references the data of this array
+     */
+    cv::Mat getDescriptors() const
+    {
+	// need to const cast here, as opencv doesn't provide a way to supply a const void *
+	if( isBinary() )
+	    return cv::Mat( size(), descriptorSize, CV_8U, const_cast<uint8_t*>( binaryDescriptors.empty() ? NULL : &binaryDescriptors[0] ) );
+	return cv::Mat( size(), descriptorSize, cv::DataType<Scalar>::type, const_cast<Scalar*>( descriptors.empty() ? NULL : &descriptors[0] ) );
+    }
+
     size_t size() const 
     { 
 	return keypoints.size(); 
@@ -174,6 +428,7 @@ public:
 	descriptorSize = 0;
 	points.clear(); 
 	descriptors.clear(); 
+	binaryDescriptors.clear(); 
 	keypoints.clear(); 
         source_frame.clear();
     }
@@ -195,6 +450,7 @@ public:
      {
        target.descriptors.push_back(descriptors[i]);
      }
+     target.binaryDescriptors.insert(target.binaryDescriptors.end(), binaryDescriptors.begin(), binaryDescriptors.end());
      for(size_t i = 0; i < source_frame.size(); ++i)
      {
        target.source_frame.push_back(source_frame[i]);
@@ -209,7 +465,8 @@ public:
             target.points.size() == points.size() &&
             target.keypoints.size() == keypoints.size() &&
             target.source_frame.size() == source_frame.size() &&
-            target.descriptors.size() == descriptors.size(); 
+            target.descriptors.size() == descriptors.size() &&
+            target.binaryDescriptors.size() == binaryDescriptors.size(); 
    }
 
 
@@ -229,6 +486,13 @@ public:
      os << "\n";
      StorePODVector(source_frame, os);
      os << "\n";
+     // only written for binary descriptors, so files with float
+     // descriptors keep their format
+     if(isBinary())
+     {
+       StoreByteVector(binaryDescriptors, os);
+       os << "\n";
+     }
    }
 
    void load(std::istream& is)
@@ -259,6 +523,11 @@ public:
      is.ignore(10, '\n');
      LoadPODVector(source_frame, is); 
      is.ignore(10, '\n');
+     if(isBinary())
+     {
+       LoadByteVector(binaryDescriptors, is);
+       is.ignore(10, '\n');
+     }
    }
 };
 }
@@ -2,6 +2,7 @@
 #define __STORE_VECTOR_HPP__ 
 
 #include <opencv2/opencv.hpp>
+#include <stdint.h>
 
 /******
 simple templace functions for storing/loading stereo vectors. supports the class version as well as the POD version and stream version of target template storage, e.g. if target template is a basic type, use POD, if target template is a class which has the storeKeyPoint and loadKeyPoint functions implemented use class
@@ -91,6 +92,25 @@ void LoadPODVector(std::vector<T>& Tvector, std::istream& is)
   }
 };  
 
+/** store a vector of bytes, e.g. binary descriptors, as raw data, which
+ * would not survive the formatted stream operators */
+inline void StoreByteVector(const std::vector<uint8_t>& Tvector, std::ostream& os)
+{
+  std::vector<uint8_t>::size_type size(Tvector.size());
+  os.write(reinterpret_cast<const char*>(&size), sizeof(std::vector<uint8_t>::size_type));
+  if(size)
+    os.write(reinterpret_cast<const char*>(&Tvector[0]), size);
+};
+
+inline void LoadByteVector(std::vector<uint8_t>& Tvector, std::istream& is)
+{
+  std::vector<uint8_t>::size_type to_load_size(0);
+  is.read(reinterpret_cast<char*>(&to_load_size), sizeof(std::vector<uint8_t>::size_type));
+  Tvector.resize(to_load_size);
+  if(to_load_size)
+    is.read(reinterpret_cast<char*>(&Tvector[0]), to_load_size);
+};
+
 template<typename T>
 void StoreEigenMatrix3d(const T &matrix, std::ostream& os)
 {
@@ -0,0 +1,188 @@
+#include "thread_pool.hpp"
+#include <chrono>
+
+using namespace stereo;
+
+namespace
+{
+    // the pool and queue index of the worker running in this thread
+    thread_local const ThreadPool *currentPool = NULL;
+    thread_local size_t currentIndex = 0;
+}
+
+ThreadPool::ThreadPool( size_t numThreads )
+    : nextQueue( 0 ), pending( 0 ), stopping( false )
+{
+    if( numThreads == 0 )
+	numThreads = std::max( 1u, std::thread::hardware_concurrency() );
+
+    for( size_t i = 0; i < numThreads; i++ )
+	queues.push_back( new Queue );
+    for( size_t i = 0; i < numThreads; i++ )
+	workers.push_back( std::thread( &ThreadPool::run, this, i ) );
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+	std::lock_guard<std::mutex> lock( sleepMutex );
+	stopping = true;
+    }
+    sleep.notify_all();
+
+    for( size_t i = 0; i < workers.size(); i++ )
+	workers[i].join();
+    for( size_t i = 0; i < queues.size(); i++ )
+	delete queues[i];
+}
+
+std::shared_ptr<ThreadPool> ThreadPool::getDefault()
+{
+    static std::shared_ptr<ThreadPool> pool( new ThreadPool() );
+    return pool;
+}
+
+void ThreadPool::submit( const Task& task )
+{
+    // workers keep their own tasks local, everyone else distributes them
+    const size_t index = currentPool == this ?
+	currentIndex : nextQueue++ % queues.size();
+
+    // count the task before it can be taken, so that takeTask never
+    // decrements the counter below zero. A worker which is woken up before
+    // the task is in the queue retries until it finds it.
+    {
+	std::lock_guard<std::mutex> lock( sleepMutex );
+	pending++;
+    }
+
+    {
+	std::lock_guard<std::mutex> lock( queues[index]->mutex );
+	queues[index]->tasks.push_back( task );
+    }
+    sleep.notify_one();
+}
+
+bool ThreadPool::takeTask( Task& task )
+{
+    const bool isWorker = currentPool == this;
+    const size_t self = isWorker ? currentIndex : 0;
+    const size_t n = queues.size();
+
+    for( size_t i = 0; i < n; i++ )
+    {
+	Queue &queue( *queues[( self + i ) % n] );
+	std::lock_guard<std::mutex> lock( queue.mutex );
+	if( queue.tasks.empty() )
+	    continue;
+
+	// newest task from the own queue, oldest task when stealing
+	if( isWorker && i == 0 )
+	{
+	    task = queue.tasks.back();
+	    queue.tasks.pop_back();
+	}
+	else
+	{
+	    task = queue.tasks.front();
+	    queue.tasks.pop_front();
+	}
+	pending--;
+	return true;
+    }
+    return false;
+}
+
+void ThreadPool::run( size_t index )
+{
+    currentPool = this;
+    currentIndex = index;
+
+    Task task;
+    while( true )
+    {
+	if( takeTask( task ) )
+	{
+	    task();
+	    task = Task();
+	    continue;
+	}
+
+	std::unique_lock<std::mutex> lock( sleepMutex );
+	while( pending == 0 && !stopping )
+	    sleep.wait( lock );
+	if( pending == 0 && stopping )
+	    return;
+    }
+}
+
+TaskGroup::TaskGroup( ThreadPool& pool )
+    : pool( pool ), remaining( 0 )
+{
+}
+
+TaskGroup::~TaskGroup()
+{
+    try
+    {
+	wait();
+    }
+    catch( ... )
+    {
+    }
+}
+
+void TaskGroup::run( const ThreadPool::Task& task )
+{
+    remaining++;
+    pool.submit( [this, task]() {
+	std::exception_ptr error;
+	try
+	{
+	    task();
+	}
+	catch( ... )
+	{
+	    error = std::current_exception();
+	}
+	finished( error );
+    } );
+}
+
+void TaskGroup::finished( std::exception_ptr taskError )
+{
+    std::lock_guard<std::mutex> lock( mutex );
+    if( taskError && !error )
+	error = taskError;
+    if( --remaining == 0 )
+	done.notify_all();
+}
+
+void TaskGroup::wait()
+{
+    while( remaining > 0 )
+    {
+	// help with the pending tasks instead of blocking
+	ThreadPool::Task task;
+	if( pool.takeTask( task ) )
+	{
+	    task();
+	    continue;
+	}
+
+	std::unique_lock<std::mutex> lock( mutex );
+	if( remaining > 0 )
+	    done.wait_for( lock, std::chrono::milliseconds( 1 ) );
+    }
+
+    // synchronize with the last finished() call, which still holds the lock
+    // after the counter reached zero
+    std::exception_ptr taskError;
+    {
+	std::lock_guard<std::mutex> lock( mutex );
+	taskError = error;
+	error = std::exception_ptr();
+    }
+    if( taskError )
+	std::rethrow_exception( taskError );
+}
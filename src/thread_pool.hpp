@@ -0,0 +1,118 @@
+#ifndef __STEREO_THREAD_POOL_HPP__
+#define __STEREO_THREAD_POOL_HPP__
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace stereo
+{
+
+/**
+ * Persistent pool of worker threads with work-stealing task queues.
+ *
+ * Every worker has its own task queue. Tasks submitted from a worker go to
+ * its own queue and are processed LIFO, tasks submitted from other threads
+ * are distributed round robin. Idle workers steal the oldest tasks from the
+ * queues of the other workers.
+ *
+ * Tasks are submitted and waited for through a TaskGroup. Waiting on a group
+ * processes pending tasks in the waiting thread, so tasks can wait for
+ * their own sub-tasks without blocking a worker.
+ *
+ * A pool can be shared by several users, e.g. the StereoFeatures instances of
+ * multiple cameras, so that they don't oversubscribe the cores of a host.
+ */
+class ThreadPool
+{
+public:
+    typedef std::function<void ()> Task;
+
+    /** @param numThreads - number of worker threads. 0 uses the number of
+     *                      hardware threads.
+     */
+    explicit ThreadPool( size_t numThreads = 0 );
+
+    /** waits for all queued tasks to finish and stops the workers */
+    ~ThreadPool();
+
+    /** @result the number of worker threads */
+    size_t size() const { return workers.size(); }
+
+    /** @result a process wide pool with one thread per hardware thread,
+     *          which is created on first use
+     */
+    static std::shared_ptr<ThreadPool> getDefault();
+
+private:
+    friend class TaskGroup;
+
+    struct Queue
+    {
+	std::mutex mutex;
+	std::deque<Task> tasks;
+    };
+
+    ThreadPool( const ThreadPool& );
+    ThreadPool& operator=( const ThreadPool& );
+
+    void submit( const Task& task );
+
+    /** take a task from the own queue of the calling worker, or steal one
+     * from the other queues */
+    bool takeTask( Task& task );
+
+    void run( size_t index );
+
+    std::vector<std::thread> workers;
+    std::vector<Queue*> queues;
+
+    std::atomic<size_t> nextQueue;
+    std::atomic<size_t> pending;
+    bool stopping;
+
+    std::mutex sleepMutex;
+    std::condition_variable sleep;
+};
+
+/**
+ * A set of tasks which is submitted to a ThreadPool and can be waited for.
+ * The destructor waits for all tasks of the group.
+ */
+class TaskGroup
+{
+public:
+    explicit TaskGroup( ThreadPool& pool );
+    ~TaskGroup();
+
+    /** submit a task to the pool as part of this group */
+    void run( const ThreadPool::Task& task );
+
+    /** wait for all tasks of this group, while processing pending tasks of
+     * the pool in the calling thread. Rethrows the first exception thrown by
+     * one of the tasks.
+     */
+    void wait();
+
+private:
+    TaskGroup( const TaskGroup& );
+    TaskGroup& operator=( const TaskGroup& );
+
+    void finished( std::exception_ptr error );
+
+    ThreadPool &pool;
+    std::atomic<size_t> remaining;
+    std::exception_ptr error;
+    std::mutex mutex;
+    std::condition_variable done;
+};
+
+}
+
+#endif
@@ -0,0 +1,107 @@
+#include "window_matcher.hpp"
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+using namespace stereo;
+
+WindowMatcher::WindowMatcher()
+    : radius( 30 ), gridCols( 0 ), gridRows( 0 )
+{
+}
+
+void WindowMatcher::setRadius( float radius )
+{
+    this->radius = radius;
+}
+
+void WindowMatcher::buildGrid( const std::vector<cv::KeyPoint>& keypoints )
+{
+    float minX = keypoints[0].pt.x, minY = keypoints[0].pt.y, maxX = minX, maxY = minY;
+    for( size_t i = 1; i < keypoints.size(); i++ )
+    {
+	minX = std::min( minX, keypoints[i].pt.x );
+	maxX = std::max( maxX, keypoints[i].pt.x );
+	minY = std::min( minY, keypoints[i].pt.y );
+	maxY = std::max( maxY, keypoints[i].pt.y );
+    }
+    gridOrigin = cv::Point2f( minX, minY );
+    gridCols = (int)( (maxX - minX) / radius ) + 1;
+    gridRows = (int)( (maxY - minY) / radius ) + 1;
+
+    // counting sort of the keypoints into the cells
+    std::vector<int> cells( keypoints.size() );
+    cellStart.assign( gridCols * gridRows + 1, 0 );
+    for( size_t i = 0; i < keypoints.size(); i++ )
+    {
+	const int cx = (int)( (keypoints[i].pt.x - minX) / radius );
+	const int cy = (int)( (keypoints[i].pt.y - minY) / radius );
+	cells[i] = cy * gridCols + cx;
+	cellStart[cells[i] + 1]++;
+    }
+    for( size_t c = 1; c < cellStart.size(); c++ )
+	cellStart[c] += cellStart[c - 1];
+
+    cellIndices.resize( keypoints.size() );
+    std::vector<int> fill( cellStart.begin(), cellStart.end() - 1 );
+    for( size_t i = 0; i < keypoints.size(); i++ )
+	cellIndices[fill[cells[i]]++] = i;
+}
+
+void WindowMatcher::match( const std::vector<cv::Point2f>& predicted, const cv::Mat& queryDescriptors,
+	const std::vector<cv::KeyPoint>& trainKeypoints, const cv::Mat& trainDescriptors,
+	std::vector<cv::DMatch>& matches, int knn, float distanceFactor )
+{
+    matches.clear();
+    if( queryDescriptors.rows != (int)predicted.size() || trainDescriptors.rows != (int)trainKeypoints.size() )
+	throw std::runtime_error( "WindowMatcher: number of positions and descriptors differ" );
+    if( queryDescriptors.empty() || trainDescriptors.empty() )
+	return;
+    if( queryDescriptors.type() != trainDescriptors.type() || queryDescriptors.cols != trainDescriptors.cols )
+	throw std::runtime_error( "WindowMatcher: query and train descriptors are not compatible" );
+    if( !( radius > 0 ) )
+	throw std::runtime_error( "WindowMatcher: the radius needs to be positive" );
+
+    buildGrid( trainKeypoints );
+
+    queryBest.assign( predicted.size(), BestCandidates() );
+    trainBest.assign( trainKeypoints.size(), BestCandidates() );
+
+    const float radius2 = radius * radius;
+    for( size_t i = 0; i < predicted.size(); i++ )
+    {
+	const cv::Point2f &p( predicted[i] );
+	if( std::isnan( p.x ) || std::isnan( p.y ) )
+	    continue;
+
+	// the cells are as large as the radius, so the candidates are in the
+	// neighbouring cells of the prediction
+	const float gx = std::floor( (p.x - gridOrigin.x) / radius );
+	const float gy = std::floor( (p.y - gridOrigin.y) / radius );
+	if( gx < -1 || gy < -1 || gx > gridCols || gy > gridRows )
+	    continue;
+	const int x0 = std::max( 0, (int)gx - 1 ), x1 = std::min( gridCols - 1, (int)gx + 1 );
+	const int y0 = std::max( 0, (int)gy - 1 ), y1 = std::min( gridRows - 1, (int)gy + 1 );
+
+	for( int cy = y0; cy <= y1; cy++ )
+	{
+	    for( int cx = x0; cx <= x1; cx++ )
+	    {
+		const int cell = cy * gridCols + cx;
+		for( int k = cellStart[cell]; k < cellStart[cell + 1]; k++ )
+		{
+		    const int j = cellIndices[k];
+		    const cv::Point2f d = trainKeypoints[j].pt - p;
+		    if( d.x * d.x + d.y * d.y > radius2 )
+			continue;
+
+		    const float distance = descriptorDistance( queryDescriptors, i, trainDescriptors, j );
+		    queryBest[i].update( distance, j );
+		    trainBest[j].update( distance, i );
+		}
+	    }
+	}
+    }
+
+    crossCheckCandidates( queryBest, trainBest, matches, knn, distanceFactor );
+}
@@ -0,0 +1,61 @@
+#ifndef __STEREO_WINDOW_MATCHER_HPP__
+#define __STEREO_WINDOW_MATCHER_HPP__
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/features2d/features2d.hpp>
+#include <stereo/candidate_matching.hpp>
+#include <vector>
+
+namespace stereo
+{
+
+/**
+ * Descriptor matcher for features with a predicted image position.
+ *
+ * The train keypoints are sorted into a grid of square cells, which are as
+ * large as the search radius. For every query, only the train keypoints
+ * within the radius around its predicted position are compared, which are
+ * found in the 3x3 cells around the prediction.
+ *
+ * As in the EpipolarMatcher, the two best distances of every query and
+ * train keypoint are kept in a single pass, and the matches are cross
+ * checked and optionally filtered with the ratio test.
+ */
+class WindowMatcher
+{
+public:
+    WindowMatcher();
+
+    /** a train keypoint is a candidate for a query, if it is not further
+     * than radius pixels away from the predicted position of the query
+     */
+    void setRadius( float radius );
+
+    /** match the query descriptors to the train keypoints.
+     *
+     * @param predicted - predicted position of each query in the image of
+     *                    the train keypoints. Queries with a NaN position
+     *                    have no candidates.
+     * @param matches - the cross checked matches
+     */
+    void match( const std::vector<cv::Point2f>& predicted, const cv::Mat& queryDescriptors,
+	    const std::vector<cv::KeyPoint>& trainKeypoints, const cv::Mat& trainDescriptors,
+	    std::vector<cv::DMatch>& matches, int knn = 1, float distanceFactor = 2.0 );
+
+private:
+    void buildGrid( const std::vector<cv::KeyPoint>& keypoints );
+
+    float radius;
+
+    /// grid of the train keypoints, with the indices of the keypoints of
+    /// cell c in cellIndices[cellStart[c]] to cellIndices[cellStart[c+1]]
+    cv::Point2f gridOrigin;
+    int gridCols, gridRows;
+    std::vector<int> cellStart, cellIndices;
+
+    std::vector<BestCandidates> queryBest, trainBest;
+};
+
+}
+
+#endif
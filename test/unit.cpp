@@ -4,11 +4,25 @@
 #include <frame_helper/CalibrationCv.h>
 #ifdef HAS_SPARSE_STEREO
 #include <stereo/sparse_stereo.hpp>
+#include <stereo/hamming.hpp>
+#include <stereo/hamming_matcher.hpp>
+#include <stereo/brute_force_matcher.hpp>
+#include <stereo/descriptor_index_cache.hpp>
+#include <stereo/epipolar_matcher.hpp>
+#include <stereo/window_matcher.hpp>
+#include <stereo/ransac.hpp>
 #endif
 #include <stereo/densestereo.h>
 #include <stereo/homography.h>
+#include <stereo/rectification_cache.h>
+#include <stereo/dense_stereo_scheduler.h>
 
 #include <iostream>
+#include <fstream>
+#include <condition_variable>
+#include <mutex>
+#include <stdlib.h>
+#include <unistd.h>
 #include "opencv2/opencv.hpp"
 #include "opencv2/highgui/highgui.hpp"
 
@@ -215,6 +229,138 @@ BOOST_AUTO_TEST_CASE( dense_test )
     cv::imwrite( prefix_out + "rdist.png", rdisp );
 }
 
+BOOST_AUTO_TEST_CASE( dense_stereo_scheduler_test ) 
+{
+    cv::Mat left, right;
+    getTestImages( "", left, right );
+    stereo::DenseStereo dense;
+    dense.setStereoCalibration( getTestCalibration("", left.size().width, left.size().height ), left.size().width, left.size().height );
+
+    // the callback records the times of the processed pairs, and keeps the
+    // worker busy until it is released
+    std::mutex mutex;
+    std::condition_variable changed;
+    bool busy = true;
+    std::vector<base::Time> times;
+    stereo::DenseStereoScheduler scheduler( dense, 
+	    [&]( const base::samples::DistanceImage& leftDistance, const base::samples::DistanceImage& ) {
+		std::unique_lock<std::mutex> lock( mutex );
+		times.push_back( leftDistance.time );
+		changed.notify_all();
+		while( busy )
+		    changed.wait( lock );
+	    } );
+
+    const base::Time start = base::Time::now();
+    base::Time pairTimes[5];
+    for( int i = 0; i < 5; i++ )
+	pairTimes[i] = start + base::Time::fromMilliseconds( i );
+
+    // the first pair is picked up at once, while it is processed only the
+    // latest of the other pairs is kept
+    scheduler.start();
+    scheduler.push( left, right, pairTimes[0], true );
+    {
+	std::unique_lock<std::mutex> lock( mutex );
+	while( times.size() < 1 )
+	    changed.wait( lock );
+    }
+    for( int i = 1; i < 5; i++ )
+	scheduler.push( left, right, pairTimes[i], true );
+    {
+	std::unique_lock<std::mutex> lock( mutex );
+	busy = false;
+	changed.notify_all();
+	while( times.size() < 2 )
+	    changed.wait( lock );
+    }
+    scheduler.stop();
+
+    BOOST_REQUIRE_EQUAL( times.size(), 2u );
+    BOOST_CHECK( times[0] == pairTimes[0] );
+    BOOST_CHECK( times[1] == pairTimes[4] );
+    stereo::DenseStereoSchedulerStatistics stats = scheduler.getStatistics();
+    BOOST_CHECK_EQUAL( stats.pushed, 5u );
+    BOOST_CHECK_EQUAL( stats.processed, 2u );
+    BOOST_CHECK_EQUAL( stats.dropped, 3u );
+    BOOST_CHECK_EQUAL( stats.skipped, 0u );
+    BOOST_CHECK_EQUAL( stats.pushed, stats.processed + stats.dropped + stats.skipped );
+
+    // a pair older than the deadline is skipped, without a deadline it is
+    // processed
+    scheduler.resetStatistics();
+    scheduler.setDeadline( base::Time::fromMicroseconds( 5 ) );
+    scheduler.push( left, right, base::Time::now() - base::Time::fromSeconds( 1 ), true );
+    BOOST_CHECK( !scheduler.processLatest() );
+    scheduler.setDeadline( base::Time() );
+    scheduler.push( left, right, base::Time::now() - base::Time::fromSeconds( 1 ), true );
+    BOOST_CHECK( scheduler.processLatest() );
+    BOOST_CHECK( !scheduler.processLatest() );
+
+    stats = scheduler.getStatistics();
+    BOOST_CHECK_EQUAL( stats.pushed, 2u );
+    BOOST_CHECK_EQUAL( stats.processed, 1u );
+    BOOST_CHECK_EQUAL( stats.dropped, 0u );
+    BOOST_CHECK_EQUAL( stats.skipped, 1u );
+    BOOST_CHECK_EQUAL( times.size(), 3u );
+}
+
+BOOST_AUTO_TEST_CASE( rectification_cache_test ) 
+{
+    char directory[] = "/tmp/stereo_rectification_cache_XXXXXX";
+    BOOST_REQUIRE( mkdtemp( directory ) );
+    stereo::RectificationCache cache( directory );
+
+    const cv::Size size( 160, 120 );
+    frame_helper::StereoCalibration calib = getTestCalibration( "", size.width, size.height );
+    frame_helper::StereoCalibrationCv computed, loaded;
+    computed.setCalibration( calib );
+    computed.setImageSize( size );
+    loaded.setCalibration( calib );
+    loaded.setImageSize( size );
+
+    // the first call computes and stores the maps, the second loads them
+    BOOST_CHECK( !cache.initCv( computed ) );
+    BOOST_CHECK( cache.initCv( loaded ) );
+    BOOST_CHECK_EQUAL( cv::norm( computed.camLeft.map1, loaded.camLeft.map1, cv::NORM_INF ), 0 );
+    BOOST_CHECK_EQUAL( cv::norm( computed.camRight.map2, loaded.camRight.map2, cv::NORM_INF ), 0 );
+    BOOST_CHECK_EQUAL( cv::norm( computed.Q, loaded.Q, cv::NORM_INF ), 0 );
+
+    // another calibration or image size does not use the entry
+    frame_helper::StereoCalibration other( calib );
+    other.camLeft.fx += 1.0;
+    frame_helper::StereoCalibrationCv mismatch;
+    mismatch.setCalibration( other );
+    mismatch.setImageSize( size );
+    BOOST_CHECK( !cache.load( mismatch ) );
+    mismatch.setCalibration( calib );
+    mismatch.setImageSize( cv::Size( 320, 240 ) );
+    BOOST_CHECK( !cache.load( mismatch ) );
+
+    // changed map data and truncated files are rejected
+    const std::string fileName = cache.getFileName( stereo::RectificationCache::getKey( calib, size ) );
+    std::fstream file( fileName.c_str(), std::ios::in | std::ios::out | std::ios::binary );
+    file.seekg( 0, std::ios::end );
+    const std::streamoff fileSize = file.tellg();
+    file.seekg( fileSize / 2 );
+    const char byte = file.get() ^ 0x5a;
+    file.seekp( fileSize / 2 );
+    file.put( byte );
+    file.close();
+    frame_helper::StereoCalibrationCv corrupted;
+    corrupted.setCalibration( calib );
+    corrupted.setImageSize( size );
+    BOOST_CHECK( !cache.load( corrupted ) );
+
+    BOOST_CHECK( !cache.initCv( computed ) );
+    BOOST_CHECK( cache.load( loaded ) );
+    BOOST_REQUIRE_EQUAL( truncate( fileName.c_str(), fileSize - 1 ), 0 );
+    BOOST_CHECK( !cache.load( loaded ) );
+
+    unlink( fileName.c_str() );
+    rmdir( directory );
+}
+
 void testHomography( const base::samples::DistanceImage& dimage, cv::Mat& image )
 {
     // pick some test points in the image, calculate the homography and
@@ -331,3 +477,593 @@ BOOST_AUTO_TEST_CASE( psurf_test )
     cv::imwrite( prefix_out + "sparse-surf.png", sparse.getDebugImage() );
 }
 #endif
+
+#ifdef HAS_SPARSE_STEREO
+BOOST_AUTO_TEST_CASE( hamming_matcher_test ) 
+{
+    // random binary descriptors of the size of ORB
+    cv::RNG rng( 42 );
+    cv::Mat query( 200, 32, CV_8U ), train( 2000, 32, CV_8U );
+    rng.fill( query, cv::RNG::UNIFORM, 0, 256 );
+    rng.fill( train, cv::RNG::UNIFORM, 0, 256 );
+
+    for( int i = 0; i < query.rows; i++ )
+	BOOST_CHECK_EQUAL( stereo::hammingDistance( query.ptr<uchar>(i), train.ptr<uchar>(i), query.cols ),
+		(unsigned int)cv::norm( query.row(i), train.row(i), cv::NORM_HAMMING ) );
+
+    // the multi-index hashing has to give the same distances as brute force
+    std::vector<std::vector<cv::DMatch> > bruteForce, multiIndex;
+    stereo::HammingMatcher( stereo::HammingMatcher::BRUTE_FORCE ).knnMatch( query, train, bruteForce, 2 );
+    stereo::HammingMatcher( stereo::HammingMatcher::MULTI_INDEX_HASHING ).knnMatch( query, train, multiIndex, 2 );
+
+    BOOST_REQUIRE_EQUAL( bruteForce.size(), multiIndex.size() );
+    for( size_t i = 0; i < bruteForce.size(); i++ )
+    {
+	BOOST_REQUIRE_EQUAL( bruteForce[i].size(), multiIndex[i].size() );
+	for( size_t k = 0; k < bruteForce[i].size(); k++ )
+	    BOOST_CHECK_EQUAL( bruteForce[i][k].distance, multiIndex[i][k].distance );
+    }
+    BOOST_TEST_MESSAGE( "hamming implementation: " << stereo::getHammingImplementation() );
+}
+#endif
+
+#ifdef HAS_SPARSE_STEREO
+/** compare the two best matches of a query with the ones of cv::BFMatcher */
+void checkKnnMatches( const stereo::KnnMatches& matches, const std::vector<std::vector<cv::DMatch> >& reference )
+{
+    BOOST_REQUIRE_EQUAL( matches.size(), (int)reference.size() );
+    for( size_t i = 0; i < reference.size(); i++ )
+    {
+	BOOST_REQUIRE_EQUAL( matches.getCount( i ), (int)reference[i].size() );
+	for( size_t k = 0; k < reference[i].size(); k++ )
+	    BOOST_CHECK_CLOSE( matches.getDistance( i, k ), reference[i][k].distance, 1e-3 );
+	// binary descriptors often have the same distance to several train
+	// descriptors, so only compare the index of a unique best match
+	if( reference[i].size() < 2 || reference[i][0].distance < reference[i][1].distance )
+	    BOOST_CHECK_EQUAL( matches.getIndex( i, 0 ), reference[i][0].trainIdx );
+    }
+}
+
+BOOST_AUTO_TEST_CASE( brute_force_matcher_test ) 
+{
+    cv::RNG rng( 42 );
+    cv::Mat float1( 200, 64, CV_32F ), float2( 301, 64, CV_32F );
+    rng.fill( float1, cv::RNG::UNIFORM, -1.0, 1.0 );
+    rng.fill( float2, cv::RNG::UNIFORM, -1.0, 1.0 );
+    cv::Mat binary1( 200, 32, CV_8U ), binary2( 301, 32, CV_8U );
+    rng.fill( binary1, cv::RNG::UNIFORM, 0, 256 );
+    rng.fill( binary2, cv::RNG::UNIFORM, 0, 256 );
+
+    stereo::ThreadPool pool( 4 );
+    stereo::BruteForceMatcher matcher;
+    stereo::KnnMatches matches12, matches21;
+    std::vector<std::vector<cv::DMatch> > reference12, reference21;
+
+    // both directions of the float descriptors, with and without the pool
+    cv::BFMatcher l2( cv::NORM_L2 );
+    l2.knnMatch( float1, float2, reference12, 2 );
+    l2.knnMatch( float2, float1, reference21, 2 );
+    matcher.knnMatch( float1, float2, matches12, matches21, &pool );
+    checkKnnMatches( matches12, reference12 );
+    checkKnnMatches( matches21, reference21 );
+    matcher.knnMatch( float1, float2, matches12, matches21 );
+    checkKnnMatches( matches12, reference12 );
+    checkKnnMatches( matches21, reference21 );
+
+    cv::BFMatcher hamming( cv::NORM_HAMMING );
+    hamming.knnMatch( binary1, binary2, reference12, 2 );
+    hamming.knnMatch( binary2, binary1, reference21, 2 );
+    matcher.knnMatch( binary1, binary2, matches12, matches21, &pool );
+    checkKnnMatches( matches12, reference12 );
+    checkKnnMatches( matches21, reference21 );
+    BOOST_TEST_MESSAGE( "l2 implementation: " << stereo::BruteForceMatcher::getImplementation() );
+}
+#endif
+
+#ifdef HAS_SPARSE_STEREO
+BOOST_AUTO_TEST_CASE( descriptor_index_cache_test ) 
+{
+    cv::RNG rng( 42 );
+    cv::Mat frames[3];
+    for( int i = 0; i < 3; i++ )
+    {
+	frames[i].create( 100, 64, CV_32F );
+	rng.fill( frames[i], cv::RNG::UNIFORM, -1.0, 1.0 );
+    }
+    const base::Time times[3] = { base::Time::fromSeconds( 1 ), base::Time::fromSeconds( 2 ), base::Time::fromSeconds( 3 ) };
+
+    stereo::DescriptorIndexCache cache( 2 );
+    cv::Ptr<cv::DescriptorMatcher> prototype = cv::DescriptorMatcher::create( "BruteForce" );
+
+    // the frames of two consecutive matching calls, the second call reuses
+    // the current frame of the first one
+    cv::Ptr<cv::DescriptorMatcher> matcher0 = cache.get( prototype, times[0], frames[0] );
+    cache.get( prototype, times[1], frames[1] );
+    BOOST_CHECK( cache.get( prototype, times[0], frames[0] ) == matcher0 );
+    BOOST_CHECK_EQUAL( cache.getHits(), 1 );
+    BOOST_CHECK_EQUAL( cache.getMisses(), 2 );
+    BOOST_CHECK_EQUAL( cache.getEvictions(), 0 );
+
+    // the least recently used frame is evicted
+    cache.get( prototype, times[2], frames[2] );
+    BOOST_CHECK_EQUAL( cache.getEvictions(), 1 );
+    BOOST_CHECK_EQUAL( cache.size(), 2 );
+    BOOST_CHECK( cache.get( prototype, times[0], frames[0] ) == matcher0 );
+    cache.get( prototype, times[1], frames[1] );
+    BOOST_CHECK_EQUAL( cache.getHits(), 2 );
+    BOOST_CHECK_EQUAL( cache.getMisses(), 4 );
+    BOOST_CHECK_EQUAL( cache.getEvictions(), 2 );
+
+    // a changed frame with the same time, and a copy of a cached frame
+    cv::Mat changed = frames[1].clone();
+    changed.at<float>( 0, 0 ) += 1.0;
+    cache.get( prototype, times[1], changed );
+    BOOST_CHECK_EQUAL( cache.getMisses(), 5 );
+    cache.get( prototype, times[1], changed.clone() );
+    BOOST_CHECK_EQUAL( cache.getHits(), 3 );
+
+    // the matcher of a hit is trained with the descriptors of the frame
+    std::vector<cv::DMatch> matches;
+    matcher0->match( frames[0], matches );
+    BOOST_REQUIRE_EQUAL( matches.size(), (size_t)frames[0].rows );
+    for( size_t i = 0; i < matches.size(); i++ )
+	BOOST_CHECK_EQUAL( matches[i].trainIdx, (int)i );
+}
+#endif
+
+#ifdef HAS_SPARSE_STEREO
+/** random binary descriptors, where the first half of the rows of each
+ * frame are noisy copies of the rows of the frame before */
+void createBinaryFrames( cv::RNG& rng, cv::Mat *frames, int numFrames )
+{
+    for( int f = 0; f < numFrames; f++ )
+    {
+	frames[f].create( 300, 32, CV_8U );
+	rng.fill( frames[f], cv::RNG::UNIFORM, 0, 256 );
+	for( int i = 0; f > 0 && i < frames[f].rows / 2; i++ )
+	{
+	    frames[f - 1].row( i ).copyTo( frames[f].row( i ) );
+	    for( int b = 0; b < 8; b++ )
+		frames[f].at<uchar>( i, rng.uniform( 0, 32 ) ) ^= 1 << rng.uniform( 0, 8 );
+	}
+    }
+}
+
+bool equalMatches( const std::vector<cv::DMatch>& a, const std::vector<cv::DMatch>& b )
+{
+    if( a.size() != b.size() )
+	return false;
+    for( size_t i = 0; i < a.size(); i++ )
+    {
+	if( a[i].queryIdx != b[i].queryIdx || a[i].trainIdx != b[i].trainIdx || a[i].distance != b[i].distance )
+	    return false;
+    }
+    return true;
+}
+
+BOOST_AUTO_TEST_CASE( cross_check_matching_test ) 
+{
+    cv::RNG rng( 42 );
+    cv::Mat frames[3];
+    createBinaryFrames( rng, frames, 3 );
+    const base::Time times[3] = { base::Time::fromSeconds( 1 ), base::Time::fromSeconds( 2 ), base::Time::fromSeconds( 3 ) };
+
+    stereo::FeatureConfiguration config;
+    config.descriptorType = stereo::DESCRIPTOR_ORB;
+    config.knn = 2;
+    stereo::StereoFeatures features;
+
+    // the reference from the exhaustive matcher
+    config.bruteForceMatchLimit = 100000000;
+    features.setConfiguration( config );
+    std::vector<cv::DMatch> reference[2];
+    features.crossCheckMatching( frames[0], frames[1], reference[0], config.knn, 1.5 );
+    features.crossCheckMatching( frames[1], frames[2], reference[1], config.knn, 1.5 );
+    BOOST_CHECK_EQUAL( reference[0].size(), frames[0].rows / 2 );
+
+    // the hamming matcher with and without multi-index hashing, which is
+    // used even with the brute force limit, through the index cache
+    for( int mih = 0; mih < 2; mih++ )
+    {
+	config.multiIndexHashing = mih;
+	config.bruteForceMatchLimit = mih ? 100000000 : 0;
+	features.setConfiguration( config );
+
+	const size_t hits = features.getIndexCacheHits(), misses = features.getIndexCacheMisses();
+	std::vector<cv::DMatch> matches;
+	features.crossCheckMatching( frames[0], times[0], frames[1], times[1], matches, config.knn, 1.5 );
+	BOOST_CHECK( equalMatches( matches, reference[0] ) );
+	BOOST_CHECK_EQUAL( features.getIndexCacheHits() - hits, 0 );
+	BOOST_CHECK_EQUAL( features.getIndexCacheMisses() - misses, 2 );
+
+	// the next call reuses the index of the current frame
+	features.crossCheckMatching( frames[1], times[1], frames[2], times[2], matches, config.knn, 1.5 );
+	BOOST_CHECK( equalMatches( matches, reference[1] ) );
+	BOOST_CHECK_EQUAL( features.getIndexCacheHits() - hits, 1 );
+	BOOST_CHECK_EQUAL( features.getIndexCacheMisses() - misses, 3 );
+    }
+}
+#endif
+
+#ifdef HAS_SPARSE_STEREO
+/** keypoints on a grid of 10x5 points with a spacing of 50 pixels, and
+ * random float descriptors */
+void createGridKeypoints( cv::RNG& rng, std::vector<cv::KeyPoint>& keypoints, cv::Mat& descriptors )
+{
+    keypoints.clear();
+    for( int i = 0; i < 50; i++ )
+	keypoints.push_back( cv::KeyPoint( 100 + (i % 10) * 50, 20 + (i / 10) * 60, 10 ) );
+    descriptors.create( keypoints.size(), 64, CV_32F );
+    rng.fill( descriptors, cv::RNG::UNIFORM, -1.0, 1.0 );
+}
+
+/** noisy copies of the descriptors */
+cv::Mat perturbDescriptors( cv::RNG& rng, const cv::Mat& descriptors )
+{
+    cv::Mat noise( descriptors.size(), CV_32F ), result;
+    rng.fill( noise, cv::RNG::NORMAL, 0, 0.01 );
+    cv::add( descriptors, noise, result );
+    return result;
+}
+
+BOOST_AUTO_TEST_CASE( epipolar_matcher_test ) 
+{
+    cv::RNG rng( 42 );
+    std::vector<cv::KeyPoint> left, right;
+    cv::Mat leftDescriptors;
+    createGridKeypoints( rng, left, leftDescriptors );
+
+    // the right keypoints at a disparity of 20, followed by exact copies of
+    // the left descriptors between the rows, which are off the epipolar line
+    right = left;
+    for( size_t i = 0; i < left.size(); i++ )
+	right[i].pt.x -= 20;
+    for( size_t i = 0; i < left.size(); i++ )
+	right.push_back( cv::KeyPoint( left[i].pt.x - 20, left[i].pt.y + 30, 10 ) );
+    cv::Mat rightDescriptors = perturbDescriptors( rng, leftDescriptors );
+    rightDescriptors.push_back( leftDescriptors );
+
+    stereo::EpipolarMatcher matcher;
+    matcher.setMaxYDeviation( 3 );
+    std::vector<cv::DMatch> matches;
+    matcher.match( left, leftDescriptors, right, rightDescriptors, matches, 1 );
+    BOOST_REQUIRE_EQUAL( matches.size(), left.size() );
+    for( size_t i = 0; i < matches.size(); i++ )
+	BOOST_CHECK_EQUAL( matches[i].queryIdx, matches[i].trainIdx );
+
+    // with the ratio test, the left keypoints of the first column and the
+    // right keypoints of the last column only have a single candidate, and
+    // are rejected like in the knn matchers
+    matcher.match( left, leftDescriptors, right, rightDescriptors, matches, 2, 1.6 );
+    BOOST_CHECK_EQUAL( matches.size(), left.size() - 10 );
+    for( size_t i = 0; i < matches.size(); i++ )
+    {
+	BOOST_CHECK_EQUAL( matches[i].queryIdx, matches[i].trainIdx );
+	BOOST_CHECK( matches[i].queryIdx % 10 != 0 && matches[i].queryIdx % 10 != 9 );
+    }
+
+    // a disparity range without the true disparity gives no matches
+    matcher.setDisparityRange( 30, 100 );
+    matcher.match( left, leftDescriptors, right, rightDescriptors, matches, 1 );
+    for( size_t i = 0; i < matches.size(); i++ )
+	BOOST_CHECK( matches[i].queryIdx != matches[i].trainIdx );
+}
+
+BOOST_AUTO_TEST_CASE( window_matcher_test ) 
+{
+    cv::RNG rng( 42 );
+    std::vector<cv::KeyPoint> train;
+    cv::Mat trainDescriptors;
+    createGridKeypoints( rng, train, trainDescriptors );
+
+    // the queries are predicted 5 pixels off, and their exact copies in the
+    // train set are far away from the predictions
+    std::vector<cv::Point2f> predicted;
+    for( size_t i = 0; i < train.size(); i++ )
+	predicted.push_back( train[i].pt + cv::Point2f( 3, 4 ) );
+    for( size_t i = 0; i < predicted.size(); i++ )
+	train.push_back( cv::KeyPoint( train[i].pt.x, train[i].pt.y + 1000, 10 ) );
+    cv::Mat queryDescriptors = perturbDescriptors( rng, trainDescriptors );
+    trainDescriptors.push_back( queryDescriptors );
+    predicted[7] = cv::Point2f( NAN, NAN );
+
+    stereo::WindowMatcher matcher;
+    matcher.setRadius( 20 );
+    std::vector<cv::DMatch> matches;
+    matcher.match( predicted, queryDescriptors, train, trainDescriptors, matches, 1 );
+    BOOST_CHECK_EQUAL( matches.size(), predicted.size() - 1 );
+    for( size_t i = 0; i < matches.size(); i++ )
+    {
+	BOOST_CHECK_EQUAL( matches[i].queryIdx, matches[i].trainIdx );
+	BOOST_CHECK( matches[i].queryIdx != 7 );
+    }
+
+    // a single candidate fails the ratio test, with a larger window there
+    // are the neighbours of the grid as well
+    matcher.match( predicted, queryDescriptors, train, trainDescriptors, matches, 2, 1.6 );
+    BOOST_CHECK( matches.empty() );
+    matcher.setRadius( 60 );
+    matcher.match( predicted, queryDescriptors, train, trainDescriptors, matches, 2, 1.6 );
+    BOOST_CHECK_EQUAL( matches.size(), predicted.size() - 1 );
+    for( size_t i = 0; i < matches.size(); i++ )
+	BOOST_CHECK_EQUAL( matches[i].queryIdx, matches[i].trainIdx );
+}
+
+/** makes the disparity prediction of the dense guided matching accessible */
+class GuidedStereoFeatures : public stereo::StereoFeatures
+{
+public:
+    using stereo::StereoFeatures::predictDisparities;
+};
+
+BOOST_AUTO_TEST_CASE( guided_matching_test ) 
+{
+    // fx * tx = 20000, so a distance of 1000 is a disparity of 20
+    frame_helper::StereoCalibration calib;
+    calib.camLeft.fx = 200.0;
+    calib.extrinsic.tx = 100;
+
+    // the left half at 1000, the right half at 500, and the top rows
+    // without a distance
+    base::samples::DistanceImage distance;
+    distance.width = 200;
+    distance.height = 100;
+    distance.data.resize( distance.width * distance.height );
+    for( size_t y = 0; y < distance.height; y++ )
+    {
+	for( size_t x = 0; x < distance.width; x++ )
+	    distance.data[y * distance.width + x] = y < 20 ? 
+		std::numeric_limits<float>::quiet_NaN() : 
+		x < 100 ? 1000.0 : 500.0;
+    }
+
+    GuidedStereoFeatures features;
+    features.setCalibration( calib );
+    features.setDistanceImages( &distance, NULL );
+
+    // the last keypoint lies on the depth discontinuity
+    std::vector<cv::KeyPoint> left;
+    left.push_back( cv::KeyPoint( 50.5, 50.5, 1 ) );
+    left.push_back( cv::KeyPoint( 150.5, 60.5, 1 ) );
+    left.push_back( cv::KeyPoint( 50.5, 10.5, 1 ) );
+    left.push_back( cv::KeyPoint( 99.5, 90.5, 1 ) );
+    std::vector<float> disparities;
+    features.predictDisparities( left, disparities );
+    BOOST_REQUIRE_EQUAL( disparities.size(), left.size() );
+    BOOST_CHECK_CLOSE( disparities[0], 20.0, 1e-3 );
+    BOOST_CHECK_CLOSE( disparities[1], 40.0, 1e-3 );
+    BOOST_CHECK( std::isnan( disparities[2] ) );
+    BOOST_CHECK( std::isnan( disparities[3] ) );
+
+    // right keypoints on the epipolar lines, inside and outside of the
+    // search radius around the predicted disparities
+    const float rightPoints[][2] = { 
+	{ 31.5, 50.5 }, { 25.5, 50.5 },
+	{ 112.0, 60.5 }, { 140.5, 60.5 },
+	{ 10.5, 10.5 }, { 45.5, 10.5 }, { 60.5, 10.5 },
+	{ 30.5, 80.5 } };
+    std::vector<cv::KeyPoint> right;
+    for( size_t i = 0; i < sizeof( rightPoints ) / sizeof( rightPoints[0] ); i++ )
+	right.push_back( cv::KeyPoint( rightPoints[i][0], rightPoints[i][1], 1 ) );
+
+    stereo::EpipolarMatcher matcher;
+    matcher.setMaxYDeviation( 2 );
+    matcher.setSearchRadius( 3 );
+    matcher.selectCandidates( left, right, &disparities );
+
+    // the keypoints without a prediction search the whole band with a
+    // positive disparity
+    const float expected[] = { 31.5, 112.0, 10.5, 45.5 };
+    BOOST_REQUIRE_EQUAL( right.size(), sizeof( expected ) / sizeof( expected[0] ) );
+    for( size_t i = 0; i < right.size(); i++ )
+	BOOST_CHECK_EQUAL( right[i].pt.x, expected[i] );
+}
+
+/** makes the tracking state of the tracking mode accessible */
+class TrackingStereoFeatures : public stereo::StereoFeatures
+{
+public:
+    using stereo::StereoFeatures::trackFeatures;
+    using stereo::StereoFeatures::trackingLeftImage;
+    using stereo::StereoFeatures::trackingRightImage;
+    using stereo::StereoFeatures::trackedLeft;
+    using stereo::StereoFeatures::trackedRight;
+};
+
+/** blurred noise, which Lucas-Kanade can track everywhere */
+cv::Mat createTexture( cv::RNG& rng, cv::Size size )
+{
+    cv::Mat texture( size, CV_8U );
+    rng.fill( texture, cv::RNG::UNIFORM, 0, 256 );
+    cv::GaussianBlur( texture, texture, cv::Size( 5, 5 ), 1.5 );
+    return texture;
+}
+
+cv::Mat shiftImage( const cv::Mat& image, double dx )
+{
+    cv::Mat shifted;
+    const cv::Mat transformation = (cv::Mat_<double>(2,3) << 1, 0, dx, 0, 1, 0);
+    cv::warpAffine( image, shifted, transformation, image.size() );
+    return shifted;
+}
+
+BOOST_AUTO_TEST_CASE( tracking_test ) 
+{
+    // a disparity of 10 in both pairs, and the scene moves 3 pixels to the
+    // right between the pairs
+    cv::RNG rng( 42 );
+    const cv::Mat prevLeft = createTexture( rng, cv::Size( 320, 240 ) );
+    const cv::Mat prevRight = shiftImage( prevLeft, -10 );
+    cv::Mat nextLeft = shiftImage( prevLeft, 3 );
+    const cv::Mat nextRight = shiftImage( prevRight, 3 );
+
+    // the surroundings of the last track are occluded in the next left image
+    const cv::Rect occluded( 205, 25, 100, 100 );
+    createTexture( rng, occluded.size() ).copyTo( nextLeft( occluded ) );
+
+    stereo::FeatureConfiguration config;
+    config.tracking = true;
+    config.trackingPyramidLevels = 1;
+    TrackingStereoFeatures features;
+    features.setConfiguration( config );
+
+    const cv::Point2f points[] = { 
+	cv::Point2f( 80, 160 ), cv::Point2f( 130, 180 ), cv::Point2f( 100, 100 ), cv::Point2f( 255, 75 ) };
+    const size_t numPoints = sizeof( points ) / sizeof( points[0] );
+    for( size_t i = 0; i < numPoints; i++ )
+    {
+	features.trackedLeft.keypoints.push_back( cv::KeyPoint( points[i], 7, -1, 0, 0, i ) );
+	features.trackedRight.keypoints.push_back( cv::KeyPoint( points[i] - cv::Point2f( 10, 0 ), 7, -1, 0, 0, i ) );
+    }
+    features.trackedLeft.descriptors = cv::Mat::zeros( numPoints, 32, CV_8U );
+    features.trackedRight.descriptors = cv::Mat::zeros( numPoints, 32, CV_8U );
+    features.trackingLeftImage = prevLeft;
+    features.trackingRightImage = prevRight;
+
+    // the occluded track fails the forward-backward check, the others keep
+    // their ids
+    features.trackFeatures( nextLeft, nextRight );
+    BOOST_REQUIRE_EQUAL( features.trackedLeft.keypoints.size(), numPoints - 1 );
+    BOOST_REQUIRE_EQUAL( features.trackedRight.keypoints.size(), numPoints - 1 );
+    for( size_t i = 0; i < numPoints - 1; i++ )
+    {
+	const cv::KeyPoint &left( features.trackedLeft.keypoints[i] ), &right( features.trackedRight.keypoints[i] );
+	BOOST_CHECK_EQUAL( left.class_id, (int)i );
+	BOOST_CHECK_EQUAL( right.class_id, (int)i );
+	BOOST_CHECK_SMALL( cv::norm( left.pt - ( points[i] + cv::Point2f( 3, 0 ) ) ), 0.2 );
+	BOOST_CHECK_SMALL( cv::norm( right.pt - ( points[i] + cv::Point2f( -7, 0 ) ) ), 0.2 );
+    }
+}
+#endif
+
+#ifdef HAS_SPARSE_STEREO
+BOOST_AUTO_TEST_CASE( parallel_ransac_test ) 
+{
+    // point pairs with a known isometry, every second pair is an outlier
+    cv::RNG rng( 42 );
+    Eigen::Affine3d transform( Eigen::AngleAxisd( 0.3, Eigen::Vector3d( 1, 2, 3 ).normalized() ) );
+    transform.translation() = Eigen::Vector3d( 1, 2, 3 );
+    std::vector<Eigen::Vector3d> x, p;
+    for( int i = 0; i < 400; i++ )
+    {
+	Eigen::Vector3d v( rng.uniform( -5.0, 5.0 ), rng.uniform( -5.0, 5.0 ), rng.uniform( 5.0, 15.0 ) );
+	p.push_back( v );
+	if( i % 2 )
+	    x.push_back( transform * v + Eigen::Vector3d( rng.gaussian( 0.01 ), rng.gaussian( 0.01 ), rng.gaussian( 0.01 ) ) );
+	else
+	    x.push_back( Eigen::Vector3d( rng.uniform( -5.0, 5.0 ), rng.uniform( -5.0, 5.0 ), rng.uniform( 5.0, 15.0 ) ) );
+    }
+
+    stereo::ransac::FitTransform fit( x, p, 0.1 );
+    stereo::ThreadPool pool( 4 );
+    for( size_t threads = 1; threads <= 8; threads *= 2 )
+    {
+	// the result only depends on the seed and the number of threads
+	Eigen::Affine3d model1, model2;
+	stereo::ransac::vector_size_t inliers1, inliers2;
+	BOOST_REQUIRE( stereo::ransac::ransacParallelModel( fit, 3, 0.1, model1, inliers1, pool, threads, 42, 1000 ) );
+	BOOST_REQUIRE( stereo::ransac::ransacParallelModel( fit, 3, 0.1, model2, inliers2, pool, threads, 42, 1000 ) );
+	BOOST_CHECK( inliers1 == inliers2 );
+	BOOST_CHECK( model1.matrix() == model2.matrix() );
+
+	BOOST_CHECK_GE( inliers1.size(), 190 );
+	BOOST_CHECK_SMALL( ( model1.matrix() - transform.matrix() ).norm(), 0.2 );
+    }
+}
+#endif
+
+#ifdef HAS_SPARSE_STEREO
+BOOST_AUTO_TEST_CASE( pairs_transform_test ) 
+{
+    cv::RNG rng( 42 );
+    for( int i = 0; i < 100; i++ )
+    {
+	const Eigen::Vector3d axis( rng.uniform( -1.0, 1.0 ), rng.uniform( -1.0, 1.0 ), rng.uniform( -1.0, 1.0 ) );
+	Eigen::Affine3d transform( Eigen::AngleAxisd( rng.uniform( -3.0, 3.0 ), axis.normalized() ) );
+	transform.translation() = Eigen::Vector3d( rng.uniform( -5.0, 5.0 ), rng.uniform( -5.0, 5.0 ), rng.uniform( -5.0, 5.0 ) );
+
+	// the minimal sample of the ransac, and a larger set of points
+	std::vector<Eigen::Vector3d> x, p;
+	for( int j = 0; j < 10; j++ )
+	{
+	    const Eigen::Vector3d v( rng.uniform( -5.0, 5.0 ), rng.uniform( -5.0, 5.0 ), rng.uniform( 5.0, 15.0 ) );
+	    p.push_back( v );
+	    x.push_back( transform * v );
+	}
+
+	stereo::ransac::FitTransform fit( x, p, 1e-6 );
+	Eigen::Affine3d model;
+	stereo::ransac::vector_size_t minimal( 3 );
+	for( int j = 0; j < 3; j++ )
+	    minimal[j] = j;
+	BOOST_REQUIRE( fit.fitModel( minimal, model ) );
+	BOOST_CHECK_SMALL( ( model.matrix() - transform.matrix() ).norm(), 1e-6 );
+
+	stereo::ransac::Pairs pairs;
+	for( size_t j = 0; j < x.size(); j++ )
+	    pairs.add( x[j], p[j], 0 );
+	BOOST_CHECK_SMALL( ( pairs.getTransform().matrix() - transform.matrix() ).norm(), 1e-6 );
+    }
+
+    // collinear points don't have a unique rotation, but need to be mapped
+    // onto each other anyway
+    std::vector<Eigen::Vector3d> x, p;
+    for( int j = 0; j < 3; j++ )
+    {
+	p.push_back( Eigen::Vector3d( j, 0, 5 ) );
+	x.push_back( Eigen::Vector3d( 1, j, 5 ) );
+    }
+    stereo::ransac::FitTransform fit( x, p, 1e-6 );
+    Eigen::Affine3d model;
+    stereo::ransac::vector_size_t minimal( 3 );
+    for( int j = 0; j < 3; j++ )
+	minimal[j] = j;
+    BOOST_CHECK( fit.fitModel( minimal, model ) );
+}
+#endif
+
+#ifdef HAS_SPARSE_STEREO
+BOOST_AUTO_TEST_CASE( batch_scoring_test ) 
+{
+    // points around a known isometry with errors of the order of the
+    // threshold, and an odd number of samples for the scalar remainder
+    cv::RNG rng( 42 );
+    Eigen::Affine3d transform( Eigen::AngleAxisd( 0.2, Eigen::Vector3d::UnitY() ) );
+    transform.translation() = Eigen::Vector3d( 0.5, 0, 1 );
+    std::vector<Eigen::Vector3d> x, p;
+    std::vector<float> e1, e2;
+    for( int i = 0; i < 1001; i++ )
+    {
+	const Eigen::Vector3d v( rng.uniform( -5.0, 5.0 ), rng.uniform( -5.0, 5.0 ), rng.uniform( 2.0, 20.0 ) );
+	p.push_back( v );
+	x.push_back( transform * v + Eigen::Vector3d( rng.gaussian( 0.1 ), rng.gaussian( 0.1 ), rng.gaussian( 0.1 ) ) );
+	e1.push_back( x.back().norm() / 70.0 );
+	e2.push_back( v.norm() / 70.0 );
+    }
+
+    const double threshold = 0.1;
+    stereo::ransac::FitTransform fit( x, p, threshold );
+    stereo::ransac::FitTransformUncertain fitUncertain( x, p, e1, e2, threshold );
+    stereo::ransac::vector_mask_t mask, maskUncertain;
+    const size_t count = fit.testSamples( transform, threshold, mask );
+    const size_t countUncertain = fitUncertain.testSamples( transform, threshold, maskUncertain );
+
+    // the batch scoring compares squared distances, so only allow
+    // differences right at the threshold
+    size_t expected = 0, expectedUncertain = 0;
+    for( size_t i = 0; i < x.size(); i++ )
+    {
+	const double dist = fit.testSample( i, transform );
+	const double distUncertain = fitUncertain.testSample( i, transform );
+	if( fabs( dist - threshold ) > 1e-9 )
+	    BOOST_CHECK_EQUAL( (bool)mask[i], dist < threshold );
+	if( fabs( distUncertain - threshold ) > 1e-9 )
+	    BOOST_CHECK_EQUAL( (bool)maskUncertain[i], distUncertain < threshold );
+	expected += mask[i];
+	expectedUncertain += maskUncertain[i];
+    }
+    BOOST_CHECK_EQUAL( count, expected );
+    BOOST_CHECK_EQUAL( countUncertain, expectedUncertain );
+    BOOST_TEST_MESSAGE( "ransac score implementation: " << stereo::ransac::getScoreImplementation() );
+}
+#endif